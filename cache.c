@@ -0,0 +1,647 @@
+/*
+    cache.c - Content addressed cache of compiled images
+
+    Language: C
+
+    Notes:
+        - An entry is keyed by the SHA-256 of the compiler version
+            (PL0_VERSION, bumped whenever the generated code changes), the
+            binary image version, the optimization level and the source
+            bytes. It holds the binary image (<key>.bin) and a
+            dump of its symbol table (<key>.sym, the layout of elfdump -s).
+        - Entries are written to a temporary file in the cache directory and
+            renamed into place, the dump before the image, so readers and
+            other writers (other threads, other processes) only ever see
+            whole entries. A hit copies the image out the same way.
+        - A hit touches the image, so its modification time is the time it
+            was last used. After a run that stored entries, cache_close()
+            removes the least recently used entries until the cache fits its
+            size limit, and temporary files left behind by writers that died.
+        - The size limit is kept in the directory (file "limit") so every
+            tool using the cache evicts the same way. The hit, miss, store
+            and eviction counts of every run are added to the file "stats".
+        - The counters are atomic: pl0batch.c uses the cache from all of its
+            workers.
+        - Used by pl0.c and pl0batch.c (-C).
+*/
+
+#define _DEFAULT_SOURCE
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <stdint.h>
+    #include <time.h>
+    #include <stdatomic.h>
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/file.h>
+    #include <sys/stat.h>
+
+    #include "pl0.h"
+
+// Constants
+    #define CACHE_DEFAULT_LIMIT (64L << 20) // Bytes
+    #define CACHE_STALE_SECONDS 3600 // Age after which a temporary file is garbage
+
+// Structs
+    typedef struct {
+        char name[CACHE_KEY_SIZE + 4]; // Key and extension
+        long bytes;
+        time_t used;
+    } CacheFile;
+
+    typedef struct {
+        uint32_t state[8];
+        uint64_t length; // Bytes hashed so far
+        unsigned char block[64];
+        int blockLength;
+    } Sha256;
+
+// Variables
+    static char cacheDirectory[CACHE_DIRECTORY];
+    static long cacheLimit = 0;
+    static int cacheOpen = 0;
+
+    static atomic_long cacheHits, cacheMisses, cacheStores, cacheEvictions;
+    static atomic_long temporaryCount; // Makes temporary names unique within the process
+
+// SHA-256
+    static const uint32_t shaRounds[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    #define ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+    static void sha_block(Sha256 *sha, const unsigned char *block)
+    {
+        uint32_t w[64];
+
+        for(int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+                (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for(int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = ROTATE(w[i - 15], 7) ^ ROTATE(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTATE(w[i - 2], 17) ^ ROTATE(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+        uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+
+        for(int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (ROTATE(e, 6) ^ ROTATE(e, 11) ^ ROTATE(e, 25)) + ((e & f) ^ (~e & g)) + shaRounds[i] + w[i];
+            uint32_t t2 = (ROTATE(a, 2) ^ ROTATE(a, 13) ^ ROTATE(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        sha->state[0] += a;
+        sha->state[1] += b;
+        sha->state[2] += c;
+        sha->state[3] += d;
+        sha->state[4] += e;
+        sha->state[5] += f;
+        sha->state[6] += g;
+        sha->state[7] += h;
+    }
+
+    static void sha_start(Sha256 *sha)
+    {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+
+        memcpy(sha->state, initial, sizeof(initial));
+        sha->length = 0;
+        sha->blockLength = 0;
+    }
+
+    static void sha_add(Sha256 *sha, const void *data, long length)
+    {
+        const unsigned char *bytes = data;
+
+        sha->length += length;
+
+        while(length > 0)
+        {
+            int take = 64 - sha->blockLength < length ? 64 - sha->blockLength : (int)length;
+
+            memcpy(sha->block + sha->blockLength, bytes, take);
+            sha->blockLength += take;
+            bytes += take;
+            length -= take;
+
+            if(sha->blockLength == 64)
+            {
+                sha_block(sha, sha->block);
+                sha->blockLength = 0;
+            }
+        }
+    }
+
+    /*
+        Finish the hash and write it as 64 hex digits
+    */
+    static void sha_finish(Sha256 *sha, char *hex)
+    {
+        uint64_t bits = sha->length * 8;
+        unsigned char pad = 0x80, zero = 0, length[8];
+
+        sha_add(sha, &pad, 1);
+        while(sha->blockLength != 56)
+        {
+            sha_add(sha, &zero, 1);
+        }
+        for(int i = 0; i < 8; i++)
+        {
+            length[i] = bits >> (56 - 8 * i);
+        }
+        sha_add(sha, length, 8);
+
+        for(int i = 0; i < 8; i++)
+        {
+            sprintf(hex + i * 8, "%08x", sha->state[i]);
+        }
+    }
+
+// Keys
+    /*
+        Key of a compile: everything the image depends on. key must hold
+            CACHE_KEY_SIZE characters.
+    */
+    void cache_key(char *source, long length, int optimizeLevel, char *key)
+    {
+        char header[128];
+        int headerLength = snprintf(header, sizeof(header), "%s|image %d|-O%d|",
+            PL0_VERSION, ELF_VERSION, optimizeLevel);
+
+        Sha256 sha;
+        sha_start(&sha);
+        sha_add(&sha, header, headerLength);
+        sha_add(&sha, source, length);
+        sha_finish(&sha, key);
+    }
+
+// Files
+    static void entry_path(char *path, char *key, char *extension)
+    {
+        snprintf(path, CACHE_PATH, "%s/%s.%s", cacheDirectory, key, extension);
+    }
+
+    /*
+        A temporary name in the directory of path, unique across threads and
+            processes
+    */
+    static void temporary_path(char *temporary, char *path)
+    {
+        char *slash = strrchr(path, '/');
+        int directoryLength = slash ? slash - path + 1 : 0;
+
+        snprintf(temporary, CACHE_PATH, "%.*s.cache.%ld.%ld.tmp", directoryLength, path,
+            (long)getpid(), atomic_fetch_add(&temporaryCount, 1));
+    }
+
+    /*
+        Copy a file to a new temporary file
+
+        Returns 0 on success, otherwise removes the copy and returns -1
+    */
+    static int copy_file(char *source, char *temporary)
+    {
+        int in = open(source, O_RDONLY);
+        if(in < 0)
+        {
+            return -1;
+        }
+
+        int out = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(out < 0)
+        {
+            close(in);
+            return -1;
+        }
+
+        char buffer[65536];
+        ssize_t count;
+        int failed = 0;
+
+        while((count = read(in, buffer, sizeof(buffer))) > 0)
+        {
+            if(write(out, buffer, count) != count)
+            {
+                failed = 1;
+                break;
+            }
+        }
+
+        failed |= count < 0;
+        failed |= close(out) != 0;
+        close(in);
+
+        if(failed)
+        {
+            unlink(temporary);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /*
+        Copy a file to destination through a temporary file and a rename
+
+        Returns 0 on success, -1 otherwise
+    */
+    static int copy_atomically(char *source, char *destination)
+    {
+        char temporary[CACHE_PATH];
+        temporary_path(temporary, destination);
+
+        if(copy_file(source, temporary))
+        {
+            return -1;
+        }
+
+        if(rename(temporary, destination))
+        {
+            unlink(temporary);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /*
+        Write the symbol table of an image as elfdump -s prints it
+    */
+    static int write_symbol_dump(char *path, ElfImage *image)
+    {
+        char temporary[CACHE_PATH];
+        temporary_path(temporary, path);
+
+        FILE *file = fopen(temporary, "w");
+        if(!file)
+        {
+            return -1;
+        }
+
+        fprintf(file, "%4s | %11s | %5s | %5s | %7s | %4s\n", "Kind", "Name", "Value", "Level", "Address", "Mark");
+        fprintf(file, "---------------------------------------------------\n");
+
+        for(int i = 0; i < image->symbolCount; i++)
+        {
+            ElfSymbol *symbol = &image->symbols[i];
+            fprintf(file, "%4d | %11s | %5d | %5d | %7d | %4d\n",
+                symbol->kind, symbol->name, symbol->val, symbol->level, symbol->addr, symbol->mark);
+        }
+
+        if(fclose(file) || rename(temporary, path))
+        {
+            unlink(temporary);
+            return -1;
+        }
+
+        return 0;
+    }
+
+// Cache
+    /*
+        Use the cache in directory, creating it if needed. A maxBytes above
+            0 sets the size limit of the cache, otherwise the limit it was
+            created with is kept.
+
+        Returns 0 on success, otherwise prints the problem and returns -1
+    */
+    int cache_open(char *directory, long maxBytes)
+    {
+        if(strlen(directory) >= CACHE_DIRECTORY)
+        {
+            fprintf(stderr, "Error: Cache directory name is too long\n");
+            return -1;
+        }
+
+        mkdir(directory, 0755);
+
+        struct stat info;
+        if(stat(directory, &info) || !S_ISDIR(info.st_mode))
+        {
+            fprintf(stderr, "Error: Failed to open the cache directory %s\n", directory);
+            return -1;
+        }
+
+        strcpy(cacheDirectory, directory);
+
+        char path[CACHE_PATH];
+        snprintf(path, CACHE_PATH, "%s/limit", cacheDirectory);
+
+        if(maxBytes > 0)
+        {
+            FILE *file = fopen(path, "w");
+            if(file)
+            {
+                fprintf(file, "%ld\n", maxBytes);
+                fclose(file);
+            }
+            cacheLimit = maxBytes;
+        }
+        else
+        {
+            FILE *file = fopen(path, "r");
+            if(!file || fscanf(file, "%ld", &cacheLimit) != 1 || cacheLimit <= 0)
+            {
+                cacheLimit = CACHE_DEFAULT_LIMIT;
+            }
+            if(file)
+            {
+                fclose(file);
+            }
+        }
+
+        cacheOpen = 1;
+        return 0;
+    }
+
+    /*
+        Look a key up. Stores the path of its image in imagePath (CACHE_PATH
+            characters) either way, and marks it as just used on a hit.
+
+        Returns 1 on a hit, 0 on a miss
+    */
+    int cache_lookup(char *key, char *imagePath)
+    {
+        entry_path(imagePath, key, "bin");
+
+        if(!cacheOpen || utimensat(AT_FDCWD, imagePath, NULL, 0))
+        {
+            atomic_fetch_add(&cacheMisses, 1);
+            return 0;
+        }
+
+        atomic_fetch_add(&cacheHits, 1);
+        return 1;
+    }
+
+    /*
+        Copy the image of a key to imageFileName
+
+        Returns its number of instructions, or -1 on a miss
+    */
+    int cache_fetch(char *key, char *imageFileName)
+    {
+        char path[CACHE_PATH];
+
+        if(!cache_lookup(key, path))
+        {
+            return -1;
+        }
+
+        // Entries are only ever replaced whole, so the entry itself can be
+        // mapped while the copy is made
+        ElfImage image;
+        int codeCount = -1;
+
+        if(elf_open(path, &image) == 0)
+        {
+            if(copy_atomically(path, imageFileName) == 0)
+            {
+                codeCount = image.codeCount;
+            }
+            elf_close(&image);
+        }
+
+        // Evicted between the lookup and the copy: count it as a miss
+        if(codeCount < 0)
+        {
+            atomic_fetch_sub(&cacheHits, 1);
+            atomic_fetch_add(&cacheMisses, 1);
+        }
+
+        return codeCount;
+    }
+
+    /*
+        Add the image in imageFileName under key, with its symbol dump
+
+        Returns 0 on success, -1 otherwise
+    */
+    int cache_store(char *key, char *imageFileName)
+    {
+        if(!cacheOpen)
+        {
+            return -1;
+        }
+
+        // Work on a private copy: the image may be rewritten by someone else
+        char path[CACHE_PATH], temporary[CACHE_PATH];
+        entry_path(path, key, "bin");
+        temporary_path(temporary, path);
+
+        if(copy_file(imageFileName, temporary))
+        {
+            return -1;
+        }
+
+        ElfImage image;
+        int failed = elf_open(temporary, &image);
+
+        if(!failed)
+        {
+            char dumpPath[CACHE_PATH];
+            entry_path(dumpPath, key, "sym");
+            failed = write_symbol_dump(dumpPath, &image);
+            elf_close(&image);
+        }
+
+        if(failed || rename(temporary, path))
+        {
+            unlink(temporary);
+            return -1;
+        }
+
+        atomic_fetch_add(&cacheStores, 1);
+        return 0;
+    }
+
+    static int compare_use(const void *a, const void *b)
+    {
+        time_t x = ((const CacheFile *)a)->used, y = ((const CacheFile *)b)->used;
+        return (x > y) - (x < y);
+    }
+
+    /*
+        Remove the least recently used entries until the cache fits its
+            limit. Images are removed before their dumps.
+    */
+    static void evict()
+    {
+        DIR *directory = opendir(cacheDirectory);
+        if(!directory)
+        {
+            return;
+        }
+
+        CacheFile *files = NULL;
+        int fileCount = 0, fileCapacity = 0;
+        long total = 0;
+        time_t now = time(NULL);
+        struct dirent *entry;
+        char path[CACHE_PATH];
+
+        while((entry = readdir(directory)))
+        {
+            char *name = entry->d_name;
+            int length = strlen(name);
+            struct stat info;
+
+            snprintf(path, CACHE_PATH, "%s/%s", cacheDirectory, name);
+
+            if(stat(path, &info) || !S_ISREG(info.st_mode))
+            {
+                continue;
+            }
+
+            // Temporary files of writers that died
+            if(length > 4 && !strcmp(name + length - 4, ".tmp"))
+            {
+                if(now - info.st_mtime > CACHE_STALE_SECONDS)
+                {
+                    unlink(path);
+                }
+                continue;
+            }
+
+            if(length != CACHE_KEY_SIZE - 1 + 4)
+            {
+                continue;
+            }
+
+            total += info.st_size;
+
+            // Dumps are charged to their images
+            if(strcmp(name + length - 4, ".bin"))
+            {
+                continue;
+            }
+
+            if(fileCount == fileCapacity)
+            {
+                fileCapacity = fileCapacity * 2 + 64;
+                files = realloc(files, sizeof(CacheFile) * fileCapacity);
+            }
+
+            strcpy(files[fileCount].name, name);
+            files[fileCount].bytes = info.st_size;
+            files[fileCount].used = info.st_mtime;
+            fileCount++;
+        }
+        closedir(directory);
+
+        qsort(files, fileCount, sizeof(CacheFile), compare_use);
+
+        for(int i = 0; i < fileCount && total > cacheLimit; i++)
+        {
+            struct stat info;
+
+            snprintf(path, CACHE_PATH, "%s/%s", cacheDirectory, files[i].name);
+            unlink(path);
+            total -= files[i].bytes;
+
+            strcpy(path + strlen(path) - 3, "sym");
+            if(stat(path, &info) == 0)
+            {
+                total -= info.st_size;
+            }
+            unlink(path);
+
+            atomic_fetch_add(&cacheEvictions, 1);
+        }
+
+        free(files);
+    }
+
+    /*
+        Evict what no longer fits (only needed when something was stored) and
+            add the counts of this run to the totals of the cache
+    */
+    void cache_close()
+    {
+        if(!cacheOpen)
+        {
+            return;
+        }
+
+        if(atomic_load(&cacheStores) > 0)
+        {
+            evict();
+        }
+
+        // Add this run to the totals, one process at a time
+        char path[CACHE_PATH];
+        snprintf(path, CACHE_PATH, "%s/stats", cacheDirectory);
+
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if(fd >= 0)
+        {
+            flock(fd, LOCK_EX);
+
+            long totals[4] = {0};
+            char text[256] = {0};
+
+            if(read(fd, text, sizeof(text) - 1) > 0)
+            {
+                sscanf(text, "hits %ld misses %ld stores %ld evictions %ld",
+                    &totals[0], &totals[1], &totals[2], &totals[3]);
+            }
+
+            totals[0] += atomic_load(&cacheHits);
+            totals[1] += atomic_load(&cacheMisses);
+            totals[2] += atomic_load(&cacheStores);
+            totals[3] += atomic_load(&cacheEvictions);
+
+            int length = snprintf(text, sizeof(text), "hits %ld misses %ld stores %ld evictions %ld\n",
+                totals[0], totals[1], totals[2], totals[3]);
+
+            if(ftruncate(fd, 0) == 0 && pwrite(fd, text, length, 0) != length)
+            {
+                fprintf(stderr, "Error: Failed to update the cache statistics\n");
+            }
+
+            flock(fd, LOCK_UN);
+            close(fd);
+        }
+
+        cacheOpen = 0;
+    }
+
+    /*
+        Print the hits and misses of this run
+    */
+    void cache_report()
+    {
+        long hits = atomic_load(&cacheHits), misses = atomic_load(&cacheMisses);
+
+        fprintf(stderr, "Cache: %ld hits, %ld misses (%.1f%% hits), %ld stored, %ld evicted\n",
+            hits, misses, hits + misses ? hits * 100.0 / (hits + misses) : 0.0,
+            atomic_load(&cacheStores), atomic_load(&cacheEvictions));
+    }
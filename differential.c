@@ -0,0 +1,186 @@
+/*
+    differential.c - Check an engine of the VM against the stack engine
+
+    Language: C
+
+    Notes:
+        - The -d mode of vm.c and pl0.c. Each engine runs the program in a
+            child process, so a crash or an exit() in one run cannot hide
+            the other, and the two runs are compared by what they print,
+            their exit status and the PAS they leave behind.
+        - It forks and its children exit, so it is kept out of vm.c: the
+            machines themselves never fork, exit or touch the process
+            streams, and a process running machines on many threads does
+            not need this file.
+*/
+
+#define _DEFAULT_SOURCE
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <stdint.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+
+    #include "pl0.h"
+
+// Functions
+    static char *read_all(FILE *file, long *length);
+
+// Differential mode
+    /*
+        Run the loaded program on the stack engine and on engine (the JIT
+            when engine is the stack engine), each in a child process reading
+            the same input (all of stdin, read up front), and compare them.
+            The stack engine's output and errors are passed on, then the
+            verdict is printed to stderr.
+
+        Returns the exit status of the stack engine's run, or 1 when the
+            engines disagree
+    */
+    int run_differential(Vm *vm, int engine)
+    {
+        int engines[2] = {ENGINE_STACK, engine == ENGINE_STACK ? ENGINE_JIT : engine};
+        char *names[] = {"stack engine", "register engine", "JIT"};
+
+        // Keep the input so both runs read the same values. Only a program
+        // that reads waits for the end of the input.
+        FILE *input = tmpfile();
+
+        if(vm_reads_input(vm) && input)
+        {
+            char chunk[4096];
+            size_t count;
+
+            while((count = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+            {
+                fwrite(chunk, 1, count, input);
+            }
+            fflush(input);
+        }
+
+        // Each run leaves the hash of its PAS here
+        uint64_t *hashes = mmap(NULL, sizeof(uint64_t) * 2, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        char *outputs[2], *errors[2];
+        long outputLengths[2], errorLengths[2];
+        int statuses[2];
+
+        for(int k = 0; k < 2; k++)
+        {
+            FILE *output = tmpfile();
+            FILE *error = tmpfile();
+            pid_t child = -1;
+
+            if(input && output && error && hashes != MAP_FAILED)
+            {
+                hashes[k] = 0;
+                lseek(fileno(input), 0, SEEK_SET);
+                fflush(stdout);
+                fflush(stderr);
+
+                child = fork();
+            }
+
+            if(child < 0)
+            {
+                fprintf(stderr, "Error: Cannot set up the differential run");
+                return 1;
+            }
+
+            if(child == 0)
+            {
+                dup2(fileno(input), 0);
+                dup2(fileno(output), 1);
+                dup2(fileno(error), 2);
+                clearerr(stdin);
+
+                vm_set_streams(vm, stdin, stdout);
+                vm_select_engine(vm, engines[k]);
+
+                int status = vm_run(vm, 0);
+
+                if(status)
+                {
+                    fprintf(stderr, "%s", vm_error(vm));
+                    exit(status);
+                }
+
+                hashes[k] = vm_hash(vm);
+                exit(0);
+            }
+
+            waitpid(child, &statuses[k], 0);
+
+            outputs[k] = read_all(output, &outputLengths[k]);
+            errors[k] = read_all(error, &errorLengths[k]);
+            fclose(output);
+            fclose(error);
+        }
+
+        fclose(input);
+
+        // Pass on what the stack engine printed
+        fwrite(outputs[0], 1, outputLengths[0], stdout);
+        fflush(stdout);
+        fwrite(errors[0], 1, errorLengths[0], stderr);
+
+        if(errorLengths[0] > 0 && errors[0][errorLengths[0] - 1] != '\n')
+        {
+            fprintf(stderr, "\n");
+        }
+
+        int sameOutput = outputLengths[0] == outputLengths[1] &&
+            !memcmp(outputs[0], outputs[1], outputLengths[0]);
+        int sameErrors = errorLengths[0] == errorLengths[1] &&
+            !memcmp(errors[0], errors[1], errorLengths[0]);
+        int sameStatus = statuses[0] == statuses[1];
+        int sameMemory = hashes[0] == hashes[1];
+
+        free(outputs[0]);
+        free(outputs[1]);
+        free(errors[0]);
+        free(errors[1]);
+        munmap(hashes, sizeof(uint64_t) * 2);
+
+        if(!(sameOutput && sameErrors && sameStatus && sameMemory))
+        {
+            fprintf(stderr, "Differential: the %s differs from the stack engine in its%s%s%s%s\n",
+                names[engines[1]],
+                sameOutput ? "" : " output",
+                sameErrors ? "" : " errors",
+                sameStatus ? "" : " exit status",
+                sameMemory ? "" : " final PAS");
+            return 1;
+        }
+
+        fprintf(stderr, "Differential: the %s matches the stack engine\n", names[engines[1]]);
+
+        // Finish as the stack engine did
+        if(WIFSIGNALED(statuses[0]))
+        {
+            return 128 + WTERMSIG(statuses[0]);
+        }
+
+        return WEXITSTATUS(statuses[0]);
+    }
+
+// Helpers
+    /*
+        Read a file from its start into memory
+    */
+    static char *read_all(FILE *file, long *length)
+    {
+        fseek(file, 0, SEEK_END);
+        *length = ftell(file);
+        rewind(file);
+
+        char *contents = malloc(*length + 1);
+        *length = fread(contents, 1, *length, file);
+
+        return contents;
+    }
@@ -0,0 +1,246 @@
+/*
+    elf.c - Read and write binary PM/0 executables
+
+    Language: C
+
+    Notes:
+        - The layout is described in pl0.h. Code is stored as fixed width
+            32-bit words so the VM can copy it without any parsing.
+        - Images are opened with mmap, so opening costs the same no matter
+            how large the program is; pages are only touched when loaded.
+        - Used by parsercodegen_complete.c (-b), vm.c and elfdump.c.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+
+    #include "pl0.h"
+
+// Reading
+    /*
+        Returns 1 if the file starts with the binary image magic number
+    */
+    int elf_is_binary(char *fileName)
+    {
+        char magic[4];
+        FILE *file = fopen(fileName, "rb");
+
+        if(!file)
+        {
+            return 0;
+        }
+
+        int isBinary = fread(magic, 1, 4, file) == 4 && !memcmp(magic, ELF_MAGIC, 4);
+
+        fclose(file);
+        return isBinary;
+    }
+
+    /*
+        Map an image into memory and locate its sections
+
+        Returns 0 on success, otherwise prints the problem and returns -1
+    */
+    int elf_open(char *fileName, ElfImage *image)
+    {
+        memset(image, 0, sizeof(ElfImage));
+
+        // Map the whole file
+        int fd = open(fileName, O_RDONLY);
+        if(fd < 0)
+        {
+            fprintf(stderr, "Error: File not found");
+            return -1;
+        }
+
+        struct stat info;
+        if(fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(ElfHeader))
+        {
+            fprintf(stderr, "Error: Binary image is truncated");
+            close(fd);
+            return -1;
+        }
+
+        image->mapSize = info.st_size;
+        image->map = mmap(NULL, image->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if(image->map == MAP_FAILED)
+        {
+            fprintf(stderr, "Error: Failed to map binary image");
+            image->map = NULL;
+            return -1;
+        }
+
+        // Validate the header
+        char *bytes = image->map;
+        ElfHeader *header = image->map;
+
+        if(memcmp(header->magic, ELF_MAGIC, 4))
+        {
+            fprintf(stderr, "Error: Not a binary PM/0 image");
+            elf_close(image);
+            return -1;
+        }
+
+        if(header->version != ELF_VERSION)
+        {
+            fprintf(stderr, "Error: Unsupported binary image version %d", header->version);
+            elf_close(image);
+            return -1;
+        }
+
+        size_t tableEnd = sizeof(ElfHeader) + (size_t)header->sectionCount * sizeof(ElfSection);
+        if(header->sectionCount < 0 || tableEnd > image->mapSize)
+        {
+            fprintf(stderr, "Error: Binary image is truncated");
+            elf_close(image);
+            return -1;
+        }
+
+        // Locate the sections
+        ElfSection *sections = (ElfSection *)(bytes + sizeof(ElfHeader));
+
+        for(int i = 0; i < header->sectionCount; i++)
+        {
+            size_t entrySize;
+
+            switch(sections[i].kind)
+            {
+                case ELF_SECTION_CODE: entrySize = 3 * sizeof(int32_t); break;
+                case ELF_SECTION_SYMBOLS: entrySize = sizeof(ElfSymbol); break;
+                case ELF_SECTION_DEBUG: entrySize = sizeof(int32_t); break;
+                default: continue;
+            }
+
+            if(sections[i].offset < 0 || sections[i].count < 0 ||
+                (size_t)sections[i].offset + entrySize * sections[i].count > image->mapSize)
+            {
+                fprintf(stderr, "Error: Binary image is truncated");
+                elf_close(image);
+                return -1;
+            }
+
+            void *data = bytes + sections[i].offset;
+
+            switch(sections[i].kind)
+            {
+                case ELF_SECTION_CODE:
+                    image->code = data;
+                    image->codeCount = sections[i].count;
+                break;
+                case ELF_SECTION_SYMBOLS:
+                    image->symbols = data;
+                    image->symbolCount = sections[i].count;
+                break;
+                case ELF_SECTION_DEBUG:
+                    image->lines = data;
+                    image->lineCount = sections[i].count;
+                break;
+            }
+        }
+
+        if(!image->code)
+        {
+            fprintf(stderr, "Error: Binary image has no code section");
+            elf_close(image);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /*
+        Unmap an image opened with elf_open
+    */
+    void elf_close(ElfImage *image)
+    {
+        if(image->map)
+        {
+            munmap(image->map, image->mapSize);
+        }
+
+        memset(image, 0, sizeof(ElfImage));
+    }
+
+// Writing
+    /*
+        Write an image with a code section, plus a symbol section when symbols
+            is not NULL and a debug section when lines is not NULL
+
+        Returns 0 on success, otherwise -1
+    */
+    int elf_write(char *fileName, Instruction *code, int codeCount,
+        ElfSymbol *symbols, int symbolCount, int *lines)
+    {
+        FILE *file = fopen(fileName, "wb");
+
+        if(!file)
+        {
+            return -1;
+        }
+
+        // Build the section table
+        ElfHeader header = {ELF_MAGIC, ELF_VERSION, 1, 0};
+        ElfSection sections[3];
+
+        if(symbols)
+        {
+            header.sectionCount++;
+        }
+        if(lines)
+        {
+            header.sectionCount++;
+        }
+
+        int offset = sizeof(ElfHeader) + header.sectionCount * sizeof(ElfSection);
+        int sectionIndex = 0;
+
+        sections[sectionIndex++] = (ElfSection){ELF_SECTION_CODE, offset, codeCount, 0};
+        offset += codeCount * 3 * sizeof(int32_t);
+
+        if(symbols)
+        {
+            sections[sectionIndex++] = (ElfSection){ELF_SECTION_SYMBOLS, offset, symbolCount, 0};
+            offset += symbolCount * sizeof(ElfSymbol);
+        }
+        if(lines)
+        {
+            sections[sectionIndex++] = (ElfSection){ELF_SECTION_DEBUG, offset, codeCount, 0};
+        }
+
+        fwrite(&header, sizeof(ElfHeader), 1, file);
+        fwrite(sections, sizeof(ElfSection), header.sectionCount, file);
+
+        // Write the sections in table order
+        for(int i = 0; i < codeCount; i++)
+        {
+            int32_t words[3] = {code[i].o, code[i].l, code[i].m};
+            fwrite(words, sizeof(int32_t), 3, file);
+        }
+
+        if(symbols)
+        {
+            fwrite(symbols, sizeof(ElfSymbol), symbolCount, file);
+        }
+
+        if(lines)
+        {
+            for(int i = 0; i < codeCount; i++)
+            {
+                int32_t line = lines[i];
+                fwrite(&line, sizeof(int32_t), 1, file);
+            }
+        }
+
+        int failed = ferror(file);
+        return (fclose(file) || failed) ? -1 : 0;
+    }
@@ -0,0 +1,136 @@
+/*
+    Assignment:
+    elfdump.c - Print a binary PM/0 image as text
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -Wall -std=c11 -o elfdump elfdump.c elf.c
+
+    To Execute:
+        ./elfdump [-s] [-g] elf.bin
+
+    where:
+        elf.bin is a binary image written by parsercodegen -b or pl0 -o
+        -s also prints the symbol section
+        -g also prints the debug (source line) section
+
+    Notes:
+        - Without options the output is the text elf format ("OP L M" per
+            line), so ./elfdump elf.bin > elf.txt gives a file vm.c can run.
+*/
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+
+    #include "pl0.h"
+
+// Main
+    int main(int argc, char *argv[])
+    {
+        // Validate command line arguments
+        int printSymbols = 0, printLines = 0;
+        char *inputFileName = NULL;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if(!strcmp(argv[i], "-s"))
+            {
+                printSymbols = 1;
+            }
+            else if(!strcmp(argv[i], "-g"))
+            {
+                printLines = 1;
+            }
+            else if(!inputFileName)
+            {
+                inputFileName = argv[i];
+            }
+            else
+            {
+                inputFileName = NULL;
+                break;
+            }
+        }
+
+        if(!inputFileName)
+        {
+            fprintf(stderr, "Usage: elfdump [-s] [-g] elf.bin\n");
+            exit(1);
+        }
+
+        // Map the image
+        ElfImage image;
+
+        if(elf_open(inputFileName, &image))
+        {
+            exit(1);
+        }
+
+        // Print the code in the text elf format
+        for(int i = 0; i < image.codeCount; i++)
+        {
+            printf("%d %d %d\n",
+                image.code[i * 3],
+                image.code[i * 3 + 1],
+                image.code[i * 3 + 2]
+            );
+        }
+
+        // Print the symbol section
+        if(printSymbols)
+        {
+            printf("\nSymbol Table:\n\n");
+
+            if(!image.symbols)
+            {
+                printf("(none)\n");
+            }
+            else
+            {
+                printf("%4s | %11s | %5s | %5s | %7s | %4s\n",
+                    "Kind", "Name", "Value", "Level", "Address", "Mark"
+                );
+                printf("---------------------------------------------------\n");
+
+                for(int i = 0; i < image.symbolCount; i++)
+                {
+                    printf("%4d | %11s | %5d | %5d | %7d | %4d\n",
+                        image.symbols[i].kind,
+                        image.symbols[i].name,
+                        image.symbols[i].val,
+                        image.symbols[i].level,
+                        image.symbols[i].addr,
+                        image.symbols[i].mark
+                    );
+                }
+            }
+        }
+
+        // Print the debug section
+        if(printLines)
+        {
+            printf("\nLine Table:\n\n");
+
+            if(!image.lines)
+            {
+                printf("(none)\n");
+            }
+            else
+            {
+                printf("%6s %5s\n", "Line", "Src");
+
+                for(int i = 0; i < image.lineCount; i++)
+                {
+                    printf("%6d %5d\n", i, image.lines[i]);
+                }
+            }
+        }
+
+        elf_close(&image);
+        return 0;
+    }
@@ -1,7 +1,10 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
     Assignment :
@@ -9,11 +12,14 @@
     Author : Tal Avital
     Language : C ( only )
     To Compile :
-        gcc - O2 - std = c11 -o lex lex.c
+        gcc - O2 - std = c11 -o lex lex.c phase.c
     To Execute ( on Eustis ):
-        ./lex < input file >
+        ./lex [ -T trace . json ] < input file >
         where :
-            < input file > is the path to the PL /0 source program
+            < input file > is the path to the PL /0 source program , or -
+            to read the program from stdin
+            -T prints the time of every phase and writes them as a Chrome
+            trace ( see phase .c)
     Notes :
         - Implement a lexical analyser for the PL /0 language .
         - The program must detect errors such as
@@ -21,85 +27,62 @@
         - identifiers longer than eleven characters
         - invalid characters .
         - The output format must exactly match the specification .
+        - Regular files are mapped and lexed in place . Pipes and stdin are
+        lexed through a fixed size window , so memory does not grow with
+        the size of the source .
+        - Whitespace , comments , identifiers and numbers are skipped a run
+        at a time with SSE2 / AVX2 / SWAR scanners chosen for the CPU at
+        run time ( force one with - DSCANNER =1 scalar , 2 SWAR , 3 SSE2 ,
+        4 AVX2 ).
         - Tested on Eustis .
     Class : COP 3402 - System Software - Fall 2025
     Instructor : Dr . Jie Lin
     Due Date : Friday , October 3 , 2025 at 11:59 PM ET
 */
 
-#define MAX_WORD 11
-#define MAX_NUMBER 5
+#include "pl0.h"
 
-typedef enum
-{
-    skipsym = 1,
-    identsym,
-    numbersym,
-    plussym,
-    minussym,
-    multsym,
-    slashsym,
-    eqsym,
-    neqsym,
-    lessym,
-    leqsym,
-    gtrsym,
-    geqsym,
-    lparentsym,
-    rparentsym,
-    commasym,
-    semicolonsym,
-    periodsym,
-    becomessym,
-    beginsym,
-    endsym,
-    ifsym,
-    fisym,
-    thensym,
-    whilesym,
-    dosym,
-    callsym,
-    constsym,
-    varsym,
-    procsym,
-    writesym,
-    readsym,
-    elsesym,
-    evensym
-} TokenType;
-
-typedef struct Token
+typedef struct Keyword
 {
     char *lexeme;
     int token;
-} Token;
+} Keyword;
 
-Token reservedWordArr[] = 
+/*
+    Perfect hash of the reserved words: (first + 31 * second + length) % 32,
+    with the characters as unsigned values. Generated once by trying
+    multipliers until all 15 words landed in different slots, so a word is
+    a keyword only if it matches the one entry in its slot.
+*/
+#define KEYWORD_HASH(word, length) \
+    (((unsigned char)(word)[0] + 31u * (unsigned char)(word)[1] + (unsigned)(length)) & 31u)
+
+Keyword keywordTable[32] =
 {
-    {"begin", beginsym},
-    {"end", endsym},
-    {"if", ifsym},
-    {"fi", fisym},
-    {"then", thensym},
-    {"while", whilesym},
-    {"do", dosym},
-    {"call", callsym},
-    {"const", constsym},
-    {"var", varsym},
-    {"procedure", procsym},
-    {"write", writesym},
-    {"read", readsym},
-    {"else", elsesym},
-    {"even", evensym}
+    [2] = {"begin", beginsym},
+    [5] = {"if", ifsym},
+    [6] = {"call", callsym},
+    [7] = {"procedure", procsym},
+    [10] = {"write", writesym},
+    [16] = {"then", thensym},
+    [17] = {"read", readsym},
+    [19] = {"even", evensym},
+    [20] = {"while", whilesym},
+    [23] = {"do", dosym},
+    [24] = {"var", varsym},
+    [25] = {"const", constsym},
+    [26] = {"end", endsym},
+    [29] = {"else", elsesym},
+    [31] = {"fi", fisym}
 };
 
-Token specialSymbolArr[] = 
+Keyword specialSymbolArr[] = 
 {
     {"+", plussym},
     {"-", minussym},
     {"*", multsym},
     {"/", slashsym},
-    {"=", eqsym},
+    {"=", eqlsym},
     {"<", lessym},
     {">", gtrsym},
     {"(", lparentsym},
@@ -109,8 +92,292 @@ Token specialSymbolArr[] =
     {".", periodsym}
 };
 
+// Two character operators, tried only when charClass marks the first character
+Keyword doubleSymbolArr[] =
+{
+    {"<>", neqsym},
+    {"<=", leqsym},
+    {">=", geqsym},
+    {":=", becomessym}
+};
+
+// Character classes, CHAR_DOUBLE can be combined with the others
+#define CHAR_OTHER 0
+#define CHAR_SPACE 1
+#define CHAR_LETTER 2
+#define CHAR_DIGIT 4
+#define CHAR_SYMBOL 8
+#define CHAR_DOUBLE 16
+
+unsigned char charClass[256]; // Class of every character
+unsigned char symbolToken[256]; // Token of every single character symbol
+
+/*
+    Span scanners. Each returns how many of the n characters at p belong to
+    one class, so the lexer can skip a whole run at once: whitespace
+    (counting the newlines in it), letters and digits, digits, and comment
+    text up to the next '*'. The SSE2, AVX2 and SWAR versions classify 16,
+    32 or 8 characters per step and finish the last partial block with the
+    scalar version, so they never read past the end of the source. One set
+    is picked when the tables are built, from the CPU the lexer runs on,
+    unless the build forces one with -DSCANNER=<n>.
+*/
+#define SCANNER_AUTO 0
+#define SCANNER_SCALAR 1
+#define SCANNER_SWAR 2
+#define SCANNER_SSE2 3
+#define SCANNER_AVX2 4
+
+#ifndef SCANNER
+#define SCANNER SCANNER_AUTO
+#endif
+
+#define SCAN_SPACE 0
+#define SCAN_WORD 1
+#define SCAN_DIGITS 2
+#define SCAN_COMMENT 3 // Anything but '*'
+
+typedef struct Scanner
+{
+    char *name;
+    long (*space)(const char *p, long n, int *lines);
+    long (*word)(const char *p, long n, int *lines);
+    long (*digits)(const char *p, long n, int *lines);
+    long (*comment)(const char *p, long n, int *lines);
+} Scanner;
+
+// Defines the four scanners of a set from its span function
+#define SCANNER_SET(prefix, attributes) \
+    attributes long prefix##Space(const char *p, long n, int *lines) { return prefix##Span(p, n, SCAN_SPACE, lines); } \
+    attributes long prefix##Word(const char *p, long n, int *lines) { return prefix##Span(p, n, SCAN_WORD, lines); } \
+    attributes long prefix##Digits(const char *p, long n, int *lines) { return prefix##Span(p, n, SCAN_DIGITS, lines); } \
+    attributes long prefix##Comment(const char *p, long n, int *lines) { return prefix##Span(p, n, SCAN_COMMENT, lines); }
+
+// Scalar, one character at a time through charClass
+static inline long scalarSpan(const char *p, long n, int kind, int *lines)
+{
+    static const unsigned char classOf[] = {CHAR_SPACE, CHAR_LETTER | CHAR_DIGIT, CHAR_DIGIT};
+    long i = 0;
+
+    for (; i < n; i++)
+    {
+        unsigned char c = p[i];
+
+        if (kind == SCAN_COMMENT ? c == '*' : !(charClass[c] & classOf[kind]))
+            break;
+        if (c == '\n')
+            (*lines)++;
+    }
+    return i;
+}
+
+SCANNER_SET(scalar, static)
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_SWAR 1
+
+/*
+    SWAR, eight characters in a 64-bit word. SWAR_BETWEEN sets the high bit
+    of every byte of x that is strictly between m and n (at most 128); the
+    low seven bits are compared with the sign bits masked off, so no byte
+    borrows from or carries into its neighbour.
+*/
+#define SWAR_ONES 0x0101010101010101ull
+#define SWAR_HIGHS (SWAR_ONES * 0x80)
+#define SWAR_BETWEEN(x, m, n) \
+    ((SWAR_ONES * (127 + (n)) - ((x) & SWAR_ONES * 127)) & ~(x) & \
+     (((x) & SWAR_ONES * 127) + SWAR_ONES * (127 - (m))) & SWAR_HIGHS)
+
+static inline long swarSpan(const char *p, long n, int kind, int *lines)
+{
+    long i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t x, in;
+        memcpy(&x, p + i, 8);
+
+        if (kind == SCAN_SPACE)
+            in = SWAR_BETWEEN(x, 8, 14) | SWAR_BETWEEN(x, 31, 33);
+        else if (kind == SCAN_WORD)
+            in = SWAR_BETWEEN(x, 'a' - 1, 'z' + 1) | SWAR_BETWEEN(x, 'A' - 1, 'Z' + 1) | SWAR_BETWEEN(x, '0' - 1, '9' + 1);
+        else if (kind == SCAN_DIGITS)
+            in = SWAR_BETWEEN(x, '0' - 1, '9' + 1);
+        else
+            in = ~SWAR_BETWEEN(x, '*' - 1, '*' + 1) & SWAR_HIGHS;
+
+        uint64_t newlines = (kind == SCAN_SPACE || kind == SCAN_COMMENT) ? SWAR_BETWEEN(x, '\n' - 1, '\n' + 1) : 0;
+        uint64_t out = ~in & SWAR_HIGHS;
+
+        if (out)
+        {
+            int end = __builtin_ctzll(out) / 8;
+            *lines += __builtin_popcountll(newlines & ((1ull << (end * 8)) - 1));
+            return i + end;
+        }
+        *lines += __builtin_popcountll(newlines);
+    }
+    return i + scalarSpan(p + i, n - i, kind, lines);
+}
+
+SCANNER_SET(swar, static)
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_X86 1
+#include <immintrin.h>
+
+/*
+    SSE2 (every x86-64 CPU) and AVX2 (detected at run time, so the lexer
+    still builds without -mavx2). A character is in lo..hi when
+    min(c - lo, hi - lo) == c - lo as unsigned bytes.
+*/
+#define SSE2_IN_RANGE(x, lo, hi) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8((x), _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), \
+        _mm_sub_epi8((x), _mm_set1_epi8(lo)))
+#define AVX2_IN_RANGE(x, lo, hi) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8((x), _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi) - (lo))), \
+        _mm256_sub_epi8((x), _mm256_set1_epi8(lo)))
+
+static inline long sse2Span(const char *p, long n, int kind, int *lines)
+{
+    long i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i)), in;
+
+        if (kind == SCAN_SPACE)
+            in = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), SSE2_IN_RANGE(x, '\t', '\r'));
+        else if (kind == SCAN_WORD)
+            in = _mm_or_si128(SSE2_IN_RANGE(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z'), SSE2_IN_RANGE(x, '0', '9'));
+        else if (kind == SCAN_DIGITS)
+            in = SSE2_IN_RANGE(x, '0', '9');
+        else
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('*')), _mm_set1_epi8(-1));
+
+        unsigned newlines = (kind == SCAN_SPACE || kind == SCAN_COMMENT) ?
+            (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n'))) : 0;
+        unsigned out = ~(unsigned)_mm_movemask_epi8(in) & 0xFFFFu;
+
+        if (out)
+        {
+            int end = __builtin_ctz(out);
+            *lines += __builtin_popcount(newlines & ((1u << end) - 1));
+            return i + end;
+        }
+        *lines += __builtin_popcount(newlines);
+    }
+    return i + scalarSpan(p + i, n - i, kind, lines);
+}
+
+__attribute__((target("avx2")))
+static inline long avx2Span(const char *p, long n, int kind, int *lines)
+{
+    long i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i)), in;
+
+        if (kind == SCAN_SPACE)
+            in = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), AVX2_IN_RANGE(x, '\t', '\r'));
+        else if (kind == SCAN_WORD)
+            in = _mm256_or_si256(AVX2_IN_RANGE(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z'), AVX2_IN_RANGE(x, '0', '9'));
+        else if (kind == SCAN_DIGITS)
+            in = AVX2_IN_RANGE(x, '0', '9');
+        else
+            in = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('*')), _mm256_set1_epi8(-1));
+
+        unsigned newlines = (kind == SCAN_SPACE || kind == SCAN_COMMENT) ?
+            (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'))) : 0;
+        unsigned out = ~(unsigned)_mm256_movemask_epi8(in);
+
+        if (out)
+        {
+            int end = __builtin_ctz(out);
+            *lines += __builtin_popcount(newlines & ((1u << end) - 1));
+            return i + end;
+        }
+        *lines += __builtin_popcount(newlines);
+    }
+    return i + sse2Span(p + i, n - i, kind, lines);
+}
+
+SCANNER_SET(sse2, static)
+SCANNER_SET(avx2, __attribute__((target("avx2"))) static)
+#endif
+
+Scanner scanner; // Set by initCharTables()
+
+// Returns the fastest scanner set this build and CPU support, or the one forced with -DSCANNER
+Scanner chooseScanner()
+{
+    Scanner scalar = {"scalar", scalarSpace, scalarWord, scalarDigits, scalarComment};
+    int wanted = SCANNER;
+
+#ifdef HAVE_X86
+    if (wanted == SCANNER_AVX2 || (wanted == SCANNER_AUTO && __builtin_cpu_supports("avx2")))
+        return (Scanner){"avx2", avx2Space, avx2Word, avx2Digits, avx2Comment};
+    if (wanted == SCANNER_SSE2 || wanted == SCANNER_AUTO)
+        return (Scanner){"sse2", sse2Space, sse2Word, sse2Digits, sse2Comment};
+#endif
+#ifdef HAVE_SWAR
+    if (wanted == SCANNER_SWAR || wanted == SCANNER_AUTO)
+        return (Scanner){"swar", swarSpace, swarWord, swarDigits, swarComment};
+#endif
+    return scalar;
+}
+
+
+// Fills in the character tables from the symbol arrays the first time it is called
+void initCharTables()
+{
+    static int initialized = 0;
+    if (initialized)
+        return;
+    initialized = 1;
+
+    for (int c = 0; c < 256; c++)
+    {
+        symbolToken[c] = skipsym;
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r')
+            charClass[c] = CHAR_SPACE;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            charClass[c] = CHAR_LETTER;
+        else if (c >= '0' && c <= '9')
+            charClass[c] = CHAR_DIGIT;
+        else
+            charClass[c] = CHAR_OTHER;
+    }
+
+    for (int j = 0; j < (int)(sizeof(specialSymbolArr) / sizeof(specialSymbolArr[0])); j++)
+    {
+        unsigned char c = specialSymbolArr[j].lexeme[0];
+        charClass[c] |= CHAR_SYMBOL;
+        symbolToken[c] = specialSymbolArr[j].token;
+    }
+
+    for (int j = 0; j < (int)(sizeof(doubleSymbolArr) / sizeof(doubleSymbolArr[0])); j++)
+    {
+        charClass[(unsigned char)doubleSymbolArr[j].lexeme[0]] |= CHAR_DOUBLE;
+    }
+
+    scanner = chooseScanner();
+}
+
+// Returns the name of the scanner set the lexer uses
+char *scanner_name()
+{
+    initCharTables();
+    return scanner.name;
+}
+
 int copySrcToArray(FILE *fp, char **arr, int *arrSize)
 {
+    phase_begin("phase", "copySrcToArray");
+
     int curIndex = 0;
     while (1)
     {
@@ -118,6 +385,8 @@ int copySrcToArray(FILE *fp, char **arr, int *arrSize)
 
         if (c == EOF)
         {
+            phase_count("bytes", curIndex);
+            phase_end();
             return curIndex;
         }
 
@@ -129,6 +398,7 @@ int copySrcToArray(FILE *fp, char **arr, int *arrSize)
             if (*arr == NULL)
             {
                 printf("Reallocation failed\n");
+                phase_end();
                 return curIndex;
             }
         }
@@ -139,232 +409,396 @@ int copySrcToArray(FILE *fp, char **arr, int *arrSize)
     return curIndex;
 }
 
-int getToken(char *word, int reservedWordArrLen)
+int getToken(char *word, int length)
 {
-    for (int j = 0; j < reservedWordArrLen; j++) // For the length of reserved words
+    if (length < 2 || length > 9) // No reserved word is shorter or longer
     {
-        if (strcmp(word, reservedWordArr[j].lexeme) == 0) // If the word is in reserved words print its token
-        {
-            return reservedWordArr[j].token; // Stops the loop once the word is found
-        }
+        return identsym;
+    }
+
+    Keyword *keyword = &keywordTable[KEYWORD_HASH(word, length)];
+    if (keyword->lexeme != NULL && strcmp(word, keyword->lexeme) == 0) // Only one reserved word can match
+    {
+        return keyword->token;
     }
     return identsym;
 }
 
-int getSingleSymbol(char symbol, int specialSymbolArrLen)
+// Returns the token of the two character operator first second, or 0
+int getDoubleSymbol(int first, int second)
 {
-    char s[2] = {symbol, '\0'};
-    for (int j = 0; j < specialSymbolArrLen; j++)
+    if (!(charClass[first] & CHAR_DOUBLE) || second == EOF)
     {
-        if (strcmp(s, specialSymbolArr[j].lexeme) == 0)
+        return 0;
+    }
+
+    for (int j = 0; j < (int)(sizeof(doubleSymbolArr) / sizeof(doubleSymbolArr[0])); j++)
+    {
+        if (first == doubleSymbolArr[j].lexeme[0] && second == doubleSymbolArr[j].lexeme[1])
         {
-            return specialSymbolArr[j].token;
+            return doubleSymbolArr[j].token;
         }
     }
-    return skipsym;
+    return 0;
 }
 
-void addToken(Token *tokenList, int *tokenListIndex, char *lexeme, int token)
+// Appends a token whose lexeme is length characters at offset in the list's text, growing the list when needed
+void addToken(TokenList *list, int token, int value, int line, long offset, int length)
 {
-    tokenList[*tokenListIndex].lexeme = malloc(strlen(lexeme) + 1);
-    strcpy(tokenList[*tokenListIndex].lexeme, lexeme);
+    if (list->count + 1 >= list->capacity) // Keep a slot for the terminating token
+    {
+        list->capacity *= 2;
+        list->tokens = realloc(list->tokens, sizeof(Token) * list->capacity);
+    }
 
-    tokenList[*tokenListIndex].token = token;
+    Token *added = &list->tokens[list->count];
+    added->type = token;
+    added->value = value;
+    added->line = line;
+    added->length = length;
+    added->offset = offset;
 
-    (*tokenListIndex)++;
+    list->count++;
 }
 
-//! Remember to change this back to a command argument for the input file
-int main(int argc, char *argv[])
+// Copies a lexeme to the end of the list's arena and returns its offset
+long addLexeme(TokenList *list, char *lexeme, int length)
 {
-    int reservedWordArrLen = sizeof(reservedWordArr) / sizeof(reservedWordArr[0]);
-    int specialSymbolsArrLen = sizeof(specialSymbolArr) / sizeof(specialSymbolArr[0]);
-
-    if (argc != 2)
+    if (list->arenaLength + length > list->arenaCapacity)
     {
-        fprintf(stderr, "Incorrect number of arguments\n");
-        return 1;
+        list->arenaCapacity = list->arenaCapacity ? list->arenaCapacity * 2 : 4096;
+        list->arena = realloc(list->arena, list->arenaCapacity);
     }
 
-    FILE *inFile = fopen(argv[1], "r"); // Open the file
-    FILE *outFile = fopen("lex_output.txt", "w"); // Open the file for writing
+    long offset = list->arenaLength;
+    memcpy(list->arena + offset, lexeme, length);
+    list->arenaLength += length;
 
-    if (outFile == NULL) // can't open output file
-    {
-        printf("Error opening output file!\n");
-        return 1;
-    }
-    if (inFile == NULL) // can't open input file
+    return offset;
+}
+
+/*
+    The characters being lexed. data holds either the whole source (an array
+    or a mapped file, stream is NULL) or a window of a stream that is
+    refilled as the lexer reaches its end. The lexer never looks more than
+    one character past the current one, so a window only has to keep the
+    unread characters when it is refilled; tokens and comments that cross
+    the end of a window carry their state in the lexer, not in the window.
+*/
+#ifndef STREAM_WINDOW
+#define STREAM_WINDOW 65536
+#endif
+
+typedef struct Source
+{
+    char *data;
+    long length; // Characters in data
+    long pos; // Index of the current character
+    long capacity; // Size of the window
+    FILE *stream; // Stream the window is refilled from, or NULL
+} Source;
+
+// Character k places after the current one as an unsigned char, or EOF
+#define PEEK(src, k) \
+    ((src)->pos + (k) < (src)->length ? (unsigned char)(src)->data[(src)->pos + (k)] : sourceFill((src), (k)))
+
+// Refills the window so that character k is in it; returns it, or EOF at the end of the source
+int sourceFill(Source *src, int k)
+{
+    if (src->stream == NULL)
     {
-        printf("Error opening input file!\n");
-        return 1;
+        return EOF;
     }
 
-    // Allocate space for two arrays one for the input file and one for the token list
-    int arrSize = 2; // Set the initial size of the dynamic array
-    int tokenArrSize = 500;
-    int tokenListIndex = 0;
-    char *arr = malloc(sizeof(char) * arrSize); // Creates a dynamic array to store the input file
-    Token *tokenList = malloc(sizeof(Token) * tokenArrSize);
+    // Keep the unread characters and read after them
+    memmove(src->data, src->data + src->pos, src->length - src->pos);
+    src->length -= src->pos;
+    src->pos = 0;
 
-    if (arr == NULL) // Check if allocation failed
+    while (src->length <= k)
     {
-        printf("Memory allocation failed!\n");
-        return 1;
+        size_t got = fread(src->data + src->length, 1, src->capacity - src->length, src->stream);
+        if (got == 0)
+        {
+            return EOF;
+        }
+        src->length += got;
     }
-    int charsRead = copySrcToArray(inFile, &arr, &arrSize); // adds everything from src input file to array and return the last index
-    // Read the array
-    for (int i = 0; i < charsRead; i++)
+
+    return (unsigned char)src->data[k];
+}
+
+/*
+    Scans the source into a token list and returns the number of tokens.
+    Lexemes of identifiers and numbers are slices of the source when it
+    stays in memory; a stream's window is reused, so those are copied to
+    the list's arena instead.
+*/
+int lexStream(Source *src, TokenList *list)
+{
+    initCharTables();
+    phase_begin("phase", "lex");
+
+    memset(list, 0, sizeof(TokenList));
+    list->capacity = 512;
+    list->tokens = malloc(sizeof(Token) * list->capacity);
+
+    int line = 1; // Source line of the current character
+    int c;
+
+    // Read the source
+    while ((c = PEEK(src, 0)) != EOF)
     {
-        if (isspace((unsigned char)arr[i]))
+        int class = charClass[c];
+
+        if (class & CHAR_SPACE) // Skip the whole run that is in the window
+        {
+            src->pos += scanner.space(src->data + src->pos, src->length - src->pos, &line);
             continue;
-        if (i + 1 < charsRead && arr[i] == '/' && arr[i + 1] == '*')
+        }
+        if (c == '/' && PEEK(src, 1) == '*')
         {
-            int j = i + 1; // start scanning after /*
-            while (j + 1 < charsRead && !(arr[j] == '*' && arr[j + 1] == '/'))
-            {
-                j++;
-            }
-            if (j + 1 >= charsRead) // No closing comment delimeter was found "*/"
-            {
-                // Do nothing
-            }
-            else
+            // Skip to the closing "*/", which may reuse the * of the opening "/*"
+            src->pos++;
+            while ((c = PEEK(src, 0)) != EOF && !(c == '*' && PEEK(src, 1) == '/'))
             {
-                i = j + 2;
-                continue;
+                if (c == '*')
+                    src->pos++;
+                else // Jump to the next '*' in the window
+                    src->pos += scanner.comment(src->data + src->pos, src->length - src->pos, &line);
             }
-            
+            if (c != EOF) // An unclosed comment runs to the end of the source
+                src->pos += 2;
+            continue;
         }
 
-        else if (isalpha(arr[i])) // If it is a letter
+        if (class & CHAR_LETTER) // If it is a letter
         {
+            long start = src->pos;
             char word[MAX_WORD + 1];
             int wordIndex = 0;
 
-            while (isalpha(arr[i]) || isdigit(arr[i])) // Iterates until anything other than a letter or num is found
+            while ((c = PEEK(src, 0)) != EOF && (charClass[c] & (CHAR_LETTER | CHAR_DIGIT))) // Iterates until anything other than a letter or num is found
             {
+                // Take the rest of the run that is in the window
+                int runLines = 0; // Always 0, words and numbers have no newlines
+                long run = scanner.word(src->data + src->pos, src->length - src->pos, &runLines);
+
                 if (wordIndex < MAX_WORD)
                 {
-                    word[wordIndex] = arr[i]; // Add chars to word until max word length
+                    // Add chars to word until max word length
+                    memcpy(word + wordIndex, src->data + src->pos, run < MAX_WORD - wordIndex ? run : MAX_WORD - wordIndex);
                 }
-                i++;
-                wordIndex++;
+                src->pos += run;
+                wordIndex = wordIndex + run > MAX_WORD ? MAX_WORD + 1 : wordIndex + run;
             }
-            i--;
-            
 
             if (wordIndex > MAX_WORD)
             { // word is too long
-                addToken(tokenList, &tokenListIndex, "1", skipsym);
-                word[MAX_WORD] = '\0';
+                addToken(list, skipsym, 0, line, 0, 0);
             }
             else
             {   
                 word[wordIndex] = '\0';
-                int token = getToken(word, reservedWordArrLen);
-                addToken(tokenList, &tokenListIndex, word, token);
+                int token = getToken(word, wordIndex);
+
+                if (token == identsym) // Keywords need no lexeme
+                {
+                    long offset = src->stream ? addLexeme(list, word, wordIndex) : start;
+                    addToken(list, token, 0, line, offset, wordIndex);
+                }
+                else
+                {
+                    addToken(list, token, 0, line, 0, 0);
+                }
             }
         }
-        else if (isdigit(arr[i])) // If it is a number
+        else if (class & CHAR_DIGIT) // If it is a number
         {
+            long start = src->pos;
             char number[MAX_NUMBER + 1];
             int numberIndex = 0;
+            int value = 0;
 
-            while (isdigit(arr[i])) // Iterates until anything other than a num is found
+            while ((c = PEEK(src, 0)) != EOF && (charClass[c] & CHAR_DIGIT)) // Iterates until anything other than a num is found
             {
+                // Take the rest of the run that is in the window
+                int runLines = 0; // Always 0, words and numbers have no newlines
+                long run = scanner.digits(src->data + src->pos, src->length - src->pos, &runLines);
+
                 if (numberIndex < MAX_NUMBER)
                 {
-                    number[numberIndex] = arr[i]; // Add numbers to number until max number length
+                    // Add numbers to number until max number length
+                    memcpy(number + numberIndex, src->data + src->pos, run < MAX_NUMBER - numberIndex ? run : MAX_NUMBER - numberIndex);
                 }
-                i++;
-                numberIndex++;
+                src->pos += run;
+                numberIndex = numberIndex + run > MAX_NUMBER ? MAX_NUMBER + 1 : numberIndex + run;
             }
-            i--;
             
             if (numberIndex > MAX_NUMBER)
             { // number is too long
-                number[MAX_NUMBER] = '\0';
-                addToken(tokenList, &tokenListIndex, "1", skipsym);
+                addToken(list, skipsym, 0, line, 0, 0);
             }
             else
             {   
-                number[numberIndex] = '\0';
-                addToken(tokenList, &tokenListIndex, number, numbersym);
+                for (int j = 0; j < numberIndex; j++)
+                {
+                    value = value * 10 + (number[j] - '0');
+                }
+                long offset = src->stream ? addLexeme(list, number, numberIndex) : start;
+                addToken(list, numbersym, value, line, offset, numberIndex);
             }
         }
         else // Check if its a symbol
         {
-            int canDouble = (i + 1 < charsRead);
-            int done = 0;
+            int doubleSymbol = getDoubleSymbol(c, PEEK(src, 1));
 
-            if (canDouble && arr[i] == '<' && arr[i + 1] == '>') 
+            if (doubleSymbol)
             {
-                addToken(tokenList, &tokenListIndex, "<>", neqsym);
-                i++;
-                done = 1;
+                addToken(list, doubleSymbol, 0, line, 0, 0);
+                src->pos += 2;
             }
-            if (canDouble && arr[i] == '<' && arr[i + 1] == '=') 
-            {
-                addToken(tokenList, &tokenListIndex, "<=", leqsym);
-                i++;
-                done = 1;
-            }
-            if (canDouble && arr[i] == '>' && arr[i + 1] == '=') 
-            {
-                addToken(tokenList, &tokenListIndex, ">=", geqsym);
-                i++;
-                done = 1;
-            }
-            if (canDouble && arr[i] == ':' && arr[i + 1] == '=') 
+            else
             {
-                addToken(tokenList, &tokenListIndex, ":=", becomessym);
-                i++;
-                done = 1;
-            }            
-
-            if(!done) {
-                int symbol = getSingleSymbol(arr[i], specialSymbolsArrLen);
+                int symbol = symbolToken[c];
 
                 if (symbol == skipsym)
                 { // Symbol does not exist
-                    addToken(tokenList, &tokenListIndex, "1", symbol);
-                    printf("%c\tInvalid", arr[i]);
-                }
-                else
-                {
-                    char lexeme[2];
-                    lexeme[0] = arr[i];
-                    lexeme[1] = '\0';
-                    addToken(tokenList, &tokenListIndex, lexeme, symbol);
+                    printf("%c\tInvalid", c);
                 }
+                addToken(list, symbol, 0, line, 0, 0);
+                src->pos++;
             }
         }
+    }
+
+    // Terminate the list so the parser never reads past the last token
+    list->tokens[list->count].type = 0;
+    list->text = src->stream ? list->arena : src->data;
+
+    phase_count("tokens", list->count);
+    phase_count("lines", line);
+    phase_end();
+
+    return list->count;
+}
+
+// Scans a source array into a token list and returns the number of tokens; the lexemes point into arr
+int lex_source(char *arr, int charsRead, TokenList *list)
+{
+    Source src = {arr, charsRead, 0, charsRead, NULL};
+    return lexStream(&src, list);
+}
+
+/*
+    Scans an open file into a token list and returns the number of tokens.
+    A regular file is mapped and lexed in place, and stays mapped for the
+    lexemes until free_tokens(); anything else (a pipe, a terminal) is read
+    through a window of STREAM_WINDOW characters.
+*/
+int lex_file(FILE *fp, TokenList *list)
+{
+    struct stat info;
+
+    if (fstat(fileno(fp), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        char *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+
+        if (map != MAP_FAILED)
+        {
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+            Source src = {map, info.st_size, 0, info.st_size, NULL};
+            int tokenCount = lexStream(&src, list);
+
+            list->map = map;
+            list->mapSize = info.st_size;
+            return tokenCount;
+        }
+    }
+
+    Source src = {malloc(STREAM_WINDOW), 0, 0, STREAM_WINDOW, fp};
+    int tokenCount = lexStream(&src, list);
+
+    free(src.data);
+    return tokenCount;
+}
 
+// Frees a token list along with its arena or mapping
+void free_tokens(TokenList *list)
+{
+    if (list->map != NULL)
+    {
+        munmap(list->map, list->mapSize);
     }
+    free(list->arena);
+    free(list->tokens);
+    memset(list, 0, sizeof(TokenList));
+}
+
+#ifndef PL0_DRIVER
+//! Remember to change this back to a command argument for the input file
+int main(int argc, char *argv[])
+{
+    // -T times the phases (see phase.c)
+    if (argc == 4 && !strcmp(argv[1], "-T"))
+    {
+        phase_enable(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Incorrect number of arguments\n");
+        return 1;
+    }
+
+    FILE *inFile = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin; // Open the file
+    FILE *outFile = fopen("lex_output.txt", "w"); // Open the file for writing
+
+    if (outFile == NULL) // can't open output file
+    {
+        printf("Error opening output file!\n");
+        return 1;
+    }
+    if (inFile == NULL) // can't open input file
+    {
+        printf("Error opening input file!\n");
+        return 1;
+    }
+
+    // Lex the input file in place, the token list is allocated by lex_file
+    TokenList list;
+    int tokenListIndex = lex_file(inFile, &list);
+    Token *tokenList = list.tokens;
 
     // Print the token list to output file
+    phase_begin("phase", "output");
     for (int i = 0; i < tokenListIndex; i++)
     {
-        if (tokenList[i].token == identsym) // If its an identifier, print the identifier symbol and then the identifier
+        if (tokenList[i].type == identsym) // If its an identifier, print the identifier symbol and then the identifier
         {
-            fprintf(outFile, "2 %s ", tokenList[i].lexeme);
+            fprintf(outFile, "2 %.*s ", tokenList[i].length, list.text + tokenList[i].offset);
         }
-        else if (tokenList[i].token == numbersym) // If its a number, print the number symbol and then the number
+        else if (tokenList[i].type == numbersym) // If its a number, print the number symbol and then the number
         {
-            fprintf(outFile, "3 %s ", tokenList[i].lexeme);
+            fprintf(outFile, "3 %.*s ", tokenList[i].length, list.text + tokenList[i].offset);
         }
         else // Otherwise, just print the token
         {
-            fprintf(outFile, "%d ", tokenList[i].token);
+            fprintf(outFile, "%d ", tokenList[i].type);
         }
     }
     
     // Close Files
     fclose(outFile);
     fclose(inFile);
+    phase_count("tokens", tokenListIndex);
+    phase_end();
+    phase_report();
     // Free memory
-    free(arr);
-    free(tokenList);
+    free_tokens(&list);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -8,20 +8,33 @@
 
     To Compile:
         Scanner:
-            gcc -O2 -std=c11 -o lex lex.c
-        Parser/Code Generator:
-            gcc -O2 -std=c11 -o parsercodegen parsercodegen.c
+            gcc -O2 -std=c11 -o lex lex.c phase.c
+        Parser/Code Generator (with binary output, -b):
+            gcc -O2 -std=c11 -o parsercodegen parsercodegen_complete.c elf.c phase.c
+
+        The C translation written with -c:
+            gcc -O2 -o program program.c
 
     To Execute (on Eustis):
-        ./lex <input_file.txt>
-        ./parsercodegen
+        ./lex [-T trace.json] <input_file.txt>
+        ./parsercodegen [-b | -c] [-O<level>] [-T trace.json]
 
     where:
         lex_output.txt is the path to the PL/0 source program
         
     Notes:
-        - lex.c accepts ONE command-line argument (input PL/0 source file)
-        - parsercodegen.c accepts NO command-line arguments
+        - lex.c accepts ONE command-line argument (input PL/0 source file),
+            after -T trace.json if given
+        - parsercodegen.c accepts no command-line arguments other than -b,
+            which writes the binary image elf.bin instead of elf.txt, -c,
+            which writes the program as a standalone C program program.c
+            instead, and -O1 or -O2, which fold constant expressions and
+            conditions and run the peephole optimizer over the code (-O0,
+            the default, emits the code exactly as generated)
+        - -T times the phases of the compile (parse_input, PROGRAM with a
+            span for every BLOCK, optimize and the output) and prints a one
+            line summary to stderr and a Chrome trace to trace.json (see
+            phase.c); lex -T does the same for the lexer
         - Input filename is hard-coded in parsercodegen.c
         - Implements recursive-descent parser for PL/0 grammar
         - Generates PM/0 assembly code (see Appendix A for ISA)
@@ -38,90 +51,19 @@
     #include <stdio.h>
     #include <stdlib.h>
     #include <string.h>
+    #include <limits.h>
+    #include <setjmp.h>
+
+    #include "pl0.h"
 
 // Constants
-    #define MAX_SUPPLEMENT_SIZE 11
     #define STEP_SIZE 100
-    #define MAX_SYMBOL_TABLE_SIZE 500
-
-// Enums
-    typedef enum
-    {
-        skipsym = 1,
-        identsym,
-        numbersym,
-        plussym,
-        minussym,
-        multsym,
-        slashsym,
-        eqlsym,
-        neqsym,
-        lessym,
-        leqsym,
-        gtrsym,
-        geqsym,
-        lparentsym,
-        rparentsym,
-        commasym,
-        semicolonsym,
-        periodsym,
-        becomessym,
-        beginsym,
-        endsym,
-        ifsym,
-        fisym,
-        thensym,
-        whilesym,
-        dosym,
-        callsym,
-        constsym,
-        varsym,
-        procsym,
-        writesym,
-        readsym,
-        elsesym,
-        evensym
-    } TokenType;
-
-    typedef enum {
-        LIT = 1,
-        OPR,
-        LOD,
-        STO,
-        CAL,
-        INC,
-        JMP,
-        JPC,
-        SYS,
-    } OPCode;
-
-    typedef enum {
-        RTN,
-        ADD,
-        SUB,
-        MUL,
-        DIV,
-        EQL,
-        NEQ,
-        LSS,
-        LEQ,
-        GTR,
-        GEQ,
-        EVEN
-    } OPCode2;
-
-    typedef enum {
-        OUT = 1,
-        READ,
-        HLT
-    } OPCode9;
 
-// Structs
-    typedef struct {
-        int type;
-        char supplement[MAX_SUPPLEMENT_SIZE];
-    } Token;
+    // The lexeme of token index, as a pointer and a length
+    #define LEXEME(index) (tokenText + tokenList[index].offset)
+    #define LEXEME_LENGTH(index) (tokenList[index].length)
 
+// Structs
     typedef struct {
         int kind;
         char name[12];
@@ -129,17 +71,20 @@
         int level;
         int addr;
         int mark;
+        int bucketNext; // Next visible symbol in the same hash bucket, or -1
+        int scopeNext; // Symbol declared before it in the same scope, or -1
     } Symbol;
 
+    /*
+        An open scope: the block being parsed and every block around it
+    */
     typedef struct {
-        int o;
-        int l;
-        int m;
-    } Instruction;
+        int lastSymbol; // Symbol declared last in the scope, or -1
+    } Scope;
 
 // Functions
     // Program setup
-    void validate_command_line_arguments(int argc);
+    void validate_command_line_arguments(int argc, char *argv[]);
     FILE *open_file(char *fileName, char *fileType);
     Token *parse_input();
 
@@ -150,26 +95,54 @@
     int VAR_DECLARATION();
     void PROCEDURE_DECLARATION();
     void STATEMENT();
-    void CONDITION();
+    int CONDITION();
     void EXPRESSION();
     void TERM();
     void FACTOR();
 
     // Recursive descent parser helper functions
-    int SYMBOL_TABLE_CHECK(char *target);
-    void STORE_SYMBOL(int kind, char *name, int value, int level, int address, int mark);
-    int NEW_SYMBOL_ADDRESS(int level);
+    int SYMBOL_TABLE_CHECK(char *target, int length);
+    int SYMBOL_DECLARED_IN_SCOPE(char *target, int length);
+    void STORE_SYMBOL(int kind, char *name, int length, int value, int level, int address, int mark);
+    void OPEN_SCOPE();
+    void CLOSE_SCOPE();
+    void create_symbol_table();
+    unsigned hash_name(char *name, int length);
 
     void ERROR(char *errorString);
     void EMIT(int o, int l, int m);
+    void EMIT_OPERATION(int leftStart, int rightStart, int operation);
+
+    // Constant folding
+    int constant_at(int start, int end, int *value);
+    int fold_constants(int left, int right, int operation);
+    int has_division(int start, int end);
+    void remove_instruction(int index);
 
     int supplement_to_number(char *supplement);
 
+    // Peephole optimizer
+    int optimize_program(int optimizeLevel);
+    int thread_jumps();
+    int mark_redundant(int *removed, int *isTarget);
+    int mark_unreachable(int *removed, int *isTarget);
+    void remove_marked(int *removed);
+    int is_jump(int o);
+    void report_optimization();
+
+    // In-memory entry points
+    Instruction *compile_tokens(TokenList *list, int optimizeLevel, int *codeSize);
+    int compile_to_image(TokenList *list, int optimizeLevel, char *imageFileName, char **error);
+
     // Program close
     void HALT(int exitType);
+    void free_compiler_state();
+    ElfSymbol *compiled_symbols(int *count);
 
     void print_program();
     void output_to_file();
+    void output_binary_to_file(char *fileName);
+    void output_c_to_file(char *fileName, int pasSize);
     void output_to_terminal();
     void output_assembly_to_terminal();
     void output_symbol_table_to_terminal();
@@ -177,26 +150,49 @@
     char *opcode_to_string(int o);
 
 // Variables
-    FILE *inputFile, *outputFile;
+    /*
+        Every compile keeps its state in these. They are thread local, so
+            each thread of a batch compile (see pl0batch.c) has its own set
+            and compiles never see each other.
+    */
+    _Thread_local FILE *inputFile, *outputFile;
+
+    _Thread_local Token *tokenList;
+    _Thread_local char *tokenText; // Text the lexemes of the tokens are slices of
+    _Thread_local Symbol *symbolTable = NULL;
+    _Thread_local int *symbolBuckets = NULL; // Newest visible symbol of every hash bucket, or -1
+    _Thread_local int bucketMask = 0; // Number of buckets - 1, a power of two - 1
+    _Thread_local Scope *scopes = NULL;
+    _Thread_local int scopeCount = 0, scopeListSize = 0;
+    _Thread_local Instruction *instructionList = NULL;
+    _Thread_local int *instructionLines = NULL; // Source line of every instruction
+
+    _Thread_local int tokenListSize = 0, symbolTableSize = 0, instructionListSize = 0;
+    _Thread_local int tokenIndex = 0, symbolIndex = 0, instructionIndex = 0;
 
-    Token *tokenList;
-    Symbol symbolTable[MAX_SYMBOL_TABLE_SIZE];
-    Instruction *instructionList = NULL;
+    _Thread_local int level = 0;
 
-    int tokenListSize = 0, symbolTableSize = 0, instructionListSize = 0;
-    int tokenIndex = 0, symbolIndex = 0, instructionIndex = 0;
+    _Thread_local int binaryOutput = 0;
+    _Thread_local int cOutput = 0;
+    _Thread_local int optimizationLevel = 0; // -O level
+    _Thread_local int removedInstructions = 0; // Instructions removed by the optimizer
 
-    int level = 0;
+    _Thread_local jmp_buf *errorJump = NULL; // Set while compile_to_image() runs
+    _Thread_local char *errorMessage = NULL; // Error that stopped the last compile
 
 // Main
+#ifndef PL0_DRIVER
     int main(int argc, char *argv[]) {
         // Program setup
             // Validate command line arguments
-            validate_command_line_arguments(argc);
+            validate_command_line_arguments(argc, argv);
 
-            // Open the files
+            // Open the files, the binary image and the C program are written
+            // in one go at the end
             inputFile = open_file("lex_output.txt", "r");
-            outputFile = open_file("elf.txt", "w");
+            if(!binaryOutput && !cOutput) {
+                outputFile = open_file("elf.txt", "w");
+            }
 
             // Parse the input file
             tokenList = parse_input();
@@ -204,18 +200,38 @@
         // Parse the token list
         PROGRAM();
 
+        // Clean up the generated code
+        optimize_program(optimizationLevel);
+
         // Program close
         print_program();
+        phase_report();
     }
+#endif
 
 // Program setup
     /*
-        Command line arguments are only valid iff argc == 1, as this program does
-            not accept any.
+        The only valid command line arguments are -b to select binary output,
+            -c to select C output, -O0, -O1 or -O2 to select the
+            optimization level and -T to time the phases.
     */
-    void validate_command_line_arguments(int argc) {
-        if(argc != 1) {
-            ERROR("Error: This program does not accept any command line arguments");
+    void validate_command_line_arguments(int argc, char *argv[]) {
+        for(int i = 1; i < argc; i++) {
+            if(!strcmp(argv[i], "-b")) {
+                binaryOutput = 1;
+            }
+            else if(!strcmp(argv[i], "-c")) {
+                cOutput = 1;
+            }
+            else if(!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O2")) {
+                optimizationLevel = argv[i][2] - '0';
+            }
+            else if(!strcmp(argv[i], "-T") && i + 1 < argc) {
+                phase_enable(argv[++i]);
+            }
+            else {
+                ERROR("Error: This program does not accept any command line arguments other than -b, -c, -O<level> and -T");
+            }
         }
     }
 
@@ -242,10 +258,15 @@
     Token *parse_input() {
         // Declare variables
         Token *result;
+        char lexeme[MAX_WORD + 1];
+        int textLength = 0, textSize = 0;
 
-        // Instantiate the token list
+        phase_begin("phase", "parse_input");
+
+        // Instantiate the token list, the lexemes are copied into tokenText
         result = malloc(sizeof(Token) * STEP_SIZE);
         tokenListSize = 0;
+        tokenText = NULL;
 
         // Parse the input file
         int temp, steps = 1;
@@ -263,23 +284,127 @@
 
             // Store the token type
             result[i].type = temp;
+            result[i].value = 0;
+            result[i].line = 0;
+            result[i].length = 0;
+            result[i].offset = 0;
             
             // Handle variable edge cases
             if(temp == 2 || temp == 3) {
-                fscanf(inputFile, "%s", result[i].supplement);
+                fscanf(inputFile, "%11s", lexeme);
+
+                // Copy the lexeme to the end of the text
+                int length = strlen(lexeme);
+                if(textLength + length > textSize) {
+                    textSize = textSize * 2 + STEP_SIZE;
+                    tokenText = realloc(tokenText, textSize);
+                }
+                memcpy(tokenText + textLength, lexeme, length);
+
+                result[i].offset = textLength;
+                result[i].length = length;
+                textLength += length;
+            }
+
+            // Convert numbers once here rather than at every use
+            if(temp == 3) {
+                result[i].value = supplement_to_number(lexeme);
             }
 
             tokenListSize++;
         }
 
+        // Terminate the list so the parser never reads past the last token
+        if(tokenListSize >= STEP_SIZE * steps) {
+            result = realloc(result, sizeof(Token) * (tokenListSize + 1));
+        }
+        result[tokenListSize].type = 0;
+
+        phase_count("tokens", tokenListSize);
+        phase_end();
+
         return result;
     }
 
+    /*
+        Compile a token list that is already in memory (see pl0.c)
+
+        Returns the instruction list and stores its length in codeSize
+    */
+    Instruction *compile_tokens(TokenList *list, int optimizeLevel, int *codeSize) {
+        // Handle lexical errors
+        for(int i = 0; i < list->count; i++) {
+            if(list->tokens[i].type == skipsym) {
+                ERROR("Error: Scanning error detected by lexer (skipsym present)");
+            }
+        }
+
+        tokenList = list->tokens;
+        tokenText = list->text;
+        tokenListSize = list->count;
+        optimizationLevel = optimizeLevel;
+
+        // Start from an empty program, the caller owns the previous one
+        free(instructionLines);
+        instructionList = NULL;
+        instructionLines = NULL;
+        instructionListSize = 0;
+        tokenIndex = 0;
+        instructionIndex = 0;
+        level = 0;
+        removedInstructions = 0;
+
+        // Parse the token list
+        PROGRAM();
+
+        // Clean up the generated code
+        optimize_program(optimizeLevel);
+
+        *codeSize = instructionIndex;
+        return instructionList;
+    }
+
+    /*
+        Compile a token list and write it as a binary image. Unlike
+            compile_tokens(), an error only stops this compile: the state of
+            the calling thread is freed either way, so a thread can run one
+            compile after another.
+
+        Returns the number of instructions, or -1 and the error in error
+    */
+    int compile_to_image(TokenList *list, int optimizeLevel, char *imageFileName, char **error) {
+        jmp_buf handler;
+        volatile int codeSize = -1;
+
+        *error = NULL;
+        errorJump = &handler;
+
+        if(!setjmp(handler)) {
+            int size;
+            compile_tokens(list, optimizeLevel, &size);
+            output_binary_to_file(imageFileName);
+            codeSize = size;
+        }
+        else {
+            *error = errorMessage;
+        }
+
+        errorJump = NULL;
+        free_compiler_state();
+
+        return codeSize;
+    }
+
 // Recursive descent parser functions
     /*
         A block followed by a period
     */
     void PROGRAM() {
+        phase_begin("phase", "PROGRAM");
+
+        // Set up an empty symbol table
+        create_symbol_table();
+
         // Perform a block
         BLOCK();
 
@@ -288,6 +413,11 @@
             ERROR("Error: program must end with period");
         }
 
+        phase_count("tokens", tokenIndex + 1);
+        phase_count("symbols", symbolIndex);
+        phase_count("instructions", instructionIndex);
+        phase_end();
+
         // Emit program end
         EMIT(SYS, 0, HLT);
     }
@@ -296,6 +426,13 @@
         Performs constant declarations, variable declarations, and statements
     */
     void BLOCK() {
+        // A span per block, named after its procedure (stored just before)
+        int firstInstruction = instructionIndex, firstSymbol = symbolIndex;
+        phase_begin("BLOCK", level == 0 ? "main" : symbolTable[symbolIndex - 1].name);
+
+        // The block's declarations go in a new scope
+        OPEN_SCOPE();
+
         // Store the code index for the jmp instruction that navigates to the procedure
         int procIdx = instructionIndex;
 
@@ -321,16 +458,16 @@
         STATEMENT();
 
         // Mark all variables and procedures at the block's level as 1
-        for(int i = 0; i < symbolIndex; i++) {
-            if(symbolTable[i].level == level) {
-                symbolTable[i].mark = 1;
-            }
-        }
+        CLOSE_SCOPE();
 
         // Emit the return except for main
         if(level != 0) {
             EMIT(OPR, 0, RTN);
         }
+
+        phase_count("symbols", symbolIndex - firstSymbol);
+        phase_count("instructions", instructionIndex - firstInstruction);
+        phase_end();
     }
 
     /*
@@ -350,13 +487,13 @@
                 }
 
                 // Make sure the identifier name has not been used yet
-                if(SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement) != -1) {
+                if(SYMBOL_DECLARED_IN_SCOPE(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex))) {
                     ERROR("Error: symbol name has already been declared");
                 }
 
                 // Save the identifier name
-                char symbolName[MAX_SUPPLEMENT_SIZE];
-                strcpy(symbolName, tokenList[tokenIndex].supplement);
+                char *symbolName = LEXEME(tokenIndex);
+                int symbolLength = LEXEME_LENGTH(tokenIndex);
 
                 tokenIndex++;
 
@@ -372,7 +509,7 @@
                 }
                 
                 // Save the constant
-                STORE_SYMBOL(1, symbolName, supplement_to_number(tokenList[tokenIndex].supplement), level, 0, 0);
+                STORE_SYMBOL(1, symbolName, symbolLength, tokenList[tokenIndex].value, level, 0, 0);
                 tokenIndex++;
             } while(tokenList[tokenIndex].type == commasym);
 
@@ -408,12 +545,12 @@
                 }
 
                 // Make sure the identifier name has not been used yet
-                if(SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement) != -1) {
+                if(SYMBOL_DECLARED_IN_SCOPE(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex))) {
                     ERROR("Error: symbol name has already been declared");
                 }
 
-                // Store the variable
-                STORE_SYMBOL(2, tokenList[tokenIndex].supplement, 0, level, NEW_SYMBOL_ADDRESS(level) + 3, 0);
+                // Store the variable after the static link, dynamic link and return address
+                STORE_SYMBOL(2, LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex), 0, level, numVars + 2, 0);
                 tokenIndex++;
             } while(tokenList[tokenIndex].type == commasym);
 
@@ -443,12 +580,12 @@
             }
 
             // Make sure the identifier name has not been used yet
-            if(SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement) != -1) {
+            if(SYMBOL_DECLARED_IN_SCOPE(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex))) {
                 ERROR("Error: symbol name has already been declared");
             }
 
             // Store the procedure
-            STORE_SYMBOL(3, tokenList[tokenIndex].supplement, 0, level, instructionIndex * 3, 0);
+            STORE_SYMBOL(3, LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex), 0, level, instructionIndex * 3, 0);
             tokenIndex++;
 
             if(tokenList[tokenIndex].type != semicolonsym) {
@@ -477,7 +614,7 @@
         // Perform a variable assignment
         if(tokenList[tokenIndex].type == identsym) {
             // Find the identifier associated with the token
-            int symIdx = SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement);
+            int symIdx = SYMBOL_TABLE_CHECK(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex));
 
             // Make sure the identifier exists
             if(symIdx == -1) {
@@ -514,7 +651,7 @@
             }
 
             // Find the identifier associated with the token
-            int symIdx = SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement);
+            int symIdx = SYMBOL_TABLE_CHECK(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex));
 
             // Make sure the identifier exists
             if(symIdx == -1) {
@@ -561,13 +698,20 @@
             tokenIndex++;
 
             // Evaluate the condition, place the result at the top of the stack
-            CONDITION();
+            int known = CONDITION();
+
+            // A condition known at compile time needs no jumps, drop its LIT
+            if(known != -1) {
+                instructionIndex--;
+            }
 
             // Store the code index for the jpc instruction that navigates to the false condition
             int jpcIdx = instructionIndex;
 
             // Emit the jpc with a temporary displacement value
-            EMIT(JPC, level, 0);
+            if(known == -1) {
+                EMIT(JPC, level, 0);
+            }
 
             // Make sure the then symbol comes next
             if(tokenList[tokenIndex].type != thensym) {
@@ -575,17 +719,24 @@
             }
             tokenIndex++;
 
-            // Perform the true condition operations
+            // Perform the true condition operations, dropping them if they never run
+            int thenIdx = instructionIndex;
             STATEMENT();
 
+            if(known == 0) {
+                instructionIndex = thenIdx;
+            }
+
             // Store the code index for the jpc instruction that nagivates to the true condition
             int jmpIdx = instructionIndex;
 
             // Emit the jmc with a temporary displacement value
-            EMIT(JMP, level, 0);
+            if(known == -1) {
+                EMIT(JMP, level, 0);
 
-            // Store the address of the first instruction of the false condition
-            instructionList[jpcIdx].m = instructionIndex * 3;
+                // Store the address of the first instruction of the false condition
+                instructionList[jpcIdx].m = instructionIndex * 3;
+            }
 
             // Make sure the else symbol comes next
             if(tokenList[tokenIndex].type != elsesym) {
@@ -593,11 +744,18 @@
             }
             tokenIndex++;
 
-            // Perform the false condition operations
+            // Perform the false condition operations, dropping them if they never run
+            int elseIdx = instructionIndex;
             STATEMENT();
 
+            if(known == 1) {
+                instructionIndex = elseIdx;
+            }
+
             // Store the address of the first instruction of the true condition
-            instructionList[jmpIdx].m = instructionIndex * 3;
+            if(known == -1) {
+                instructionList[jmpIdx].m = instructionIndex * 3;
+            }
 
             // Make sure the fi symbol comes next
             if (tokenList[tokenIndex].type != fisym) {
@@ -615,7 +773,12 @@
             int loopIdx = instructionIndex;
 
             // Evaluate the condition, place the result at the top of the stack
-            CONDITION();
+            int known = CONDITION();
+
+            // A condition known at compile time needs no jpc, drop its LIT
+            if(known != -1) {
+                instructionIndex--;
+            }
 
             // Make sure the do symbol comes next
             if(tokenList[tokenIndex].type != dosym) {
@@ -627,16 +790,26 @@
             int jpcIdx = instructionIndex;
 
             // Emit the jpc with a temporary displacement value
-            EMIT(JPC, level, 0);
+            if(known == -1) {
+                EMIT(JPC, level, 0);
+            }
 
             // Perform the true condition operations
             STATEMENT();
 
-            // Emit a jmp back to the condition of the loop
-            EMIT(JMP, level, loopIdx * 3);
+            // A loop that never runs leaves no code
+            if(known == 0) {
+                instructionIndex = jpcIdx;
+            }
+            else {
+                // Emit a jmp back to the condition of the loop
+                EMIT(JMP, level, loopIdx * 3);
+            }
 
             // Store the address of the first instruction in the loop
-            instructionList[jpcIdx].m = instructionIndex * 3;
+            if(known == -1) {
+                instructionList[jpcIdx].m = instructionIndex * 3;
+            }
         }
 
         // Perform a read operation
@@ -650,7 +823,7 @@
             }
 
             // Find the identifier associated with the token
-            int symIdx = SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement);
+            int symIdx = SYMBOL_TABLE_CHECK(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex));
 
             // Make sure the identifier is in the symbol table
             if(symIdx == -1) {
@@ -672,7 +845,7 @@
             EMIT(SYS, 0, READ);
 
             // Emit the storage of the new value
-            EMIT(STO, symbolTable[symIdx].level, symbolTable[symIdx].addr);
+            EMIT(STO, level - symbolTable[symIdx].level, symbolTable[symIdx].addr);
         }
 
         // Perform a write operation
@@ -690,8 +863,14 @@
 
     /*
         Handles conditionals that may contain relational operators
+
+        Returns the value of the condition (0 or 1) when it is known at compile
+            time, which leaves it as a single LIT, otherwise -1
     */
-    void CONDITION() {
+    int CONDITION() {
+        // Remember where the condition's code starts
+        int start = instructionIndex, value;
+
         // Check whether this is an even condition
         if(tokenList[tokenIndex].type == evensym) {
             // Update the token index
@@ -700,8 +879,14 @@
             // Perform an operation, put the result at the top of the stack
             EXPRESSION();
 
-            // Emit the conditional
-            EMIT(OPR, 0, EVEN);
+            // Emit the conditional, or its value if the operand is a constant
+            if(optimizationLevel >= 1 && constant_at(start, instructionIndex, &value)) {
+                instructionIndex = start;
+                EMIT(LIT, 0, value % 2 == 0);
+            }
+            else {
+                EMIT(OPR, 0, EVEN);
+            }
         }
 
         // This condition has a relational operator (or is invalid)
@@ -736,11 +921,19 @@
             tokenIndex++;
 
             // Put the result of the second operation at the top of the stack
+            int rightStart = instructionIndex;
             EXPRESSION();
 
             // Emit the conditional
-            EMIT(OPR, 0, condition);
+            EMIT_OPERATION(start, rightStart, condition);
         }
+
+        // Report a condition that folded into a constant
+        if(optimizationLevel >= 1 && constant_at(start, instructionIndex, &value)) {
+            return value != 0;
+        }
+
+        return -1;
     }
 
     /*
@@ -749,6 +942,9 @@
         Structured to follow PEMDAS order of operations
     */
     void EXPRESSION() {
+        // Remember where the expression's code starts
+        int start = instructionIndex;
+
         // Process the first term
         TERM();
 
@@ -763,10 +959,11 @@
                 tokenIndex++;
 
                 // Process the term, placing it at the top of the stack
+                int rightStart = instructionIndex;
                 TERM();
 
                 // Emit the operation following the term
-                EMIT(OPR, 0, ADD);
+                EMIT_OPERATION(start, rightStart, ADD);
             }
 
             // Emit the term as a summand
@@ -775,10 +972,11 @@
                 tokenIndex++;
 
                 // Process the term, placing it at the top of the stack
+                int rightStart = instructionIndex;
                 TERM();
 
                 // Emit the operation following the term
-                EMIT(OPR, 0, SUB);
+                EMIT_OPERATION(start, rightStart, SUB);
             }
         }    
     }
@@ -789,6 +987,9 @@
         Structured to follow PEMDAS order of operations
     */
     void TERM() {
+        // Remember where the term's code starts
+        int start = instructionIndex;
+
         FACTOR();
 
         // Keep iterating while multiply or divide symbols are found
@@ -802,10 +1003,11 @@
                 tokenIndex++;
 
                 // Process the term, placing it at the top of the stack
+                int rightStart = instructionIndex;
                 FACTOR();
 
                 // Emit the operation following the term
-                EMIT(OPR, 0, MUL);
+                EMIT_OPERATION(start, rightStart, MUL);
             }
 
             // Emit the term as a divisor
@@ -814,10 +1016,11 @@
                 tokenIndex++;
 
                 // Process the term, placing it at the top of the stack
+                int rightStart = instructionIndex;
                 FACTOR();
 
                 // Emit the operation following the term
-                EMIT(OPR, 0, DIV);
+                EMIT_OPERATION(start, rightStart, DIV);
             }
         }
     }
@@ -830,7 +1033,7 @@
         // The token represents an identifier
         if(tokenList[tokenIndex].type == identsym) {
             // Find the identifier associated with the token
-            int symIdx = SYMBOL_TABLE_CHECK(tokenList[tokenIndex].supplement);
+            int symIdx = SYMBOL_TABLE_CHECK(LEXEME(tokenIndex), LEXEME_LENGTH(tokenIndex));
 
             // Make sure the identifier is in the symbol table
             if(symIdx == -1) {
@@ -844,7 +1047,7 @@
             }
             else {
                 // Emit the load of the identifier address
-                EMIT(LOD, symbolTable[symIdx].level, symbolTable[symIdx].addr);
+                EMIT(LOD, level - symbolTable[symIdx].level, symbolTable[symIdx].addr);
             }
 
             tokenIndex++;
@@ -853,7 +1056,7 @@
         // The token represents a number
         else if(tokenList[tokenIndex].type == numbersym) {
             // Emit the load of the literal value to the top of the stack
-            EMIT(LIT, 0, supplement_to_number(tokenList[tokenIndex].supplement));
+            EMIT(LIT, 0, tokenList[tokenIndex].value);
             tokenIndex++;
         }
 
@@ -880,14 +1083,16 @@
     
 // Recursive descent parser helper functions
     /*
-        Performs a linear search on the names of the symbols in the symbol table
+        Looks up a name among the symbols visible from the current block. The
+            newest symbol of every bucket comes first, so a name declared in
+            an inner block hides the same name declared around it.
         
         Returns the index or -1
     */
-    int SYMBOL_TABLE_CHECK(char *target) {
-        // Compare every name in the symbol table with the target
-        for(int i = 0; i < symbolIndex; i++) {
-            if(!strcmp(symbolTable[i].name, target)) {
+    int SYMBOL_TABLE_CHECK(char *target, int length) {
+        // Walk the target's hash bucket
+        for(int i = symbolBuckets[hash_name(target, length) & bucketMask]; i != -1; i = symbolTable[i].bucketNext) {
+            if(!strncmp(symbolTable[i].name, target, length) && symbolTable[i].name[length] == '\0') {
                 return i;
             }
         }
@@ -897,31 +1102,109 @@
     }
 
     /*
-        Adds a symbol to the symbol table and increments the symbol index
+        Returns 1 if the current block already declared the name
+    */
+    int SYMBOL_DECLARED_IN_SCOPE(char *target, int length) {
+        int symIdx = SYMBOL_TABLE_CHECK(target, length);
+
+        // Only the current block's symbols are visible at its level
+        return symIdx != -1 && symbolTable[symIdx].level == level;
+    }
+
+    /*
+        Adds a symbol to the symbol table and increments the symbol index. The
+            symbol belongs to the current scope and is visible until that
+            scope closes.
     */
-    void STORE_SYMBOL(int kind, char *name, int value, int level, int address, int mark) {
+    void STORE_SYMBOL(int kind, char *name, int length, int value, int level, int address, int mark) {
+        // Allocate memory when necessary
+        if(symbolIndex == symbolTableSize) {
+            symbolTableSize += STEP_SIZE;
+            symbolTable = realloc(symbolTable, sizeof(Symbol) * symbolTableSize);
+        }
+
         // Update every field for the symbol in the table
         symbolTable[symbolIndex].kind = kind;
-        strcpy(symbolTable[symbolIndex].name, name);
+        memcpy(symbolTable[symbolIndex].name, name, length);
+        symbolTable[symbolIndex].name[length] = '\0';
         symbolTable[symbolIndex].val = value;
         symbolTable[symbolIndex].level = level;
         symbolTable[symbolIndex].addr = address;
         symbolTable[symbolIndex].mark = mark;
 
+        // Put the symbol at the front of its bucket and its scope
+        int *bucket = &symbolBuckets[hash_name(name, length) & bucketMask];
+        symbolTable[symbolIndex].bucketNext = *bucket;
+        *bucket = symbolIndex;
+
+        Scope *scope = &scopes[scopeCount - 1];
+        symbolTable[symbolIndex].scopeNext = scope->lastSymbol;
+        scope->lastSymbol = symbolIndex;
+
         // Increment the symbol index
         symbolIndex++;
     }
 
     /*
-        Instantiate the address of a new symbol relative to its block
+        Start a scope for the declarations of a block
     */
-    int NEW_SYMBOL_ADDRESS(int level) {
-        int result = 0;
+    void OPEN_SCOPE() {
+        // Allocate memory when necessary
+        if(scopeCount == scopeListSize) {
+            scopeListSize += STEP_SIZE;
+            scopes = realloc(scopes, sizeof(Scope) * scopeListSize);
+        }
 
-        for(int i = 0; i < symbolIndex; i++) {
-            if(symbolTable[i].level == level && symbolTable[i].mark == 0) {
-                result++;
-            }
+        scopes[scopeCount].lastSymbol = -1;
+        scopeCount++;
+    }
+
+    /*
+        End the current block's scope: its symbols are marked as 1 and taken
+            out of their buckets. They are the newest in their buckets, so
+            unlinking them newest first takes one step each.
+    */
+    void CLOSE_SCOPE() {
+        scopeCount--;
+
+        for(int i = scopes[scopeCount].lastSymbol; i != -1; i = symbolTable[i].scopeNext) {
+            symbolBuckets[hash_name(symbolTable[i].name, strlen(symbolTable[i].name)) & bucketMask] = symbolTable[i].bucketNext;
+            symbolTable[i].mark = 1;
+        }
+    }
+
+    /*
+        Create an empty symbol table. A program cannot declare more symbols
+            than it has tokens, so the buckets are sized from the token count
+            and never need to grow.
+    */
+    void create_symbol_table() {
+        int bucketCount = 16;
+        while(bucketCount < tokenListSize) {
+            bucketCount *= 2;
+        }
+
+        free(symbolBuckets);
+        symbolBuckets = malloc(sizeof(int) * bucketCount);
+        bucketMask = bucketCount - 1;
+
+        for(int i = 0; i < bucketCount; i++) {
+            symbolBuckets[i] = -1;
+        }
+
+        symbolIndex = 0;
+        scopeCount = 0;
+    }
+
+    /*
+        Returns the FNV-1a hash of the length characters of a name
+    */
+    unsigned hash_name(char *name, int length) {
+        unsigned result = 2166136261u;
+
+        for(int i = 0; i < length; i++) {
+            result ^= (unsigned char)name[i];
+            result *= 16777619u;
         }
 
         return result;
@@ -933,8 +1216,16 @@
         Completely stop the program
     */
     void ERROR(char *errorString) {
+        // Only stop the current compile inside compile_to_image()
+        if(errorJump) {
+            errorMessage = errorString;
+            longjmp(*errorJump, 1);
+        }
+
         // Print the error to the console and the file
-        fprintf(outputFile, "%s", errorString);
+        if(outputFile) {
+            fprintf(outputFile, "%s", errorString);
+        }
         printf("%s", errorString);
 
         // Completely stop the program
@@ -951,8 +1242,12 @@
         if(instructionIndex == instructionListSize) {
             instructionListSize += STEP_SIZE;
             instructionList = realloc(instructionList, sizeof(Instruction) * (instructionListSize));
+            instructionLines = realloc(instructionLines, sizeof(int) * (instructionListSize));
         }
 
+        // Remember the source line of the last token consumed
+        instructionLines[instructionIndex] = tokenList[tokenIndex > 0 ? tokenIndex - 1 : 0].line;
+
         // Update every field for the instruction in the list
         instructionList[instructionIndex].o = o;
         instructionList[instructionIndex].l = l;
@@ -962,6 +1257,124 @@
         instructionIndex++;
     }
 
+    /*
+        Emit an arithmetic or relational operation whose operands were emitted
+            starting at leftStart and rightStart
+
+        With optimizations on (-O1 and up) two constant operands are folded
+            into a single LIT, and the identities x + 0, 0 + x, x - 0, x * 1,
+            1 * x, x / 1, x * 0 and 0 * x drop the code they make useless.
+            Expressions only read variables, so dropping x is safe unless it
+            divides (by what could be 0 at run time). Division by a constant
+            0 is left to fail at run time.
+    */
+    void EMIT_OPERATION(int leftStart, int rightStart, int operation) {
+        // Emit the operation as is
+        if(optimizationLevel < 1) {
+            EMIT(OPR, 0, operation);
+            return;
+        }
+
+        int left = 0, right = 0;
+        int leftConstant = constant_at(leftStart, rightStart, &left);
+        int rightConstant = constant_at(rightStart, instructionIndex, &right);
+        int divisionFails = operation == DIV && (right == 0 || (right == -1 && left == INT_MIN));
+
+        // Both operands are constants
+        if(leftConstant && rightConstant && !divisionFails) {
+            instructionIndex = leftStart;
+            EMIT(LIT, 0, fold_constants(left, right, operation));
+        }
+
+        // x + 0, x - 0, x * 1, x / 1
+        else if(rightConstant && (
+            (right == 0 && (operation == ADD || operation == SUB)) ||
+            (right == 1 && (operation == MUL || operation == DIV))))
+        {
+            instructionIndex = rightStart;
+        }
+
+        // 0 + x, 1 * x
+        else if(leftConstant && (
+            (left == 0 && operation == ADD) ||
+            (left == 1 && operation == MUL)))
+        {
+            remove_instruction(leftStart);
+        }
+
+        // x * 0, 0 * x
+        else if(operation == MUL && (
+            (rightConstant && right == 0 && !has_division(leftStart, rightStart)) ||
+            (leftConstant && left == 0 && !has_division(rightStart, instructionIndex))))
+        {
+            instructionIndex = leftStart;
+            EMIT(LIT, 0, 0);
+        }
+
+        else {
+            EMIT(OPR, 0, operation);
+        }
+    }
+
+// Constant folding
+    /*
+        Returns 1 and stores the value if the code from start up to end is a
+            single LIT, otherwise 0
+    */
+    int constant_at(int start, int end, int *value) {
+        if(end - start != 1 || instructionList[start].o != LIT) {
+            return 0;
+        }
+
+        *value = instructionList[start].m;
+        return 1;
+    }
+
+    /*
+        Returns the result of an operation on two constants, as the VM would
+            compute it. Sums and products wrap around like the VM's do.
+    */
+    int fold_constants(int left, int right, int operation) {
+        switch(operation) {
+            case ADD: return (int)((unsigned)left + (unsigned)right);
+            case SUB: return (int)((unsigned)left - (unsigned)right);
+            case MUL: return (int)((unsigned)left * (unsigned)right);
+            case DIV: return left / right;
+            case EQL: return left == right;
+            case NEQ: return left != right;
+            case LSS: return left < right;
+            case LEQ: return left <= right;
+            case GTR: return left > right;
+            default: return left >= right;
+        }
+    }
+
+    /*
+        Returns 1 if the code from start up to end contains a division
+    */
+    int has_division(int start, int end) {
+        for(int i = start; i < end; i++) {
+            if(instructionList[i].o == OPR && instructionList[i].m == DIV) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    /*
+        Remove one instruction, moving the ones after it down. Only used
+            inside an expression, which has no jumps to re-target.
+    */
+    void remove_instruction(int index) {
+        for(int i = index; i + 1 < instructionIndex; i++) {
+            instructionList[i] = instructionList[i + 1];
+            instructionLines[i] = instructionLines[i + 1];
+        }
+
+        instructionIndex--;
+    }
+
     /*
         Returns the value of root multiplied exponent times
     */
@@ -1006,28 +1419,297 @@
         return result;
     }
 
+// Peephole optimizer
+    /*
+        Clean up the generated code in place. Every removal shifts the
+            instructions after it, so all JMP, JPC and CAL addresses (m =
+            instructionIndex * 3) and the procedure addresses in the symbol
+            table are re-targeted, and the line numbers move with their
+            instructions.
+
+        -O1 threads jumps to jumps and removes instructions that do nothing:
+            a JMP to the next instruction (the JMP of an if with an empty
+            else), LIT 0 with OPR ADD or SUB, LIT 1 with OPR MUL or DIV, and
+            a LOD right after a STO of the same slot when it is stored back
+            to that slot (x := x).
+        -O2 also removes unreachable code, such as procedures that are never
+            called, and repeats both levels until nothing changes.
+
+        Returns the number of instructions removed
+    */
+    int optimize_program(int optimizeLevel) {
+        removedInstructions = 0;
+
+        if(optimizeLevel <= 0) {
+            return 0;
+        }
+
+        phase_begin("phase", "optimize");
+
+        int *removed = malloc(sizeof(int) * (instructionIndex + 1));
+        int *isTarget = malloc(sizeof(int) * (instructionIndex + 1));
+
+        int changed;
+        do {
+            changed = thread_jumps();
+
+            // Find the instructions that jumps and calls land on
+            for(int i = 0; i <= instructionIndex; i++) {
+                removed[i] = 0;
+                isTarget[i] = 0;
+            }
+            for(int i = 0; i < instructionIndex; i++) {
+                if(is_jump(instructionList[i].o)) {
+                    isTarget[instructionList[i].m / 3] = 1;
+                }
+            }
+
+            // Mark and remove the instructions that are not needed
+            int count = mark_redundant(removed, isTarget);
+
+            if(optimizeLevel >= 2) {
+                count += mark_unreachable(removed, isTarget);
+            }
+
+            if(count > 0) {
+                remove_marked(removed);
+                removedInstructions += count;
+                changed = 1;
+            }
+        } while(changed && optimizeLevel >= 2);
+
+        free(removed);
+        free(isTarget);
+
+        phase_count("removed", removedInstructions);
+        phase_end();
+
+        return removedInstructions;
+    }
+
+    /*
+        Point every jump that lands on a JMP straight at the final target.
+            Stops following a chain after instructionIndex steps, so a loop
+            of jumps is left alone.
+
+        Returns 1 if any jump was changed
+    */
+    int thread_jumps() {
+        int changed = 0;
+
+        for(int i = 0; i < instructionIndex; i++) {
+            if(instructionList[i].o != JMP && instructionList[i].o != JPC) {
+                continue;
+            }
+
+            int target = instructionList[i].m / 3;
+            for(int steps = 0; steps < instructionIndex && target < instructionIndex &&
+                instructionList[target].o == JMP && instructionList[target].m / 3 != target; steps++) {
+                target = instructionList[target].m / 3;
+            }
+
+            if(target * 3 != instructionList[i].m) {
+                instructionList[i].m = target * 3;
+                changed = 1;
+            }
+        }
+
+        return changed;
+    }
+
+    /*
+        Mark instructions that have no effect. The second instruction of a
+            pair is never a jump target, so no jump can land between them.
+
+        Returns the number of instructions marked
+    */
+    int mark_redundant(int *removed, int *isTarget) {
+        int count = 0;
+
+        for(int i = 0; i < instructionIndex; i++) {
+            Instruction *current = &instructionList[i];
+            Instruction *next = &instructionList[i + 1];
+            int hasNext = i + 1 < instructionIndex && !isTarget[i + 1];
+
+            // A jump to the next instruction
+            if(current->o == JMP && current->m == (i + 1) * 3) {
+                removed[i] = 1;
+                count++;
+            }
+
+            // Adding or subtracting 0, multiplying or dividing by 1
+            else if(hasNext && current->o == LIT && next->o == OPR && (
+                (current->m == 0 && (next->m == ADD || next->m == SUB)) ||
+                (current->m == 1 && (next->m == MUL || next->m == DIV))))
+            {
+                removed[i] = removed[i + 1] = 1;
+                count += 2;
+                i++;
+            }
+
+            // Storing a slot back into itself
+            else if(hasNext && current->o == LOD && next->o == STO &&
+                current->l == next->l && current->m == next->m)
+            {
+                removed[i] = removed[i + 1] = 1;
+                count += 2;
+                i++;
+            }
+        }
+
+        return count;
+    }
+
+    /*
+        Mark the instructions after a JMP, a return or a halt that no jump or
+            call lands on. Instruction 0 is where the program starts.
+
+        Returns the number of instructions marked
+    */
+    int mark_unreachable(int *removed, int *isTarget) {
+        int count = 0, reachable = 1;
+
+        for(int i = 0; i < instructionIndex; i++) {
+            if(i == 0 || isTarget[i]) {
+                reachable = 1;
+            }
+
+            if(!reachable && !removed[i]) {
+                removed[i] = 1;
+                count++;
+            }
+
+            // A removed JMP to the next instruction does not end the code
+            if(!removed[i] && (
+                instructionList[i].o == JMP ||
+                (instructionList[i].o == OPR && instructionList[i].m == RTN) ||
+                (instructionList[i].o == SYS && instructionList[i].m == HLT)))
+            {
+                reachable = 0;
+            }
+        }
+
+        return count;
+    }
+
+    /*
+        Drop the marked instructions and re-target everything that refers to
+            an instruction index. A reference to a removed instruction moves
+            to the next instruction that is kept.
+    */
+    void remove_marked(int *removed) {
+        // Index of every instruction after the removal
+        int *newIndex = malloc(sizeof(int) * (instructionIndex + 1));
+        int kept = 0;
+
+        for(int i = 0; i < instructionIndex; i++) {
+            newIndex[i] = kept;
+            if(!removed[i]) {
+                kept++;
+            }
+        }
+        newIndex[instructionIndex] = kept;
+
+        // Re-target jumps, calls and procedures
+        for(int i = 0; i < instructionIndex; i++) {
+            if(is_jump(instructionList[i].o)) {
+                instructionList[i].m = newIndex[instructionList[i].m / 3] * 3;
+            }
+        }
+        for(int i = 0; i < symbolIndex; i++) {
+            if(symbolTable[i].kind == 3) {
+                symbolTable[i].addr = newIndex[symbolTable[i].addr / 3] * 3;
+            }
+        }
+
+        // Close the gaps
+        for(int i = 0; i < instructionIndex; i++) {
+            if(!removed[i]) {
+                instructionList[newIndex[i]] = instructionList[i];
+                instructionLines[newIndex[i]] = instructionLines[i];
+            }
+        }
+        instructionIndex = kept;
+
+        free(newIndex);
+    }
+
+    /*
+        Returns 1 if the instruction's m is an instruction address
+    */
+    int is_jump(int o) {
+        return o == JMP || o == JPC || o == CAL;
+    }
+
+    /*
+        Print how many instructions the optimizer removed
+    */
+    void report_optimization() {
+        fprintf(stderr, "Peephole optimizer removed %d instructions\n", removedInstructions);
+    }
+
 // Program close
     /*
         Shuts down the file in the safest way possible
     */
     void HALT(int exitType) {
         // Close all files
-        fclose(inputFile);
-        fclose(outputFile);
+        if(inputFile) {
+            fclose(inputFile);
+        }
+        if(outputFile) {
+            fclose(outputFile);
+        }
 
-        // Close DMA
-        free(tokenList);
-        free(instructionList);
+        // Close DMA, the driver owns the token list
+        if(inputFile) {
+            free(tokenList);
+            free(tokenText);
+        }
+        free_compiler_state();
 
         // Exit
         exit(exitType);
     }
 
+    /*
+        Free the code and symbol table of the current compile and reset
+            their sizes so the next compile starts empty
+    */
+    void free_compiler_state() {
+        free(instructionList);
+        free(instructionLines);
+        free(symbolTable);
+        free(symbolBuckets);
+        free(scopes);
+
+        instructionList = NULL;
+        instructionLines = NULL;
+        symbolTable = NULL;
+        symbolBuckets = NULL;
+        scopes = NULL;
+
+        instructionListSize = symbolTableSize = scopeListSize = 0;
+        instructionIndex = symbolIndex = scopeCount = 0;
+    }
+
     /*
         Parent of all printing functions
     */
     void print_program() {
-        output_to_file();
+        if(optimizationLevel > 0) {
+            printf("Peephole optimizer removed %d instructions\n\n", removedInstructions);
+        }
+
+        if(binaryOutput) {
+            output_binary_to_file("elf.bin");
+        }
+        else if(cOutput) {
+            output_c_to_file("program.c", 500);
+        }
+        else {
+            output_to_file();
+        }
         output_to_terminal();
     }
 
@@ -1035,9 +1717,313 @@
         Print the instruction list to the output file
     */
     void output_to_file() {
+        phase_begin("phase", "output_to_file");
+
         for(int i = 0; i < instructionIndex; i++) {
             fprintf(outputFile, "%d %d %d\n", instructionList[i].o, instructionList[i].l, instructionList[i].m);
         }   
+
+        phase_count("instructions", instructionIndex);
+        phase_end();
+    }
+
+    /*
+        Convert the symbol table to the image layout. Returns the symbols,
+            which the caller frees, and stores their number in count.
+    */
+    ElfSymbol *compiled_symbols(int *count) {
+        ElfSymbol *symbols = malloc(sizeof(ElfSymbol) * (symbolIndex + 1));
+
+        for(int i = 0; i < symbolIndex; i++) {
+            memset(&symbols[i], 0, sizeof(ElfSymbol));
+            symbols[i].kind = symbolTable[i].kind;
+            symbols[i].val = symbolTable[i].val;
+            symbols[i].level = symbolTable[i].level;
+            symbols[i].addr = symbolTable[i].addr;
+            symbols[i].mark = symbolTable[i].mark;
+            strcpy(symbols[i].name, symbolTable[i].name);
+        }
+
+        *count = symbolIndex;
+        return symbols;
+    }
+
+    /*
+        Write the instruction list, symbol table and line numbers as a binary
+            image (see elf.c)
+    */
+    void output_binary_to_file(char *fileName) {
+        phase_begin("phase", "output_binary_to_file");
+
+        int symbolCount;
+        ElfSymbol *symbols = compiled_symbols(&symbolCount);
+
+        // Only keep line numbers if the lexer provided them
+        int *lines = NULL;
+        for(int i = 0; i < instructionIndex; i++) {
+            if(instructionLines[i] != 0) {
+                lines = instructionLines;
+                break;
+            }
+        }
+
+        int failed = elf_write(fileName, instructionList, instructionIndex, symbols, symbolCount, lines);
+        free(symbols);
+
+        phase_count("instructions", instructionIndex);
+        phase_end();
+
+        if(failed) {
+            ERROR("Error: Failed to write binary image");
+        }
+    }
+
+    /*
+        Runtime of the C translation: the PAS and the program output work as
+            they do in the fast mode of vm.c
+    */
+    static const char *cPrelude =
+        "#include <stdio.h>\n"
+        "#include <stdlib.h>\n"
+        "#include <limits.h>\n"
+        "\n"
+        "#ifndef PAS_SIZE\n"
+        "    #define PAS_SIZE %d\n"
+        "#endif\n"
+        "#define CODE_LENGTH %d\n"
+        "#define COUNT %d\n"
+        "#define ADDRESS(ip) (PAS_SIZE - 1 - 3 * (ip))\n"
+        "\n"
+        "#if CODE_LENGTH > PAS_SIZE\n"
+        "    #error Program does not fit in the PAS\n"
+        "#endif\n"
+        "\n"
+        "static int pas[PAS_SIZE];\n"
+        "static char output[65536];\n"
+        "static int outputLength = 0;\n"
+        "\n"
+        "void flush_output(void)\n"
+        "{\n"
+        "    fwrite(output, 1, outputLength, stdout);\n"
+        "    outputLength = 0;\n"
+        "    fflush(stdout);\n"
+        "}\n"
+        "\n"
+        "void write_output(int value)\n"
+        "{\n"
+        "    if(outputLength > (int)sizeof(output) - 64)\n"
+        "    {\n"
+        "        flush_output();\n"
+        "    }\n"
+        "    outputLength += sprintf(output + outputLength, \"Output result is: %%d\\n\", value);\n"
+        "}\n"
+        "\n"
+        "void fail(const char *message)\n"
+        "{\n"
+        "    flush_output();\n"
+        "    fprintf(stderr, \"%%s\", message);\n"
+        "    exit(1);\n"
+        "}\n"
+        "\n"
+        "void overflow(void)\n"
+        "{\n"
+        "    fail(\"Error: Stack overflow\");\n"
+        "}\n"
+        "\n"
+        "int divide(int left, int right)\n"
+        "{\n"
+        "    if(right == 0)\n"
+        "    {\n"
+        "        fail(\"Error: Division by zero\");\n"
+        "    }\n"
+        "    if(right == -1 && left == INT_MIN)\n"
+        "    {\n"
+        "        fail(\"Error: Division overflow\");\n"
+        "    }\n"
+        "    return left / right;\n"
+        "}\n"
+        "\n"
+        "int base(int bp, int l)\n"
+        "{\n"
+        "    while(l > 0)\n"
+        "    {\n"
+        "        bp = pas[bp];\n"
+        "        l--;\n"
+        "    }\n"
+        "    return bp;\n"
+        "}\n"
+        "\n"
+        "#define FRAME(l) ((l) == 0 ? bp : base(bp, (l)))\n"
+        "#define CHECK(address) if((address) < 0) overflow();\n"
+        "#define LIT(m) sp--; CHECK(sp) pas[sp] = (m);\n"
+        "#define LOD(l, m) sp--; address = FRAME(l) - (m); CHECK(sp) CHECK(address) pas[sp] = pas[address];\n"
+        "#define STO(l, m) address = FRAME(l) - (m); CHECK(address) pas[address] = pas[sp]; pas[sp] = 0; sp++;\n"
+        "#define OPERATION(operator) pas[sp + 1] = (int)((unsigned)pas[sp + 1] operator (unsigned)pas[sp]); \\\n"
+        "    pas[sp] = 0; sp++;\n"
+        "#define DIVIDE() pas[sp + 1] = divide(pas[sp + 1], pas[sp]); pas[sp] = 0; sp++;\n"
+        "#define COMPARE(operator) pas[sp + 1] = pas[sp + 1] operator pas[sp]; pas[sp] = 0; sp++;\n"
+        "#define EVEN() pas[sp] = pas[sp] %% 2 == 0;\n"
+        "#define INC(m) sp -= (m);\n"
+        "#define JPC(label) condition = pas[sp]; pas[sp] = 0; sp++; if(!condition) goto label;\n"
+        "#define CAL(l, label, returnIndex) CHECK(sp - 3) pas[sp - 1] = FRAME(l); pas[sp - 2] = bp; \\\n"
+        "    pas[sp - 3] = ADDRESS(returnIndex); bp = sp - 1; goto label;\n"
+        "#define RTN() sp = bp - 2; ip = (PAS_SIZE - 1 - pas[sp]) / 3; bp = pas[sp + 1]; sp += 3; goto dispatch;\n"
+        "#define OUT() value = pas[sp]; pas[sp] = 0; sp++; write_output(value);\n"
+        "#define READ() sp--; flush_output(); printf(\"Please Enter an Integer: \"); fflush(stdout); \\\n"
+        "    input = 0; if(scanf(\"%%d\", &input) != 1) fail(\"Error: Failed to read an integer\"); \\\n"
+        "    CHECK(sp) pas[sp] = input;\n"
+        "#define OPR_INVALID() fprintf(stderr, \"Invalid input\");\n"
+        "#define INVALID() flush_output(); fprintf(stderr, \"Invalid input\"); exit(1);\n"
+        "\n"
+        "int main(void)\n"
+        "{\n"
+        "    int bp = PAS_SIZE - 1 - CODE_LENGTH, sp = bp + 1;\n"
+        "    int ip, address, condition, value, input;\n"
+        "    (void)ip; (void)address; (void)condition; (void)value; (void)input;\n"
+        "\n";
+
+    /*
+        Write the program as a standalone C program, built with gcc -O2 into
+            an executable that prints what ./vm -f prints for the code.
+            Every instruction becomes a few statements over the same PAS
+            layout as vm.c (popped slots are zeroed, and stack overflows,
+            divisions by 0 and failed reads end the program with the VM's
+            messages), jumps and calls become gotos and a return goes
+            through a switch over the instructions that follow a call; any
+            other return address ends the program.
+
+        The whole program is one function: a procedure's frame lives in the
+            shared PAS, where uninitialized variables can see the values
+            left by earlier calls, so turning procedures into C functions
+            would change what such programs print.
+    */
+    void output_c_to_file(char *fileName, int pasSize) {
+        phase_begin("phase", "output_c_to_file");
+
+        int count = instructionIndex;
+        char *isLabel = calloc(count + 1, 1);
+        char **procedures = calloc(count + 1, sizeof(char *));
+        int hasReturn = 0;
+
+        // Find the instructions control reaches other than by falling through
+        for(int i = 0; i < count; i++) {
+            int o = instructionList[i].o, m = instructionList[i].m;
+
+            if(is_jump(o)) {
+                if(m < 0 || m / 3 > count) {
+                    free(isLabel);
+                    free(procedures);
+                    ERROR("Error: Jump outside the code");
+                }
+                isLabel[m / 3] = 1;
+            }
+            if(o == OPR && m == RTN) {
+                hasReturn = 1;
+            }
+        }
+        for(int i = 0; i < count && hasReturn; i++) {
+            if(instructionList[i].o == CAL) {
+                isLabel[i + 1] = 1;
+            }
+        }
+        isLabel[count] = 1;
+
+        for(int i = 0; i < symbolIndex; i++) {
+            if(symbolTable[i].kind == 3 && symbolTable[i].addr / 3 <= count) {
+                procedures[symbolTable[i].addr / 3] = symbolTable[i].name;
+            }
+        }
+
+        FILE *file = fopen(fileName, "w");
+        if(!file) {
+            free(isLabel);
+            free(procedures);
+            ERROR("Error: Failed to open file");
+        }
+
+        fprintf(file, "/*\n    Generated by parsercodegen -c from a PL/0 program\n\n");
+        fprintf(file, "    To Compile:\n        gcc -O2 -o program %s\n", fileName);
+        fprintf(file, "        (-DPAS_SIZE=<words> sets the size of the PAS, as vm -m does)\n*/\n\n");
+        fprintf(file, cPrelude, pasSize, count * 3, count);
+
+        // One line per instruction, labelled when something jumps to it
+        for(int i = 0; i < count; i++) {
+            int o = instructionList[i].o, l = instructionList[i].l, m = instructionList[i].m;
+
+            if(procedures[i]) {
+                fprintf(file, "    // procedure %s\n", procedures[i]);
+            }
+            if(isLabel[i]) {
+                fprintf(file, "L%d:\n", i);
+            }
+            fprintf(file, "    ");
+
+            switch(o) {
+                case LIT: fprintf(file, "LIT(%d)", m); break;
+                case LOD: fprintf(file, "LOD(%d, %d)", l, m); break;
+                case STO: fprintf(file, "STO(%d, %d)", l, m); break;
+                case CAL: fprintf(file, "CAL(%d, L%d, %d)", l, m / 3, i + 1); break;
+                case INC: fprintf(file, "INC(%d)", m); break;
+                case JMP: fprintf(file, "goto L%d;", m / 3); break;
+                case JPC: fprintf(file, "JPC(L%d)", m / 3); break;
+
+                case OPR:
+                    switch(m) {
+                        case RTN: fprintf(file, "RTN()"); break;
+                        case ADD: fprintf(file, "OPERATION(+)"); break;
+                        case SUB: fprintf(file, "OPERATION(-)"); break;
+                        case MUL: fprintf(file, "OPERATION(*)"); break;
+                        case DIV: fprintf(file, "DIVIDE()"); break;
+                        case EQL: fprintf(file, "COMPARE(==)"); break;
+                        case NEQ: fprintf(file, "COMPARE(!=)"); break;
+                        case LSS: fprintf(file, "COMPARE(<)"); break;
+                        case LEQ: fprintf(file, "COMPARE(<=)"); break;
+                        case GTR: fprintf(file, "COMPARE(>)"); break;
+                        case GEQ: fprintf(file, "COMPARE(>=)"); break;
+                        case EVEN: fprintf(file, "EVEN()"); break;
+                        default: fprintf(file, "OPR_INVALID()"); break;
+                    }
+                break;
+
+                case SYS:
+                    switch(m) {
+                        case OUT: fprintf(file, "OUT()"); break;
+                        case READ: fprintf(file, "READ()"); break;
+                        case HLT: fprintf(file, "goto L%d;", count); break;
+                        default: break;
+                    }
+                break;
+
+                default: fprintf(file, "INVALID()"); break;
+            }
+
+            fprintf(file, "\n");
+        }
+
+        // The end of the code, where HLT and unknown returns go
+        fprintf(file, "L%d:\n    flush_output();\n    return 0;\n\n", count);
+
+        // Returns land on an instruction that follows a call
+        if(hasReturn) {
+            fprintf(file, "dispatch:\n    switch(ip)\n    {\n");
+            for(int i = 1; i < count; i++) {
+                if(instructionList[i - 1].o == CAL) {
+                    fprintf(file, "        case %d: goto L%d;\n", i, i);
+                }
+            }
+            fprintf(file, "        default: goto L%d;\n    }\n", count);
+        }
+        fprintf(file, "}\n");
+
+        free(isLabel);
+        free(procedures);
+
+        if(fclose(file)) {
+            ERROR("Error: Failed to write C program");
+        }
+
+        phase_count("instructions", count);
+        phase_end();
     }
 
     /*
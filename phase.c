@@ -0,0 +1,235 @@
+/*
+    phase.c - Time the phases of a compile
+
+    Language: C
+
+    Notes:
+        - The lexer and the parser/code generator mark their phases with
+            phase_begin() and phase_end() and attach counts (tokens,
+            symbols, instructions) with phase_count(). Nothing is recorded
+            until phase_enable() is called, so an uninstrumented run pays
+            one test of a flag per phase.
+        - Every span records its wall time, its counts and the peak resident
+            memory of the process when it ended (getrusage(), so a phase
+            shows a higher peak only if it raised it).
+        - phase_report() prints a one line summary of the phase spans to
+            stderr and writes every span, including the nested BLOCK spans,
+            as a Chrome trace (chrome://tracing, Perfetto or speedscope
+            open it).
+        - The state is thread local: a thread that did not enable it records
+            nothing, so batch compiles (pl0batch.c) are unaffected.
+        - Used by lex.c, parsercodegen_complete.c and pl0.c (-T).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+    #include <unistd.h>
+    #include <sys/resource.h>
+
+    #include "pl0.h"
+
+// Constants
+    #define PHASE_NAME 32
+    #define PHASE_COUNTS 4
+
+// Structs
+    typedef struct {
+        char category[8];
+        char name[PHASE_NAME];
+        double start; // Microseconds since phase_enable()
+        double duration;
+        long peakKb; // Peak resident memory when the span ended
+
+        int countCount;
+        char *countKeys[PHASE_COUNTS];
+        long countValues[PHASE_COUNTS];
+    } PhaseSpan;
+
+// Variables
+    static _Thread_local int phaseOn = 0;
+    static _Thread_local char *traceName = NULL;
+    static _Thread_local double origin = 0;
+
+    static _Thread_local PhaseSpan *spans = NULL;
+    static _Thread_local int spanCount = 0, spanCapacity = 0;
+
+    static _Thread_local int *openSpans = NULL; // Spans begun and not yet ended, innermost last
+    static _Thread_local int openCount = 0, openCapacity = 0;
+
+// Functions
+    static double microseconds()
+    {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+    }
+
+    static long peak_kb()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+// Recording
+    /*
+        Start recording the phases of this thread. The trace is written to
+            traceFileName by phase_report(), unless it is NULL.
+    */
+    void phase_enable(char *traceFileName)
+    {
+        phaseOn = 1;
+        traceName = traceFileName;
+        origin = microseconds();
+        spanCount = 0;
+        openCount = 0;
+    }
+
+    int phase_enabled()
+    {
+        return phaseOn;
+    }
+
+    /*
+        Open a span inside the innermost open one. category is "phase" for
+            the phases of the summary.
+    */
+    void phase_begin(char *category, char *name)
+    {
+        if(!phaseOn)
+        {
+            return;
+        }
+
+        if(spanCount == spanCapacity)
+        {
+            spanCapacity = spanCapacity * 2 + 64;
+            spans = realloc(spans, sizeof(PhaseSpan) * spanCapacity);
+        }
+        if(openCount == openCapacity)
+        {
+            openCapacity = openCapacity * 2 + 16;
+            openSpans = realloc(openSpans, sizeof(int) * openCapacity);
+        }
+
+        PhaseSpan *span = &spans[spanCount];
+        memset(span, 0, sizeof(PhaseSpan));
+        snprintf(span->category, sizeof(span->category), "%s", category);
+        snprintf(span->name, sizeof(span->name), "%s", name);
+        span->start = microseconds() - origin;
+
+        openSpans[openCount++] = spanCount++;
+    }
+
+    /*
+        Attach a count to the innermost open span. key must stay valid (a
+            string literal).
+    */
+    void phase_count(char *key, long value)
+    {
+        if(!phaseOn || openCount == 0)
+        {
+            return;
+        }
+
+        PhaseSpan *span = &spans[openSpans[openCount - 1]];
+
+        if(span->countCount < PHASE_COUNTS)
+        {
+            span->countKeys[span->countCount] = key;
+            span->countValues[span->countCount] = value;
+            span->countCount++;
+        }
+    }
+
+    /*
+        Close the innermost open span
+    */
+    void phase_end()
+    {
+        if(!phaseOn || openCount == 0)
+        {
+            return;
+        }
+
+        PhaseSpan *span = &spans[openSpans[--openCount]];
+        span->duration = microseconds() - origin - span->start;
+        span->peakKb = peak_kb();
+    }
+
+// Output
+    /*
+        Print the summary line and write the trace
+    */
+    void phase_report()
+    {
+        if(!phaseOn)
+        {
+            return;
+        }
+
+        // Close what an early return left open
+        while(openCount > 0)
+        {
+            phase_end();
+        }
+
+        // One line: every phase with its time, counts and peak memory
+        fprintf(stderr, "Phases:");
+
+        int first = 1;
+        for(int i = 0; i < spanCount; i++)
+        {
+            PhaseSpan *span = &spans[i];
+
+            if(strcmp(span->category, "phase"))
+            {
+                continue;
+            }
+
+            fprintf(stderr, "%s %s %.3f ms", first ? "" : " |", span->name, span->duration / 1e3);
+            for(int k = 0; k < span->countCount; k++)
+            {
+                fprintf(stderr, " %ld %s", span->countValues[k], span->countKeys[k]);
+            }
+            fprintf(stderr, " %ld KB", span->peakKb);
+
+            first = 0;
+        }
+        fprintf(stderr, "\n");
+
+        // Chrome trace events, complete events nest by time
+        if(traceName)
+        {
+            FILE *file = fopen(traceName, "w");
+
+            if(!file)
+            {
+                fprintf(stderr, "Error: Could not write the trace to %s\n", traceName);
+                return;
+            }
+
+            fprintf(file, "{\"traceEvents\":[\n");
+
+            for(int i = 0; i < spanCount; i++)
+            {
+                PhaseSpan *span = &spans[i];
+
+                fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1,\"args\":{",
+                    span->name, span->category, span->start, span->duration, (int)getpid());
+                for(int k = 0; k < span->countCount; k++)
+                {
+                    fprintf(file, "\"%s\":%ld,", span->countKeys[k], span->countValues[k]);
+                }
+                fprintf(file, "\"peak_rss_kb\":%ld}}%s\n", span->peakKb, i + 1 < spanCount ? "," : "");
+            }
+
+            fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+            fclose(file);
+        }
+    }
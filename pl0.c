@@ -0,0 +1,358 @@
+/*
+    Assignment:
+    pl0.c - Compile and run a PL/0 program in a single process
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -std=c11 -DPL0_DRIVER -o pl0 pl0.c lex.c parsercodegen_complete.c vm.c elf.c phase.c cache.c differential.c
+
+    To Execute:
+        ./pl0 [-a] [-f] [-r | -j] [-d] [-s] [-p profile.txt] [-P stacks.txt] [-T trace.json]
+            [-O<level>] [-m words] [-H] [-C cachedir] [-o elf.bin | -c program.c] input.txt
+        ./pl0 -v        (prints the banner with the VM dispatch engine and
+                         the lexer's scanner set)
+
+    where:
+        input.txt is the path to the PL/0 source program, or - for stdin
+        -a prints the generated assembly code before running it
+        -f runs in the fast mode: program output only, no VM trace
+        -r runs the fast mode on the register engine
+        -j runs the fast mode on native x86-64 code
+        -d runs the program on the stack engine and on the engine selected
+            with -r or -j (the JIT by default) and checks that they agree
+        -s reports how many instructions the optimizer removed and how many
+            superinstructions ran (fast mode only), or how the register
+            engine or the JIT translated the program with -r or -j
+        -p writes the execution profile of the run (fast mode, stack engine;
+            see vm_profile.h) to profile.txt
+        -P writes the call paths of the run as folded stacks to stacks.txt
+        -T prints the time, counts and peak memory of every phase (lex,
+            PROGRAM, optimize, output, vm) to stderr and writes them, with a
+            span for every procedure body, as a Chrome trace to trace.json
+        -O1 and -O2 fold constants and run the peephole optimizer over the
+            generated code
+        -m sets the size of the VM address space in words (default 500)
+        -H backs the VM address space with transparent huge pages
+        -C runs (or with -o writes) the image of the program from the compile
+            cache in cachedir when the same source was compiled before at
+            the same level, and adds it to the cache otherwise (see cache.c;
+            ignored with -a, -s and -c, which need the compiler's state)
+        -o writes a binary image (with symbols and source lines) instead
+            of running the program
+        -c writes the program as a standalone C program instead of running
+            it (build it with gcc -O2; -m sets the size of its PAS)
+
+    Notes:
+        - Chains lex.c, parsercodegen_complete.c and vm.c in memory. The
+            token list from the lexer goes straight to the parser and the
+            instruction list goes straight into the VM, so lex_output.txt
+            and elf.txt are never written or read back.
+        - The standalone lex, parsercodegen and vm programs still work as
+            before.
+        - Built with -DPL0_SERVER it has no main() and pl0server.c calls
+            run_driver() instead.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <unistd.h>
+
+    #include "pl0.h"
+
+// Main
+#ifndef PL0_SERVER
+    int main(int argc, char *argv[])
+    {
+        return run_driver(argc, argv);
+    }
+#endif
+
+// Driver
+    /*
+        Everything pl0 does for one command line. pl0server.c runs it in a
+            child process for every run request of pl0client.c.
+    */
+    int run_driver(int argc, char *argv[])
+    {
+        // Print the banner
+        if(argc == 2 && !strcmp(argv[1], "-v"))
+        {
+            printf("PL/0 compiler (VM dispatch: %s, lexer scanner: %s)\n", dispatch_name(), scanner_name());
+            return 0;
+        }
+
+        // Validate command line arguments
+        int printAssembly = 0, trace = 1, size = 500, hugePages = 0, stats = 0;
+        int optimizeLevel = 0, engine = ENGINE_STACK, differential = 0;
+        char *inputFileName = NULL, *imageFileName = NULL, *cFileName = NULL;
+        char *profileFile = NULL, *foldedFile = NULL, *cacheDirectory = NULL;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if(!strcmp(argv[i], "-a"))
+            {
+                printAssembly = 1;
+            }
+            else if(!strcmp(argv[i], "-f"))
+            {
+                trace = 0;
+            }
+            else if(!strcmp(argv[i], "-s"))
+            {
+                stats = 1;
+            }
+            else if(!strcmp(argv[i], "-r"))
+            {
+                engine = ENGINE_REGISTER;
+                trace = 0;
+            }
+            else if(!strcmp(argv[i], "-j"))
+            {
+                engine = ENGINE_JIT;
+                trace = 0;
+            }
+            else if(!strcmp(argv[i], "-d"))
+            {
+                differential = 1;
+                trace = 0;
+            }
+            else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+            {
+                profileFile = argv[++i];
+                trace = 0;
+            }
+            else if(!strcmp(argv[i], "-P") && i + 1 < argc)
+            {
+                foldedFile = argv[++i];
+                trace = 0;
+            }
+            else if(!strcmp(argv[i], "-T") && i + 1 < argc)
+            {
+                phase_enable(argv[++i]);
+            }
+            else if(!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O2"))
+            {
+                optimizeLevel = argv[i][2] - '0';
+            }
+            else if(!strcmp(argv[i], "-m") && i + 1 < argc)
+            {
+                size = atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i], "-H"))
+            {
+                hugePages = 1;
+            }
+            else if(!strcmp(argv[i], "-C") && i + 1 < argc)
+            {
+                cacheDirectory = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+            {
+                imageFileName = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-c") && i + 1 < argc)
+            {
+                cFileName = argv[++i];
+            }
+            else if(!inputFileName)
+            {
+                inputFileName = argv[i];
+            }
+            else
+            {
+                inputFileName = NULL;
+                break;
+            }
+        }
+
+        if(!inputFileName || size <= 0)
+        {
+            fprintf(stderr, "Usage: pl0 [-a] [-f] [-r | -j] [-d] [-s] [-p profile.txt] [-P stacks.txt] [-T trace.json] [-O<level>] [-m words] [-H] [-C cachedir] [-o elf.bin | -c program.c] input.txt\n");
+            exit(1);
+        }
+
+        if(printAssembly || stats || cFileName)
+        {
+            cacheDirectory = NULL;
+        }
+
+        if(cacheDirectory && cache_open(cacheDirectory, 0))
+        {
+            exit(1);
+        }
+
+        // Open the source program
+            FILE *inputFile = strcmp(inputFileName, "-") ? fopen(inputFileName, "r") : stdin;
+
+            if(!inputFile)
+            {
+                fprintf(stderr, "Error: File not found");
+                exit(1);
+            }
+
+        // Look the source up in the compile cache, which needs all of it
+            char *source = NULL;
+            int sourceLength = 0;
+            char key[CACHE_KEY_SIZE], cachedImageName[CACHE_PATH];
+            ElfImage image;
+            int cached = 0;
+
+            if(cacheDirectory)
+            {
+                int sourceSize = 4096;
+                source = malloc(sourceSize);
+                sourceLength = copySrcToArray(inputFile, &source, &sourceSize);
+
+                cache_key(source, sourceLength, optimizeLevel, key);
+
+                if(imageFileName)
+                {
+                    cached = cache_fetch(key, imageFileName) >= 0;
+                }
+                else
+                {
+                    cached = cache_lookup(key, cachedImageName) && elf_open(cachedImageName, &image) == 0;
+                }
+            }
+
+        // Scan the source into tokens, in place or through a window
+            TokenList tokens = {0};
+
+            if(source && !cached)
+            {
+                lex_source(source, sourceLength, &tokens);
+            }
+            else if(!source)
+            {
+                lex_file(inputFile, &tokens);
+            }
+
+            if(inputFile != stdin)
+            {
+                fclose(inputFile);
+            }
+
+        // Parse the tokens and generate code
+            int codeSize = 0;
+            Instruction *code = cached ? NULL : compile_tokens(&tokens, optimizeLevel, &codeSize);
+
+            if(stats)
+            {
+                report_optimization();
+            }
+
+            if(printAssembly)
+            {
+                output_assembly_to_terminal();
+            }
+
+        // Add the image to the cache, through a temporary file when running
+            if(cacheDirectory && !cached)
+            {
+                if(imageFileName)
+                {
+                    output_binary_to_file(imageFileName);
+                    cache_store(key, imageFileName);
+                }
+                else
+                {
+                    snprintf(cachedImageName, CACHE_PATH, "%s/.pl0.%ld.tmp", cacheDirectory, (long)getpid());
+                    output_binary_to_file(cachedImageName);
+                    cache_store(key, cachedImageName);
+                    unlink(cachedImageName);
+                }
+            }
+
+        // Run the code, or save it for later
+            if(imageFileName)
+            {
+                // With -C the image was fetched from the cache or stored above
+                if(!cacheDirectory)
+                {
+                    output_binary_to_file(imageFileName);
+                }
+            }
+            else if(cFileName)
+            {
+                output_c_to_file(cFileName, size);
+            }
+            else
+            {
+                phase_begin("phase", "vm");
+                Vm *vm = vm_create(size, hugePages);
+
+                if(!vm)
+                {
+                    fprintf(stderr, "Error: Failed to map a PAS of %d words", size);
+                    exit(1);
+                }
+
+                int loaded;
+
+                if(cached)
+                {
+                    loaded = vm_load_image(vm, &image);
+                    elf_close(&image);
+                }
+                else
+                {
+                    loaded = vm_load(vm, code, codeSize);
+                }
+
+                if(loaded)
+                {
+                    fprintf(stderr, "%s", vm_error(vm));
+                    exit(1);
+                }
+
+                // Name the procedures in the profile (a cached image has them)
+                if((profileFile || foldedFile) && !cached)
+                {
+                    int symbolCount;
+                    ElfSymbol *symbols = compiled_symbols(&symbolCount);
+
+                    vm_load_symbols(vm, symbols, symbolCount);
+                    free(symbols);
+                }
+
+                vm_select_engine(vm, engine);
+                vm_select_profile(vm, profileFile, foldedFile);
+
+                int status = differential ? run_differential(vm, engine) : vm_run(vm, trace);
+                phase_end();
+
+                if(status)
+                {
+                    fprintf(stderr, "%s", vm_error(vm));
+                    exit(status);
+                }
+
+                if(stats && !differential)
+                {
+                    vm_report(vm);
+                }
+
+                vm_destroy(vm);
+            }
+
+            phase_report();
+
+            if(cacheDirectory)
+            {
+                cache_close();
+            }
+
+        // Free pointers
+        free_tokens(&tokens);
+        free(source);
+        free(code);
+
+        return 0;
+    }
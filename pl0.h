@@ -0,0 +1,337 @@
+/*
+    pl0.h - Definitions shared by the lexer, the parser/code generator, the
+        virtual machine and the in-memory driver (pl0.c)
+
+    Each of lex.c, parsercodegen_complete.c and vm.c still builds as its own
+        program. Compiling them together with -DPL0_DRIVER drops their main()
+        functions so that pl0.c can chain the stages without any files.
+*/
+
+#ifndef PL0_H
+#define PL0_H
+
+// Imports
+    #include <stdio.h>
+    #include <stdint.h>
+
+// Constants
+    #define MAX_WORD 11
+    #define MAX_NUMBER 5
+
+    // Version of the compiler, part of every compile cache key (see cache.c).
+    // Bump it whenever a change to the compiler changes the code it generates.
+    #define PL0_VERSION "1.4"
+    #define CACHE_KEY_SIZE 65 // 64 hex digits and the terminator
+    #define CACHE_DIRECTORY 2048 // Longest name of a cache directory
+    #define CACHE_PATH (CACHE_DIRECTORY + 512) // Room for any name in it
+
+// Enums
+    typedef enum
+    {
+        skipsym = 1,
+        identsym,
+        numbersym,
+        plussym,
+        minussym,
+        multsym,
+        slashsym,
+        eqlsym,
+        neqsym,
+        lessym,
+        leqsym,
+        gtrsym,
+        geqsym,
+        lparentsym,
+        rparentsym,
+        commasym,
+        semicolonsym,
+        periodsym,
+        becomessym,
+        beginsym,
+        endsym,
+        ifsym,
+        fisym,
+        thensym,
+        whilesym,
+        dosym,
+        callsym,
+        constsym,
+        varsym,
+        procsym,
+        writesym,
+        readsym,
+        elsesym,
+        evensym
+    } TokenType;
+
+    typedef enum {
+        LIT = 1,
+        OPR,
+        LOD,
+        STO,
+        CAL,
+        INC,
+        JMP,
+        JPC,
+        SYS,
+    } OPCode;
+
+    typedef enum {
+        RTN,
+        ADD,
+        SUB,
+        MUL,
+        DIV,
+        EQL,
+        NEQ,
+        LSS,
+        LEQ,
+        GTR,
+        GEQ,
+        EVEN
+    } OPCode2;
+
+    typedef enum {
+        OUT = 1,
+        READ,
+        HLT
+    } OPCode9;
+
+    // Execution engines of the VM for the fast mode (see vm_select_engine())
+    typedef enum {
+        ENGINE_STACK,
+        ENGINE_REGISTER,
+        ENGINE_JIT
+    } VmEngine;
+
+// Structs
+    /*
+        A scanned token. Identifiers and numbers keep their lexeme as a slice
+            (offset, length) of the text of their TokenList, which is not
+            NUL-terminated. Numbers also carry their value so nothing
+            downstream has to convert the digits again. line is 0 when
+            unknown.
+    */
+    typedef struct {
+        int type;
+        int value;
+        int line;
+        int length; // Length of the lexeme, 0 for keywords and symbols
+        long offset; // Start of the lexeme in the list's text
+    } Token;
+
+    /*
+        The tokens of a program, followed by a token of type 0. text is the
+            source itself when it stayed in memory (an array, or a mapped
+            file kept in map), otherwise the arena the lexemes were copied
+            into. Freed with free_tokens().
+    */
+    typedef struct {
+        Token *tokens;
+        int count;
+        int capacity;
+
+        char *text;
+
+        char *arena;
+        long arenaLength;
+        long arenaCapacity;
+
+        void *map;
+        size_t mapSize;
+    } TokenList;
+
+    typedef struct {
+        int o;
+        int l;
+        int m;
+    } Instruction;
+
+    /*
+        A virtual machine with its own PAS, program and output, defined in
+            vm.c. Machines share nothing, so each thread can run its own.
+    */
+    typedef struct Vm Vm;
+
+    /*
+        Size and shape of a program made by generate_program(). Every block
+            declares declarations constants and variables and, down to depth
+            levels of nesting, breadth procedures. Its body loops iterations
+            times over statements statements whose expressions have terms
+            terms.
+    */
+    typedef struct {
+        int depth;
+        int breadth;
+        int declarations;
+        int statements;
+        int terms;
+        int iterations;
+        int seed;
+    } ProgramShape;
+
+// Binary executable format (see elf.c)
+    /*
+        An image is a header, a section table and the section contents. All
+            fields are 32-bit integers in the byte order of the machine that
+            wrote the image. Readers skip section kinds they do not know.
+
+        ELF_SECTION_CODE    codeCount instructions, three words each (o l m)
+        ELF_SECTION_SYMBOLS symbol table entries (ElfSymbol)
+        ELF_SECTION_DEBUG   source line of each instruction, 0 when unknown
+    */
+    #define ELF_MAGIC "PM0\x7f"
+    #define ELF_VERSION 1
+
+    typedef enum {
+        ELF_SECTION_CODE = 1,
+        ELF_SECTION_SYMBOLS,
+        ELF_SECTION_DEBUG
+    } ElfSectionKind;
+
+    typedef struct {
+        char magic[4];
+        int32_t version;
+        int32_t sectionCount;
+        int32_t reserved;
+    } ElfHeader;
+
+    typedef struct {
+        int32_t kind;
+        int32_t offset; // Bytes from the start of the image
+        int32_t count; // Number of entries
+        int32_t reserved;
+    } ElfSection;
+
+    typedef struct {
+        int32_t kind;
+        int32_t val;
+        int32_t level;
+        int32_t addr;
+        int32_t mark;
+        char name[MAX_WORD + 1];
+    } ElfSymbol;
+
+    /*
+        A binary image mapped into memory. The section pointers point into the
+            mapping and are NULL when the image does not have that section.
+    */
+    typedef struct {
+        void *map;
+        size_t mapSize;
+
+        int32_t *code;
+        int codeCount;
+
+        ElfSymbol *symbols;
+        int symbolCount;
+
+        int32_t *lines;
+        int lineCount;
+    } ElfImage;
+
+// Compile server protocol (see pl0server.c)
+    /*
+        A client sends a request header and length bytes after it, and reads
+            a reply header and length bytes of message after that. Every
+            connection carries one request.
+
+        SERVER_COMPILE  the absolute name of the image to write, NUL
+                        terminated, then the source; compiled at
+                        optimizeLevel
+        SERVER_RUN      the working directory of the client and then
+                        argumentCount arguments of pl0, each NUL terminated;
+                        the header carries the client's stdin, stdout and
+                        stderr (SCM_RIGHTS), and status is how pl0 exited
+    */
+    #define PL0_SOCKET "/tmp/pl0server.sock"
+    #define SERVER_MAX_REQUEST (64 << 20) // Bytes
+
+    typedef enum {
+        SERVER_COMPILE = 1,
+        SERVER_RUN
+    } ServerRequestKind;
+
+    typedef struct {
+        int32_t kind;
+        int32_t optimizeLevel;
+        int32_t argumentCount;
+        int32_t length;
+    } ServerRequest;
+
+    typedef struct {
+        int32_t status; // Exit status of the request, 0 on success
+        int32_t codeSize; // Instructions in the image of a compile
+        int32_t length; // Bytes of the message (an error) that follow
+        int32_t reserved;
+    } ServerReply;
+
+// Functions
+    // elf.c
+    int elf_is_binary(char *fileName);
+    int elf_open(char *fileName, ElfImage *image);
+    void elf_close(ElfImage *image);
+    int elf_write(char *fileName, Instruction *code, int codeCount,
+        ElfSymbol *symbols, int symbolCount, int *lines);
+
+    // cache.c
+    int cache_open(char *directory, long maxBytes);
+    void cache_key(char *source, long length, int optimizeLevel, char *key);
+    int cache_lookup(char *key, char *imagePath);
+    int cache_fetch(char *key, char *imageFileName);
+    int cache_store(char *key, char *imageFileName);
+    void cache_close();
+    void cache_report();
+
+    // phase.c
+    void phase_enable(char *traceFileName);
+    int phase_enabled();
+    void phase_begin(char *category, char *name);
+    void phase_count(char *key, long value);
+    void phase_end();
+    void phase_report();
+
+    // lex.c
+    int copySrcToArray(FILE *fp, char **arr, int *arrSize);
+    int lex_source(char *arr, int charsRead, TokenList *list);
+    int lex_file(FILE *fp, TokenList *list);
+    void free_tokens(TokenList *list);
+    char *scanner_name();
+
+    // parsercodegen_complete.c
+    Instruction *compile_tokens(TokenList *list, int optimizeLevel, int *codeSize);
+    int compile_to_image(TokenList *list, int optimizeLevel, char *imageFileName, char **error);
+    void report_optimization();
+    void output_assembly_to_terminal();
+    void output_binary_to_file(char *fileName);
+    void output_c_to_file(char *fileName, int pasSize);
+    void free_compiler_state();
+    ElfSymbol *compiled_symbols(int *count);
+
+    // vm.c
+    Vm *vm_create(int size, int hugePages);
+    int vm_load(Vm *vm, Instruction *code, int count);
+    int vm_load_image(Vm *vm, ElfImage *image);
+    void vm_load_symbols(Vm *vm, ElfSymbol *symbols, int count);
+    void vm_set_streams(Vm *vm, FILE *input, FILE *output);
+    void vm_select_engine(Vm *vm, int engine);
+    void vm_select_profile(Vm *vm, char *profileFile, char *foldedFile);
+    int vm_run(Vm *vm, int trace);
+    long vm_count_instructions(Vm *vm);
+    char *vm_error(Vm *vm);
+    void vm_report(Vm *vm);
+    int vm_reads_input(Vm *vm);
+    uint64_t vm_hash(Vm *vm);
+    void vm_destroy(Vm *vm);
+    char *dispatch_name();
+
+    // differential.c
+    int run_differential(Vm *vm, int engine);
+
+    // pl0.c
+    int run_driver(int argc, char *argv[]);
+
+    // pl0gen.c
+    char *generate_program(ProgramShape *shape, long *length);
+
+#endif
@@ -0,0 +1,598 @@
+/*
+    Assignment:
+    pl0batch.c - Compile many PL/0 programs at once on every core
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -std=c11 -pthread -DPL0_DRIVER -o pl0batch pl0batch.c lex.c parsercodegen_complete.c elf.c phase.c cache.c
+
+    To Execute:
+        ./pl0batch [-j threads] [-O<level>] [-d outdir] [-l list.txt]
+            [-C cachedir [-M megabytes]] source.txt... directory...
+
+    where:
+        source.txt is a PL/0 source program, compiled to source.bin
+        directory compiles every .txt file in the directory
+        -j sets the number of worker threads (default: one per core)
+        -O1 and -O2 fold constants and run the peephole optimizer
+        -d writes the binary images to outdir instead of next to the sources
+        -l also compiles every source listed in list.txt, one per line
+        -C keeps the images in the compile cache in cachedir (see cache.c):
+            a source compiled before with the same compiler and level is
+            copied out of the cache instead of being compiled again
+        -M limits the cache to megabytes (default: the limit it was created
+            with, 64 MB for a new cache)
+
+    Notes:
+        - Every worker owns a deque of jobs. It takes jobs from the back of
+            its own deque and, once that is empty, steals from the front of
+            the others, so a few slow programs cannot leave cores idle.
+        - The parser keeps its state in thread local variables and
+            compile_to_image() stops only the failing compile, so one bad
+            program is reported without stopping the batch.
+        - Prints the failures to stderr and a throughput and latency report
+            to stdout. Exits with 1 when any program failed.
+        - With -C the report also counts the programs that came from the
+            cache, and the cache prints its hits and misses to stderr.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+    #include <dirent.h>
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+
+    #include "pl0.h"
+
+// Structs
+    typedef struct {
+        char *sourceName;
+        char *imageName;
+
+        long bytes; // Size of the source
+        int tokenCount;
+        int codeSize; // Instructions generated, -1 when the compile failed
+        int cached; // The image came from the compile cache
+        char *error;
+        double seconds; // Latency of the job
+    } Job;
+
+    /*
+        Jobs first..last-1 are still waiting. The owner takes from last,
+            thieves take from first.
+    */
+    typedef struct {
+        pthread_mutex_t lock;
+        int *jobs;
+        int first;
+        int last;
+        int steals; // Jobs this worker took from other deques
+    } Deque;
+
+// Functions
+    void add_source(char *sourceName, char *outputDirectory);
+    void add_directory(char *directoryName, char *outputDirectory);
+    void add_list(char *listName, char *outputDirectory);
+
+    void *worker(void *argument);
+    int take_job(int self);
+    void run_job(Job *job);
+    void run_cached_job(Job *job, FILE *sourceFile);
+
+    double now();
+    int compare_names(const void *a, const void *b);
+    int compare_doubles(const void *a, const void *b);
+    void report(double seconds);
+
+// Variables
+    Job *jobList = NULL;
+    int jobCount = 0, jobListSize = 0;
+
+    Deque *deques;
+    int threadCount = 0;
+    int optimizeLevel = 0;
+    char *cacheDirectory = NULL;
+
+// Main
+    int main(int argc, char *argv[])
+    {
+        // Validate command line arguments
+        char *outputDirectory = NULL;
+        long cacheLimit = 0;
+        int sources = 0;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if(!strcmp(argv[i], "-j") && i + 1 < argc)
+            {
+                threadCount = atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O2"))
+            {
+                optimizeLevel = argv[i][2] - '0';
+            }
+            else if(!strcmp(argv[i], "-d") && i + 1 < argc)
+            {
+                outputDirectory = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-C") && i + 1 < argc)
+            {
+                cacheDirectory = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-M") && i + 1 < argc)
+            {
+                cacheLimit = atol(argv[++i]) << 20;
+            }
+            else if(!strcmp(argv[i], "-l") && i + 1 < argc)
+            {
+                i++;
+                sources++;
+            }
+            else if(argv[i][0] == '-')
+            {
+                sources = 0;
+                break;
+            }
+            else
+            {
+                sources++;
+            }
+        }
+
+        if(sources == 0)
+        {
+            fprintf(stderr, "Usage: pl0batch [-j threads] [-O<level>] [-d outdir] [-l list.txt] [-C cachedir [-M megabytes]] source.txt... directory...\n");
+            exit(1);
+        }
+
+        if(cacheDirectory && cache_open(cacheDirectory, cacheLimit))
+        {
+            exit(1);
+        }
+
+        // Collect the jobs, skipping the options read above
+        for(int i = 1; i < argc; i++)
+        {
+            struct stat info;
+
+            if(!strcmp(argv[i], "-j") || !strcmp(argv[i], "-d") || !strcmp(argv[i], "-C") || !strcmp(argv[i], "-M"))
+            {
+                i++;
+            }
+            else if(!strcmp(argv[i], "-l"))
+            {
+                add_list(argv[++i], outputDirectory);
+            }
+            else if(argv[i][0] == '-')
+            {
+                continue;
+            }
+            else if(stat(argv[i], &info) == 0 && S_ISDIR(info.st_mode))
+            {
+                add_directory(argv[i], outputDirectory);
+            }
+            else
+            {
+                add_source(argv[i], outputDirectory);
+            }
+        }
+
+        if(threadCount <= 0)
+        {
+            threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if(threadCount > jobCount)
+        {
+            threadCount = jobCount > 0 ? jobCount : 1;
+        }
+
+        // Build the lexer tables once before the workers share them
+        scanner_name();
+
+        // Deal the jobs out round robin
+        deques = calloc(threadCount, sizeof(Deque));
+
+        for(int t = 0; t < threadCount; t++)
+        {
+            pthread_mutex_init(&deques[t].lock, NULL);
+            deques[t].jobs = malloc(sizeof(int) * (jobCount / threadCount + 1));
+        }
+        for(int i = 0; i < jobCount; i++)
+        {
+            Deque *deque = &deques[i % threadCount];
+            deque->jobs[deque->last++] = i;
+        }
+
+        // Run the workers until every deque is empty
+        double start = now();
+        pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+
+        for(int t = 0; t < threadCount; t++)
+        {
+            pthread_create(&threads[t], NULL, worker, (void *)(long)t);
+        }
+        for(int t = 0; t < threadCount; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+
+        report(now() - start);
+
+        if(cacheDirectory)
+        {
+            cache_close();
+            cache_report();
+        }
+
+        // Free pointers
+        int failed = 0;
+
+        for(int i = 0; i < jobCount; i++)
+        {
+            failed |= jobList[i].codeSize < 0;
+            free(jobList[i].sourceName);
+            free(jobList[i].imageName);
+        }
+        for(int t = 0; t < threadCount; t++)
+        {
+            pthread_mutex_destroy(&deques[t].lock);
+            free(deques[t].jobs);
+        }
+        free(jobList);
+        free(deques);
+        free(threads);
+
+        return failed;
+    }
+
+// Collecting jobs
+    /*
+        Add a source to the batch. Its image goes next to it, or into
+            outputDirectory, with the extension replaced by .bin
+    */
+    void add_source(char *sourceName, char *outputDirectory)
+    {
+        if(jobCount == jobListSize)
+        {
+            jobListSize = jobListSize ? jobListSize * 2 : 64;
+            jobList = realloc(jobList, sizeof(Job) * jobListSize);
+        }
+
+        // Build the image name
+        char *base = sourceName;
+        if(outputDirectory && strrchr(sourceName, '/'))
+        {
+            base = strrchr(sourceName, '/') + 1;
+        }
+
+        char *extension = strrchr(base, '.');
+        int baseLength = (extension && !strchr(extension, '/')) ? extension - base : (int)strlen(base);
+
+        char *imageName = malloc((outputDirectory ? strlen(outputDirectory) + 1 : 0) + baseLength + 5);
+        if(outputDirectory)
+        {
+            sprintf(imageName, "%s/%.*s.bin", outputDirectory, baseLength, base);
+        }
+        else
+        {
+            sprintf(imageName, "%.*s.bin", baseLength, base);
+        }
+
+        Job *job = &jobList[jobCount++];
+        memset(job, 0, sizeof(Job));
+        job->sourceName = strdup(sourceName);
+        job->imageName = imageName;
+        job->codeSize = -1;
+    }
+
+    /*
+        Add every .txt file of a directory, in name order
+    */
+    void add_directory(char *directoryName, char *outputDirectory)
+    {
+        DIR *directory = opendir(directoryName);
+
+        if(!directory)
+        {
+            fprintf(stderr, "Error: Failed to open directory %s\n", directoryName);
+            exit(1);
+        }
+
+        char **names = NULL;
+        int nameCount = 0, nameListSize = 0;
+        struct dirent *entry;
+
+        while((entry = readdir(directory)))
+        {
+            int length = strlen(entry->d_name);
+
+            if(length <= 4 || strcmp(entry->d_name + length - 4, ".txt"))
+            {
+                continue;
+            }
+
+            if(nameCount == nameListSize)
+            {
+                nameListSize = nameListSize ? nameListSize * 2 : 64;
+                names = realloc(names, sizeof(char *) * nameListSize);
+            }
+
+            names[nameCount] = malloc(strlen(directoryName) + length + 2);
+            sprintf(names[nameCount], "%s/%s", directoryName, entry->d_name);
+            nameCount++;
+        }
+        closedir(directory);
+
+        qsort(names, nameCount, sizeof(char *), compare_names);
+
+        for(int i = 0; i < nameCount; i++)
+        {
+            add_source(names[i], outputDirectory);
+            free(names[i]);
+        }
+        free(names);
+    }
+
+    /*
+        Add every source named in a list file, one per line
+    */
+    void add_list(char *listName, char *outputDirectory)
+    {
+        FILE *list = fopen(listName, "r");
+
+        if(!list)
+        {
+            fprintf(stderr, "Error: Failed to open list %s\n", listName);
+            exit(1);
+        }
+
+        char *line = NULL;
+        size_t lineSize = 0;
+
+        while(getline(&line, &lineSize, list) != -1)
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+
+            if(line[0] != '\0')
+            {
+                add_source(line, outputDirectory);
+            }
+        }
+
+        free(line);
+        fclose(list);
+    }
+
+// Workers
+    /*
+        Run jobs until there are none left anywhere. Jobs never create new
+            jobs, so once every deque is empty the worker is done.
+    */
+    void *worker(void *argument)
+    {
+        int self = (long)argument;
+        int job;
+
+        while((job = take_job(self)) != -1)
+        {
+            run_job(&jobList[job]);
+        }
+
+        return NULL;
+    }
+
+    /*
+        Returns the next job for a worker, from its own deque or stolen from
+            another one, or -1 when every deque is empty
+    */
+    int take_job(int self)
+    {
+        // Take the newest job of our own deque
+        Deque *own = &deques[self];
+        int job = -1;
+
+        pthread_mutex_lock(&own->lock);
+        if(own->first < own->last)
+        {
+            job = own->jobs[--own->last];
+        }
+        pthread_mutex_unlock(&own->lock);
+
+        if(job != -1)
+        {
+            return job;
+        }
+
+        // Steal the oldest job of the next worker that still has any
+        for(int i = 1; i < threadCount && job == -1; i++)
+        {
+            Deque *victim = &deques[(self + i) % threadCount];
+
+            pthread_mutex_lock(&victim->lock);
+            if(victim->first < victim->last)
+            {
+                job = victim->jobs[victim->first++];
+            }
+            pthread_mutex_unlock(&victim->lock);
+        }
+
+        if(job != -1)
+        {
+            own->steals++;
+        }
+
+        return job;
+    }
+
+    /*
+        Lex and compile one source into its image, timing the whole job
+    */
+    void run_job(Job *job)
+    {
+        double start = now();
+        FILE *sourceFile = fopen(job->sourceName, "r");
+
+        if(!sourceFile)
+        {
+            job->error = "Error: File not found";
+            job->seconds = now() - start;
+            return;
+        }
+
+        struct stat info;
+        if(fstat(fileno(sourceFile), &info) == 0)
+        {
+            job->bytes = info.st_size;
+        }
+
+        if(cacheDirectory)
+        {
+            run_cached_job(job, sourceFile);
+            fclose(sourceFile);
+            job->seconds = now() - start;
+            return;
+        }
+
+        TokenList tokens;
+        job->tokenCount = lex_file(sourceFile, &tokens);
+        fclose(sourceFile);
+
+        job->codeSize = compile_to_image(&tokens, optimizeLevel, job->imageName, &job->error);
+
+        free_tokens(&tokens);
+        job->seconds = now() - start;
+    }
+
+    /*
+        Copy the image out of the cache, or compile the source and add its
+            image to the cache. The source is read whole as the key hashes
+            every byte of it.
+    */
+    void run_cached_job(Job *job, FILE *sourceFile)
+    {
+        char *source = malloc(job->bytes + 1);
+        long length = fread(source, 1, job->bytes, sourceFile);
+
+        char key[CACHE_KEY_SIZE];
+        cache_key(source, length, optimizeLevel, key);
+
+        job->codeSize = cache_fetch(key, job->imageName);
+
+        if(job->codeSize >= 0)
+        {
+            job->cached = 1;
+        }
+        else
+        {
+            TokenList tokens;
+            job->tokenCount = lex_source(source, length, &tokens);
+            job->codeSize = compile_to_image(&tokens, optimizeLevel, job->imageName, &job->error);
+            free_tokens(&tokens);
+
+            if(job->codeSize >= 0)
+            {
+                cache_store(key, job->imageName);
+            }
+        }
+
+        free(source);
+    }
+
+// Reporting
+    /*
+        Returns the time in seconds on the monotonic clock
+    */
+    double now()
+    {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec + time.tv_nsec / 1e9;
+    }
+
+    int compare_names(const void *a, const void *b)
+    {
+        return strcmp(*(char **)a, *(char **)b);
+    }
+
+    int compare_doubles(const void *a, const void *b)
+    {
+        double x = *(double *)a, y = *(double *)b;
+        return (x > y) - (x < y);
+    }
+
+    /*
+        Print the failures, then the throughput of the batch and the latency
+            of its jobs
+    */
+    void report(double seconds)
+    {
+        int failed = 0, steals = 0, cached = 0;
+        long bytes = 0, tokens = 0, instructions = 0;
+        double *latencies = malloc(sizeof(double) * (jobCount + 1));
+        double total = 0;
+
+        for(int i = 0; i < jobCount; i++)
+        {
+            Job *job = &jobList[i];
+
+            if(job->codeSize < 0)
+            {
+                fprintf(stderr, "%s: %s\n", job->sourceName, job->error ? job->error : "Error: Compile failed");
+                failed++;
+            }
+            else
+            {
+                instructions += job->codeSize;
+            }
+
+            bytes += job->bytes;
+            tokens += job->tokenCount;
+            cached += job->cached;
+            latencies[i] = job->seconds;
+            total += job->seconds;
+        }
+        for(int t = 0; t < threadCount; t++)
+        {
+            steals += deques[t].steals;
+        }
+
+        qsort(latencies, jobCount, sizeof(double), compare_doubles);
+        if(seconds <= 0)
+        {
+            seconds = 1e-9;
+        }
+
+        printf("Compiled %d programs (%d failed) on %d threads in %.3f s, %d jobs stolen\n",
+            jobCount, failed, threadCount, seconds, steals
+        );
+        if(cacheDirectory)
+        {
+            printf("Cached: %d programs copied from the cache, %d compiled\n", cached, jobCount - cached);
+        }
+        printf("Throughput: %.1f programs/s, %.2f MB/s, %.0f tokens/s, %.0f instructions/s\n",
+            jobCount / seconds, bytes / seconds / 1e6, tokens / seconds, instructions / seconds
+        );
+
+        if(jobCount > 0)
+        {
+            printf("Latency (ms): min %.3f, mean %.3f, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+                latencies[0] * 1e3,
+                total / jobCount * 1e3,
+                latencies[jobCount / 2] * 1e3,
+                latencies[(int)(jobCount * 0.95)] * 1e3,
+                latencies[(int)(jobCount * 0.99)] * 1e3,
+                latencies[jobCount - 1] * 1e3
+            );
+        }
+
+        free(latencies);
+    }
@@ -0,0 +1,488 @@
+/*
+    Assignment:
+    pl0bench.c - Time the lexer, the parser/code generator and the VM
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -std=c11 -DPL0_DRIVER -o pl0bench pl0bench.c pl0gen.c lex.c parsercodegen_complete.c vm.c elf.c phase.c -lm
+
+    To Execute:
+        ./pl0bench [-n runs] [-O<level>] [-r | -j] [-m words] [-w baseline.txt]
+            [-b baseline.txt] [-t percent] [source.txt...]
+
+    where:
+        source.txt is a PL/0 program to time; without any, the standard
+            workloads made by pl0gen.c are timed instead
+        -n sets how many timed runs every workload gets (default 10), after
+            one run that is not timed
+        -O1 and -O2 fold constants and run the peephole optimizer
+        -r and -j run the VM on the register engine or the JIT
+        -m sets the size of the VM address space in words (default 4000000)
+        -w writes the median time of every workload and stage to
+            baseline.txt
+        -b compares the median times with baseline.txt and reports every
+            stage that got slower by more than the tolerance
+        -t sets the tolerance of -b in percent (default 10)
+
+    Notes:
+        - Every run lexes, compiles and runs the workload in this process,
+            timing each stage apart and all three together. The VM stage
+            includes creating the PAS and loading the code; the output of
+            the program is thrown away.
+        - Rates are the counts of one run divided by the median time:
+            tokens per second for the lexer, instructions emitted per
+            second for the parser/code generator and instructions run per
+            second for the VM. The VM count is of unfused stack machine
+            instructions (see vm_count_instructions()), so the rates of every
+            engine compare directly. The spread after each rate is the
+            coefficient of variation of the times.
+        - The standard workloads stress one thing each: many declarations,
+            deeply nested procedures, long expressions and tight loops.
+        - Exits with 1 when -b found a regression, so a script can fail on it.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <math.h>
+    #include <time.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+
+    #include "pl0.h"
+
+// Constants
+    #define STAGE_COUNT 4
+    #define MAX_NAME 64
+
+// Structs
+    typedef struct {
+        char name[MAX_NAME];
+        char *text; // Source of the program
+        long length;
+
+        // Counts of one run
+        int tokenCount;
+        int codeSize;
+        long steps;
+
+        double *seconds[STAGE_COUNT]; // Time of every run, per stage
+        double median[STAGE_COUNT];
+        double spread[STAGE_COUNT]; // Coefficient of variation
+    } Workload;
+
+// Functions
+    Workload *new_workload(char *name);
+    void add_generated(char *name, ProgramShape shape);
+    void add_file(char *fileName);
+
+    void run_workload(Workload *workload, int run);
+    void measure(Workload *workload);
+    void report();
+    void write_baseline(char *fileName);
+    int compare_baseline(char *fileName);
+
+    double now();
+    int compare_doubles(const void *a, const void *b);
+    void silence_output(int silence);
+
+// Variables
+    char *stageNames[STAGE_COUNT] = {"lex", "parse", "vm", "total"};
+
+    Workload *workloads = NULL;
+    int workloadCount = 0;
+
+    int runs = 10;
+    int optimizeLevel = 0;
+    int pasWords = 4000000;
+    int engine = ENGINE_STACK;
+    double tolerance = 10;
+
+// Main
+    int main(int argc, char *argv[])
+    {
+        // Validate command line arguments
+        char *baselineOut = NULL, *baselineIn = NULL;
+        int valid = 1;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if(!strcmp(argv[i], "-n") && i + 1 < argc)
+            {
+                runs = atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O2"))
+            {
+                optimizeLevel = argv[i][2] - '0';
+            }
+            else if(!strcmp(argv[i], "-r"))
+            {
+                engine = ENGINE_REGISTER;
+            }
+            else if(!strcmp(argv[i], "-j"))
+            {
+                engine = ENGINE_JIT;
+            }
+            else if(!strcmp(argv[i], "-m") && i + 1 < argc)
+            {
+                pasWords = atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i], "-w") && i + 1 < argc)
+            {
+                baselineOut = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-b") && i + 1 < argc)
+            {
+                baselineIn = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+            {
+                tolerance = atof(argv[++i]);
+            }
+            else if(argv[i][0] == '-')
+            {
+                valid = 0;
+            }
+            else
+            {
+                add_file(argv[i]);
+            }
+        }
+
+        if(!valid || runs <= 0 || pasWords <= 0)
+        {
+            fprintf(stderr, "Usage: pl0bench [-n runs] [-O<level>] [-r | -j] [-m words] [-w baseline.txt] [-b baseline.txt] [-t percent] [source.txt...]\n");
+            exit(1);
+        }
+
+        // The standard workloads
+        if(workloadCount == 0)
+        {
+            //                                depth breadth declarations statements terms iterations seed
+            add_generated("declarations", (ProgramShape){1, 100, 250, 4, 3, 2, 1});
+            add_generated("nesting", (ProgramShape){14, 1, 6, 12, 6, 2000, 2});
+            add_generated("expressions", (ProgramShape){0, 0, 30, 3000, 60, 1, 3});
+            add_generated("loops", (ProgramShape){1, 2, 6, 6, 4, 99999, 4});
+        }
+
+        for(int i = 0; i < workloadCount; i++)
+        {
+            measure(&workloads[i]);
+        }
+
+        report();
+
+        if(baselineOut)
+        {
+            write_baseline(baselineOut);
+        }
+
+        return baselineIn && compare_baseline(baselineIn) ? 1 : 0;
+    }
+
+// Workloads
+    Workload *new_workload(char *name)
+    {
+        workloads = realloc(workloads, sizeof(Workload) * (workloadCount + 1));
+
+        Workload *workload = &workloads[workloadCount++];
+        memset(workload, 0, sizeof(Workload));
+        snprintf(workload->name, MAX_NAME, "%s", name);
+
+        return workload;
+    }
+
+    void add_generated(char *name, ProgramShape shape)
+    {
+        Workload *workload = new_workload(name);
+        workload->text = generate_program(&shape, &workload->length);
+    }
+
+    void add_file(char *fileName)
+    {
+        FILE *file = fopen(fileName, "r");
+
+        if(!file)
+        {
+            fprintf(stderr, "Error: File not found: %s\n", fileName);
+            exit(1);
+        }
+
+        Workload *workload = new_workload(fileName);
+
+        // copySrcToArray only grows a buffer it was given
+        int size = 4096;
+        workload->text = malloc(size);
+
+        workload->length = copySrcToArray(file, &workload->text, &size);
+        fclose(file);
+    }
+
+// Timing
+    /*
+        Lex, compile and run the workload once. With run at 0 or more, the
+            times of every stage are stored as that run.
+    */
+    void run_workload(Workload *workload, int run)
+    {
+        TokenList tokens;
+        int codeSize;
+
+        double start = now();
+        lex_source(workload->text, workload->length, &tokens);
+
+        double lexed = now();
+        Instruction *code = compile_tokens(&tokens, optimizeLevel, &codeSize);
+
+        double compiled = now();
+        Vm *vm = vm_create(pasWords, 0);
+
+        if(!vm)
+        {
+            fprintf(stderr, "Error: Failed to map a PAS of %d words\n", pasWords);
+            exit(1);
+        }
+
+        if(vm_load(vm, code, codeSize))
+        {
+            fprintf(stderr, "Error: %s: %s\n", workload->name, vm_error(vm));
+            exit(1);
+        }
+
+        vm_select_engine(vm, engine);
+        silence_output(1);
+        int status = vm_run(vm, 0);
+        silence_output(0);
+
+        if(status)
+        {
+            fprintf(stderr, "Error: %s: %s\n", workload->name, vm_error(vm));
+            exit(1);
+        }
+
+        double finished = now();
+
+        if(run >= 0)
+        {
+            workload->seconds[0][run] = lexed - start;
+            workload->seconds[1][run] = compiled - lexed;
+            workload->seconds[2][run] = finished - compiled;
+            workload->seconds[3][run] = finished - start;
+        }
+        else
+        {
+            // Count what one run does
+            workload->tokenCount = tokens.count;
+            workload->codeSize = codeSize;
+
+            silence_output(1);
+            workload->steps = vm_count_instructions(vm);
+            silence_output(0);
+        }
+
+        vm_destroy(vm);
+
+        free_compiler_state();
+        free_tokens(&tokens);
+    }
+
+    /*
+        Run the workload once to count and warm up, then runs times, and
+            take the median and spread of every stage
+    */
+    void measure(Workload *workload)
+    {
+        for(int s = 0; s < STAGE_COUNT; s++)
+        {
+            workload->seconds[s] = malloc(sizeof(double) * runs);
+        }
+
+        run_workload(workload, -1);
+
+        for(int run = 0; run < runs; run++)
+        {
+            run_workload(workload, run);
+        }
+
+        for(int s = 0; s < STAGE_COUNT; s++)
+        {
+            double *seconds = workload->seconds[s];
+            double mean = 0, variance = 0;
+
+            for(int run = 0; run < runs; run++)
+            {
+                mean += seconds[run] / runs;
+            }
+            for(int run = 0; run < runs; run++)
+            {
+                variance += (seconds[run] - mean) * (seconds[run] - mean) / runs;
+            }
+
+            qsort(seconds, runs, sizeof(double), compare_doubles);
+
+            workload->median[s] = runs % 2 ? seconds[runs / 2] : (seconds[runs / 2 - 1] + seconds[runs / 2]) / 2;
+            workload->spread[s] = mean > 0 ? sqrt(variance) / mean * 100 : 0;
+        }
+    }
+
+// Reports
+    void report()
+    {
+        printf("%-14s %10s %10s %10s %12s\n", "workload", "bytes", "tokens", "code", "vm steps");
+
+        for(int i = 0; i < workloadCount; i++)
+        {
+            Workload *w = &workloads[i];
+            printf("%-14s %10ld %10d %10d %12ld\n", w->name, w->length, w->tokenCount, w->codeSize, w->steps);
+        }
+
+        printf("\n%-14s %18s %18s %18s %18s\n", "workload", "lex Mtokens/s", "parse Minstr/s", "vm Msteps/s", "total ms");
+
+        for(int i = 0; i < workloadCount; i++)
+        {
+            Workload *w = &workloads[i];
+            double counts[3] = {w->tokenCount, w->codeSize, w->steps};
+
+            printf("%-14s", w->name);
+
+            for(int s = 0; s < 3; s++)
+            {
+                double rate = w->median[s] > 0 ? counts[s] / w->median[s] / 1e6 : 0;
+                printf(" %10.2f ±%5.1f%%", rate, w->spread[s]);
+            }
+
+            printf(" %10.3f ±%5.1f%%\n", w->median[3] * 1e3, w->spread[3]);
+        }
+
+        printf("\n%d runs per workload, medians with their coefficient of variation\n", runs);
+    }
+
+    /*
+        One line per workload and stage: name, stage and median seconds
+    */
+    void write_baseline(char *fileName)
+    {
+        FILE *file = fopen(fileName, "w");
+
+        if(!file)
+        {
+            fprintf(stderr, "Error: Could not write the baseline to %s\n", fileName);
+            exit(1);
+        }
+
+        fprintf(file, "# pl0bench baseline: workload stage seconds\n");
+
+        for(int i = 0; i < workloadCount; i++)
+        {
+            for(int s = 0; s < STAGE_COUNT; s++)
+            {
+                fprintf(file, "%s %s %.9f\n", workloads[i].name, stageNames[s], workloads[i].median[s]);
+            }
+        }
+
+        fclose(file);
+    }
+
+    /*
+        Compare every stage with its line in the baseline. Returns the number
+            of stages that got slower by more than the tolerance.
+    */
+    int compare_baseline(char *fileName)
+    {
+        FILE *file = fopen(fileName, "r");
+
+        if(!file)
+        {
+            fprintf(stderr, "Error: Could not read the baseline from %s\n", fileName);
+            exit(1);
+        }
+
+        char line[256], name[MAX_NAME], stage[16];
+        double seconds;
+        int regressions = 0, compared = 0;
+
+        printf("\nCompared with %s (tolerance %.1f%%):\n", fileName, tolerance);
+
+        while(fgets(line, sizeof(line), file))
+        {
+            if(line[0] == '#' || sscanf(line, "%63s %15s %lf", name, stage, &seconds) != 3 || seconds <= 0)
+            {
+                continue;
+            }
+
+            for(int i = 0; i < workloadCount; i++)
+            {
+                for(int s = 0; s < STAGE_COUNT; s++)
+                {
+                    if(strcmp(workloads[i].name, name) || strcmp(stageNames[s], stage))
+                    {
+                        continue;
+                    }
+
+                    double change = (workloads[i].median[s] / seconds - 1) * 100;
+                    compared++;
+
+                    if(change > tolerance)
+                    {
+                        printf("  REGRESSION %-14s %-5s %+7.1f%% (%.3f ms, was %.3f ms)\n",
+                            name, stage, change, workloads[i].median[s] * 1e3, seconds * 1e3);
+                        regressions++;
+                    }
+                    else if(change < -tolerance)
+                    {
+                        printf("  faster     %-14s %-5s %+7.1f%%\n", name, stage, change);
+                    }
+                }
+            }
+        }
+
+        fclose(file);
+
+        printf("  %d stages compared, %d regressions\n", compared, regressions);
+
+        return regressions;
+    }
+
+// Helpers
+    double now()
+    {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec + time.tv_nsec / 1e9;
+    }
+
+    int compare_doubles(const void *a, const void *b)
+    {
+        double x = *(const double *)a, y = *(const double *)b;
+        return (x > y) - (x < y);
+    }
+
+    /*
+        Send stdout to /dev/null while the VM runs, and back afterwards
+    */
+    void silence_output(int silence)
+    {
+        static int saved = -1;
+
+        fflush(stdout);
+
+        if(silence)
+        {
+            int null = open("/dev/null", O_WRONLY);
+            saved = dup(STDOUT_FILENO);
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        else if(saved >= 0)
+        {
+            dup2(saved, STDOUT_FILENO);
+            close(saved);
+            saved = -1;
+        }
+    }
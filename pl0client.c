@@ -0,0 +1,343 @@
+/*
+    Assignment:
+    pl0client.c - Compile or run a PL/0 program on a running pl0server
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -std=c11 -o pl0client pl0client.c
+
+    To Execute:
+        ./pl0client [-S socket] <the options of pl0> input.txt
+
+    where:
+        -S names the socket of the server (default /tmp/pl0server.sock)
+        every other argument means what it means to pl0 (see pl0.c)
+
+    Notes:
+        - Behaves like pl0 with the same arguments: same output, same input
+            from the terminal, same exit status.
+        - A plain compile (-o with at most -O<level>) is sent as a compile
+            request: the client reads the source and the server compiles it
+            in one of its warm workers and writes the image. Anything else
+            is sent as a run request, which hands the server this process's
+            stdin, stdout and stderr to run pl0 on.
+        - Exits with 1 when no server is listening.
+*/
+
+#define _DEFAULT_SOURCE
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <errno.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+
+    #include "pl0.h"
+
+// Functions
+    int connect_server(char *socketName);
+    int compile_request(int server, char *inputFileName, char *imageFileName, int optimizeLevel);
+    int run_request(int server, int argc, char *argv[]);
+    int read_reply(int server);
+
+    int receive_all(int fd, void *buffer, long length);
+    int send_all(int fd, void *buffer, long length);
+    char *absolute_name(char *fileName);
+
+// Main
+    int main(int argc, char *argv[])
+    {
+        // Take out -S, the rest is for pl0
+        char *socketName = PL0_SOCKET;
+        char **arguments = malloc(sizeof(char *) * (argc + 1));
+        int argumentCount = 0;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if(!strcmp(argv[i], "-S") && i + 1 < argc)
+            {
+                socketName = argv[++i];
+            }
+            else
+            {
+                arguments[argumentCount++] = argv[i];
+            }
+        }
+
+        // A plain compile: -o, -O<level> and the source
+        char *inputFileName = NULL, *imageFileName = NULL;
+        int optimizeLevel = 0, plainCompile = 1;
+
+        for(int i = 0; i < argumentCount; i++)
+        {
+            if(!strcmp(arguments[i], "-o") && i + 1 < argumentCount)
+            {
+                imageFileName = arguments[++i];
+            }
+            else if(!strcmp(arguments[i], "-O0") || !strcmp(arguments[i], "-O1") || !strcmp(arguments[i], "-O2"))
+            {
+                optimizeLevel = arguments[i][2] - '0';
+            }
+            else if(arguments[i][0] != '-' && !inputFileName)
+            {
+                inputFileName = arguments[i];
+            }
+            else
+            {
+                plainCompile = 0;
+            }
+        }
+
+        int server = connect_server(socketName);
+        int status;
+
+        if(plainCompile && imageFileName && inputFileName)
+        {
+            status = compile_request(server, inputFileName, imageFileName, optimizeLevel);
+        }
+        else
+        {
+            status = run_request(server, argumentCount, arguments);
+        }
+
+        close(server);
+        free(arguments);
+
+        return status;
+    }
+
+// Requests
+    int connect_server(char *socketName)
+    {
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketName);
+
+        int server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if(server < 0 || connect(server, (struct sockaddr *)&address, sizeof(address)))
+        {
+            fprintf(stderr, "Error: No pl0server is listening on %s\n", socketName);
+            exit(1);
+        }
+
+        return server;
+    }
+
+    /*
+        Send the source to be compiled into imageFileName
+
+        Returns the exit status pl0 would have had
+    */
+    int compile_request(int server, char *inputFileName, char *imageFileName, int optimizeLevel)
+    {
+        FILE *inputFile = strcmp(inputFileName, "-") ? fopen(inputFileName, "r") : stdin;
+
+        if(!inputFile)
+        {
+            fprintf(stderr, "Error: File not found");
+            exit(1);
+        }
+
+        // The image name, then the source
+        char *imageName = absolute_name(imageFileName);
+        long nameLength = strlen(imageName) + 1;
+        long capacity = nameLength + 4096, length = nameLength;
+        char *payload = malloc(capacity);
+        size_t count;
+
+        memcpy(payload, imageName, nameLength);
+
+        while((count = fread(payload + length, 1, capacity - length, inputFile)) > 0)
+        {
+            length += count;
+
+            if(length == capacity)
+            {
+                capacity *= 2;
+                payload = realloc(payload, capacity);
+            }
+        }
+
+        if(inputFile != stdin)
+        {
+            fclose(inputFile);
+        }
+
+        ServerRequest request = {SERVER_COMPILE, optimizeLevel, 0, (int32_t)length};
+
+        if(length > SERVER_MAX_REQUEST || send_all(server, &request, sizeof(request)) || send_all(server, payload, length))
+        {
+            fprintf(stderr, "Error: Failed to send the request\n");
+            exit(1);
+        }
+
+        free(imageName);
+        free(payload);
+
+        return read_reply(server);
+    }
+
+    /*
+        Have the server run pl0 with these arguments on this process's
+            terminal and working directory
+
+        Returns the exit status of that pl0
+    */
+    int run_request(int server, int argc, char *argv[])
+    {
+        // The working directory, then the arguments
+        char *directory = getcwd(NULL, 0);
+        long length = strlen(directory) + 1;
+
+        for(int i = 0; i < argc; i++)
+        {
+            length += strlen(argv[i]) + 1;
+        }
+
+        char *payload = malloc(length), *cursor = payload;
+
+        strcpy(cursor, directory);
+        cursor += strlen(directory) + 1;
+
+        for(int i = 0; i < argc; i++)
+        {
+            strcpy(cursor, argv[i]);
+            cursor += strlen(argv[i]) + 1;
+        }
+
+        // The header carries stdin, stdout and stderr
+        ServerRequest request = {SERVER_RUN, 0, argc, (int32_t)length};
+        int descriptors[3] = {0, 1, 2};
+        char control[CMSG_SPACE(sizeof(descriptors))] = {0};
+        struct iovec part = {&request, sizeof(request)};
+        struct msghdr message = {0};
+
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(descriptors));
+        memcpy(CMSG_DATA(header), descriptors, sizeof(descriptors));
+
+        ssize_t sent = sendmsg(server, &message, 0);
+
+        if(sent < 0 || send_all(server, (char *)&request + sent, sizeof(request) - sent) || send_all(server, payload, length))
+        {
+            fprintf(stderr, "Error: Failed to send the request\n");
+            exit(1);
+        }
+
+        free(directory);
+        free(payload);
+
+        return read_reply(server);
+    }
+
+    /*
+        Print the message of the reply as pl0 would and return its status
+    */
+    int read_reply(int server)
+    {
+        ServerReply reply;
+
+        if(receive_all(server, &reply, sizeof(reply)) || reply.length < 0)
+        {
+            fprintf(stderr, "Error: The server did not answer\n");
+            return 1;
+        }
+
+        if(reply.length > 0)
+        {
+            char *text = malloc(reply.length + 1);
+
+            if(receive_all(server, text, reply.length) == 0)
+            {
+                text[reply.length] = '\0';
+                printf("%s", text);
+            }
+
+            free(text);
+        }
+
+        return reply.status;
+    }
+
+// Helpers
+    int receive_all(int fd, void *buffer, long length)
+    {
+        char *bytes = buffer;
+
+        while(length > 0)
+        {
+            ssize_t count = read(fd, bytes, length);
+
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(count <= 0)
+            {
+                return -1;
+            }
+
+            bytes += count;
+            length -= count;
+        }
+
+        return 0;
+    }
+
+    int send_all(int fd, void *buffer, long length)
+    {
+        char *bytes = buffer;
+
+        while(length > 0)
+        {
+            ssize_t count = write(fd, bytes, length);
+
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(count <= 0)
+            {
+                return -1;
+            }
+
+            bytes += count;
+            length -= count;
+        }
+
+        return 0;
+    }
+
+    /*
+        The name of a file in this working directory as the server, which
+            has its own, must see it. The caller frees it.
+    */
+    char *absolute_name(char *fileName)
+    {
+        if(fileName[0] == '/')
+        {
+            return strdup(fileName);
+        }
+
+        char *directory = getcwd(NULL, 0);
+        char *name = malloc(strlen(directory) + strlen(fileName) + 2);
+
+        sprintf(name, "%s/%s", directory, fileName);
+        free(directory);
+
+        return name;
+    }
@@ -0,0 +1,414 @@
+/*
+    Assignment:
+    pl0gen.c - Generate PL/0 programs of a given size and shape
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -std=c11 -o pl0gen pl0gen.c
+
+    To Execute:
+        ./pl0gen [-d depth] [-b breadth] [-v declarations] [-s statements]
+            [-e terms] [-i iterations] [-r seed] > program.txt
+
+    where:
+        -d sets how deep procedures nest (default 2)
+        -b sets how many procedures every block declares (default 2)
+        -v sets how many constants and variables every block declares
+            (default 8)
+        -s sets how many statements every body has (default 10)
+        -e sets how many terms every expression has (default 6, at most
+            1000)
+        -i sets how many times the loop around every body runs (default 10,
+            at most 99999 as numbers have five digits at most)
+        -r seeds the generator (default 1); the same options and seed always
+            give the same program
+
+    Notes:
+        - Every program is valid PL/0 that the compiler accepts, does not
+            read input and always halts: loops count to a constant, every
+            procedure is called once by its parent and divisions are by
+            constants other than 0.
+        - Programs are deterministic and never overflow an int: every body
+            first assigns each variable of its block, every assignment is
+            brought back below 1000 with x := x - x / 1000 * 1000,
+            expressions do not read loop counters and products are by
+            constants from 2 to 9, at most one per term. Their output is the
+            same at every optimization level and on every engine.
+        - Statements use the variables and constants of their block and of
+            every block around it, so deep nesting also means loads and
+            stores many static levels out.
+        - pl0bench.c builds its workloads with generate_program().
+*/
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <stdarg.h>
+
+    #include "pl0.h"
+
+// Structs
+    /*
+        A name visible to the block being generated
+    */
+    typedef struct {
+        char name[MAX_WORD + 1];
+        int assignable; // Variables other than loop counters
+        int counter; // Loop counters, which expressions do not read
+    } GenName;
+
+    /*
+        Text of the program being generated
+    */
+    typedef struct {
+        char *text;
+        long length;
+        long capacity;
+    } GenBuffer;
+
+// Functions
+    static void append(GenBuffer *buffer, const char *format, ...);
+    static unsigned next_random(unsigned *state);
+    static int random_below(unsigned *state, int bound);
+    static void generate_block(GenBuffer *buffer, ProgramShape *shape, unsigned *state,
+        int depth, GenName *names, int nameCount);
+    static void generate_expression(GenBuffer *buffer, unsigned *state,
+        GenName *names, int nameCount, int terms);
+    static void generate_assignment(GenBuffer *buffer, unsigned *state,
+        GenName *names, int nameCount, int target, int terms);
+
+    static int nextId = 0; // Suffix of the next identifier
+
+// Main
+#ifndef PL0_DRIVER
+    int main(int argc, char *argv[])
+    {
+        ProgramShape shape = {2, 2, 8, 10, 6, 10, 1};
+
+        for(int i = 1; i < argc; i++)
+        {
+            int *option = NULL;
+
+            if(i + 1 < argc && argv[i][0] == '-' && strlen(argv[i]) == 2)
+            {
+                switch(argv[i][1])
+                {
+                    case 'd': option = &shape.depth; break;
+                    case 'b': option = &shape.breadth; break;
+                    case 'v': option = &shape.declarations; break;
+                    case 's': option = &shape.statements; break;
+                    case 'e': option = &shape.terms; break;
+                    case 'i': option = &shape.iterations; break;
+                    case 'r': option = &shape.seed; break;
+                }
+            }
+
+            if(!option)
+            {
+                fprintf(stderr, "Usage: pl0gen [-d depth] [-b breadth] [-v declarations] [-s statements] [-e terms] [-i iterations] [-r seed]\n");
+                exit(1);
+            }
+
+            *option = atoi(argv[++i]);
+        }
+
+        long length;
+        char *program = generate_program(&shape, &length);
+
+        fwrite(program, 1, length, stdout);
+        free(program);
+
+        return 0;
+    }
+#endif
+
+// Generation
+    /*
+        Generate a program of the given shape. Returns the text, which the
+            caller frees, and stores its length in length.
+    */
+    char *generate_program(ProgramShape *shape, long *length)
+    {
+        GenBuffer buffer = {NULL, 0, 0};
+        unsigned state = (unsigned)shape->seed * 2654435761u + 1;
+
+        nextId = 0;
+        generate_block(&buffer, shape, &state, 0, NULL, 0);
+        append(&buffer, ".\n");
+
+        *length = buffer.length;
+        return buffer.text;
+    }
+
+    /*
+        A block: its constants, variables and procedures, then a body that
+            runs its statements in a counted loop, calls every procedure it
+            declared and writes its first variable
+    */
+    static void generate_block(GenBuffer *buffer, ProgramShape *shape, unsigned *state,
+        int depth, GenName *outerNames, int outerCount)
+    {
+        int declarations = shape->declarations > 1 ? shape->declarations : 1;
+        int constants = declarations / 3;
+        int variables = declarations - constants;
+
+        // Everything of the blocks around this one stays visible
+        GenName *names = malloc(sizeof(GenName) * (outerCount + declarations + 1));
+        int nameCount = outerCount;
+
+        if(outerCount > 0)
+        {
+            memcpy(names, outerNames, sizeof(GenName) * outerCount);
+        }
+
+        // Constants
+        for(int i = 0; i < constants; i++)
+        {
+            GenName *name = &names[nameCount++];
+            snprintf(name->name, sizeof(name->name), "c%d", nextId++);
+            name->assignable = 0;
+            name->counter = 0;
+
+            append(buffer, "%s %s = %d", i == 0 ? "const" : ",", name->name, random_below(state, 1000));
+        }
+        if(constants > 0)
+        {
+            append(buffer, ";\n");
+        }
+
+        // Variables, the last one counts the iterations of the loop
+        int firstVariable = nameCount;
+
+        for(int i = 0; i <= variables; i++)
+        {
+            GenName *name = &names[nameCount++];
+            snprintf(name->name, sizeof(name->name), "%s%d", i < variables ? "v" : "k", nextId++);
+            name->assignable = i < variables;
+            name->counter = i == variables;
+
+            append(buffer, "%s %s", i == 0 ? "var" : ",", name->name);
+        }
+        append(buffer, ";\n");
+
+        char *counter = names[nameCount - 1].name;
+
+        // Procedures
+        int procedures = depth < shape->depth ? shape->breadth : 0;
+        int *procedureIds = malloc(sizeof(int) * (procedures + 1));
+
+        for(int i = 0; i < procedures; i++)
+        {
+            procedureIds[i] = nextId++;
+
+            append(buffer, "procedure p%d;\n", procedureIds[i]);
+            generate_block(buffer, shape, state, depth + 1, names, nameCount);
+            append(buffer, ";\n");
+        }
+
+        // Body: every variable of the block is set before anything reads it
+        int iterations = shape->iterations < 99999 ? shape->iterations : 99999;
+        int terms = shape->terms < 1000 ? shape->terms : 1000;
+
+        append(buffer, "begin\n");
+
+        for(int i = firstVariable; i < nameCount - 1; i++)
+        {
+            append(buffer, "%s := %d;\n", names[i].name, random_below(state, 1000));
+        }
+
+        append(buffer, "%s := 0;\nwhile %s < %d do begin\n", counter, counter, iterations);
+
+        for(int i = 0; i < shape->statements; i++)
+        {
+            // Targets are variables of this block or of the blocks around it
+            int target;
+            do
+            {
+                target = random_below(state, nameCount);
+            } while(!names[target].assignable);
+
+            if(random_below(state, 4) == 0)
+            {
+                int other;
+                do
+                {
+                    other = random_below(state, nameCount);
+                } while(!names[other].assignable);
+
+                static const char *comparisons[] = {"=", "<>", "<", "<=", ">", ">="};
+
+                append(buffer, "if ");
+                generate_expression(buffer, state, names, nameCount, terms / 2 + 1);
+                append(buffer, " %s ", comparisons[random_below(state, 6)]);
+                generate_expression(buffer, state, names, nameCount, terms / 2 + 1);
+                append(buffer, " then ");
+                generate_assignment(buffer, state, names, nameCount, target, terms);
+                append(buffer, " else ");
+                generate_assignment(buffer, state, names, nameCount, other, terms);
+                append(buffer, " fi;\n");
+            }
+            else
+            {
+                generate_assignment(buffer, state, names, nameCount, target, terms);
+                append(buffer, ";\n");
+            }
+        }
+
+        append(buffer, "%s := %s + 1\nend", counter, counter);
+
+        for(int i = 0; i < procedures; i++)
+        {
+            append(buffer, ";\ncall p%d", procedureIds[i]);
+        }
+
+        append(buffer, ";\nwrite %s\nend", names[firstVariable].name);
+
+        free(procedureIds);
+        free(names);
+    }
+
+    /*
+        Assign an expression to names[target], then bring the value back
+            below 1000, so that no later expression can overflow
+    */
+    static void generate_assignment(GenBuffer *buffer, unsigned *state,
+        GenName *names, int nameCount, int target, int terms)
+    {
+        char *name = names[target].name;
+
+        append(buffer, "begin %s := ", name);
+        generate_expression(buffer, state, names, nameCount, terms);
+        append(buffer, "; %s := %s - %s / 1000 * 1000 end", name, name, name);
+    }
+
+    /*
+        An expression of about terms terms. Every few terms are grouped in
+            parentheses; products and divisions are by constants from 2 to 9
+            and 1 to 9. Every value it reads is below 1000 and each term is
+            multiplied once at most, so it stays far from overflowing.
+    */
+    static void generate_expression(GenBuffer *buffer, unsigned *state,
+        GenName *names, int nameCount, int terms)
+    {
+        int scaled = 0; // The current term was multiplied
+
+        if(terms < 1)
+        {
+            terms = 1;
+        }
+
+        for(int i = 0; i < terms; i++)
+        {
+            if(i > 0)
+            {
+                int operation = random_below(state, 8);
+
+                if(operation == 6 && scaled)
+                {
+                    operation = random_below(state, 6);
+                }
+
+                if(operation < 6)
+                {
+                    scaled = 0;
+                }
+                else if(operation == 6)
+                {
+                    scaled = 1;
+                }
+
+                if(operation < 3)
+                {
+                    append(buffer, " + ");
+                }
+                else if(operation < 6)
+                {
+                    append(buffer, " - ");
+                }
+                else if(operation == 6)
+                {
+                    append(buffer, " * %d", random_below(state, 8) + 2);
+                    continue;
+                }
+                else
+                {
+                    append(buffer, " / %d", random_below(state, 9) + 1);
+                    continue;
+                }
+            }
+
+            // A group of the next few terms
+            if(terms - i > 4 && random_below(state, 4) == 0)
+            {
+                int group = 2 + random_below(state, 3);
+
+                append(buffer, "(");
+                generate_expression(buffer, state, names, nameCount, group);
+                append(buffer, ")");
+                i += group - 1;
+                continue;
+            }
+
+            if(random_below(state, 3) == 0)
+            {
+                append(buffer, "%d", random_below(state, 100));
+            }
+            else
+            {
+                int name;
+                do
+                {
+                    name = random_below(state, nameCount);
+                } while(names[name].counter);
+
+                append(buffer, "%s", names[name].name);
+            }
+        }
+    }
+
+// Helpers
+    static void append(GenBuffer *buffer, const char *format, ...)
+    {
+        va_list arguments;
+
+        for(;;)
+        {
+            long room = buffer->capacity - buffer->length;
+
+            va_start(arguments, format);
+            int written = vsnprintf(buffer->text + buffer->length, room > 0 ? room : 0, format, arguments);
+            va_end(arguments);
+
+            if(written < room)
+            {
+                buffer->length += written;
+                return;
+            }
+
+            buffer->capacity = buffer->capacity * 2 + written + 4096;
+            buffer->text = realloc(buffer->text, buffer->capacity);
+        }
+    }
+
+    /*
+        xorshift32, so programs are the same on every platform
+    */
+    static unsigned next_random(unsigned *state)
+    {
+        unsigned x = *state ? *state : 1;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        return *state = x;
+    }
+
+    static int random_below(unsigned *state, int bound)
+    {
+        return bound > 0 ? (int)(next_random(state) % (unsigned)bound) : 0;
+    }
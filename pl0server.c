@@ -0,0 +1,739 @@
+/*
+    Assignment:
+    pl0server.c - Serve compiles and runs of PL/0 programs over a Unix socket
+
+    Author: Tal Avital
+
+    Language: C
+
+    To Compile:
+        gcc -O2 -std=c11 -pthread -DPL0_DRIVER -DPL0_SERVER -o pl0server pl0server.c pl0.c lex.c parsercodegen_complete.c vm.c elf.c phase.c cache.c differential.c
+
+    To Execute:
+        ./pl0server [-S socket] [-w workers] [-C cachedir]
+
+    where:
+        -S sets the socket to listen on (default /tmp/pl0server.sock)
+        -w sets the number of worker threads (default: two per core)
+        -C compiles through the compile cache in cachedir (see cache.c)
+
+    Notes:
+        - pl0client.c sends the requests; the protocol is in pl0.h.
+        - The workers all wait in accept() and each serves one connection
+            at a time. A worker keeps its parser state (thread local, see
+            parsercodegen_complete.c) from one compile to the next, and the
+            lexer tables and the cache are set up once before the workers
+            start, so a compile costs the lexing and parsing and nothing
+            else.
+        - A compile request is served in the worker. Errors stop only that
+            compile (compile_to_image()), and the client prints them as pl0
+            would.
+        - A run request is handed to the run helper, a process forked from
+            the server before the workers start: it has a single thread and
+            none of the clients' connections, and starts with everything
+            warm. For each run it forks a process that takes the
+            connection, forks the run itself and sends its exit status back
+            when it ends, so long runs hold neither a worker nor the helper.
+            The run takes the client's stdin, stdout and stderr and its
+            working directory, and runs the command line through
+            run_driver(), so it behaves exactly like pl0 (the VM reads and
+            writes the client's terminal and may exit()).
+        - The socket is only open to the user that started the server.
+        - SIGINT or SIGTERM stops the server: it removes the socket, closes
+            the cache and prints what it served.
+*/
+
+#define _DEFAULT_SOURCE
+
+// Imports
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <stdatomic.h>
+    #include <errno.h>
+    #include <time.h>
+    #include <signal.h>
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+
+    #include "pl0.h"
+
+// Functions
+    void *worker(void *argument);
+    void serve(int connection);
+    void serve_compile(int connection, ServerRequest *request, char *payload);
+    void serve_run(int connection, ServerRequest *request, char *payload, int *descriptors);
+
+    int start_run_helper();
+    void run_helper(int channel);
+    void start_run(int *descriptors);
+
+    int read_request(int connection, ServerRequest *request, int *descriptors);
+    ssize_t receive_descriptors(int fd, void *buffer, long length, int *descriptors, int count);
+    int send_descriptors(int fd, void *buffer, long length, int *descriptors, int count);
+    int receive_all(int fd, void *buffer, long length);
+    int send_all(int fd, void *buffer, long length);
+    void reply(int connection, int status, int codeSize, char *message);
+    double now();
+
+// Variables
+    int listener = -1;
+    int runHelper = -1; // Where runs are sent to the run helper
+    char *cacheDirectory = NULL;
+    sigset_t stopSignals;
+
+    atomic_long compilesServed, runsServed, requestsFailed;
+    atomic_long compileMicroseconds; // Total time spent serving compiles
+
+// Main
+    int main(int argc, char *argv[])
+    {
+        // Validate command line arguments
+        char *socketName = PL0_SOCKET;
+        int workerCount = 0;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if(!strcmp(argv[i], "-S") && i + 1 < argc)
+            {
+                socketName = argv[++i];
+            }
+            else if(!strcmp(argv[i], "-w") && i + 1 < argc)
+            {
+                workerCount = atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i], "-C") && i + 1 < argc)
+            {
+                cacheDirectory = argv[++i];
+            }
+            else
+            {
+                fprintf(stderr, "Usage: pl0server [-S socket] [-w workers] [-C cachedir]\n");
+                exit(1);
+            }
+        }
+
+        if(workerCount <= 0)
+        {
+            workerCount = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+        }
+
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+
+        if(strlen(socketName) >= sizeof(address.sun_path))
+        {
+            fprintf(stderr, "Error: Socket name is too long\n");
+            exit(1);
+        }
+        strcpy(address.sun_path, socketName);
+
+        // Warm state: the lexer tables and the cache
+        scanner_name();
+
+        if(cacheDirectory && cache_open(cacheDirectory, 0))
+        {
+            exit(1);
+        }
+
+        // Take over a socket left by a server that died, not a live one
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if(connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            fprintf(stderr, "Error: A server is already listening on %s\n", socketName);
+            exit(1);
+        }
+        close(listener);
+        unlink(socketName);
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        mode_t mask = umask(077);
+
+        if(bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, 128))
+        {
+            fprintf(stderr, "Error: Failed to listen on %s\n", socketName);
+            exit(1);
+        }
+        umask(mask);
+
+        // Only the main thread takes the stop signals, a closed client only
+        // fails its own write
+        signal(SIGPIPE, SIG_IGN);
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+        // Runs are forked from a process that has a single thread, so it
+        // must start before the workers
+        runHelper = start_run_helper();
+
+        if(runHelper < 0)
+        {
+            fprintf(stderr, "Error: Failed to start the run helper\n");
+            exit(1);
+        }
+
+        for(int t = 0; t < workerCount; t++)
+        {
+            pthread_t thread;
+            pthread_create(&thread, NULL, worker, NULL);
+            pthread_detach(thread);
+        }
+
+        fprintf(stderr, "pl0server: listening on %s with %d workers (VM dispatch: %s, lexer scanner: %s)\n",
+            socketName, workerCount, dispatch_name(), scanner_name());
+
+        int stop;
+        sigwait(&stopSignals, &stop);
+
+        // Stop taking requests, then report
+        unlink(socketName);
+
+        if(cacheDirectory)
+        {
+            cache_close();
+            cache_report();
+        }
+
+        long compiles = atomic_load(&compilesServed);
+
+        fprintf(stderr, "pl0server: served %ld compiles (mean %.1f us), %ld runs, %ld failed requests\n",
+            compiles, compiles ? (double)atomic_load(&compileMicroseconds) / compiles : 0.0,
+            atomic_load(&runsServed), atomic_load(&requestsFailed));
+
+        return 0;
+    }
+
+// Workers
+    /*
+        Serve connections one after another for as long as the server runs
+    */
+    void *worker(void *argument)
+    {
+        (void)argument;
+
+        for(;;)
+        {
+            int connection = accept(listener, NULL, NULL);
+
+            if(connection < 0)
+            {
+                if(errno != EINTR && errno != ECONNABORTED)
+                {
+                    fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+                }
+                continue;
+            }
+
+            serve(connection);
+        }
+
+        return NULL;
+    }
+
+    /*
+        Read one request and serve it. The connection is closed when the
+            reply has been sent, or when a run has been handed over.
+    */
+    void serve(int connection)
+    {
+        ServerRequest request;
+        int descriptors[3] = {-1, -1, -1};
+
+        if(read_request(connection, &request, descriptors))
+        {
+            atomic_fetch_add(&requestsFailed, 1);
+            close(connection);
+            return;
+        }
+
+        char *payload = malloc(request.length + 1);
+
+        if(receive_all(connection, payload, request.length))
+        {
+            atomic_fetch_add(&requestsFailed, 1);
+            free(payload);
+            close(connection);
+            return;
+        }
+        payload[request.length] = '\0';
+
+        if(request.kind == SERVER_RUN && descriptors[2] >= 0)
+        {
+            serve_run(connection, &request, payload, descriptors);
+        }
+        else if(request.kind == SERVER_COMPILE)
+        {
+            serve_compile(connection, &request, payload);
+        }
+        else
+        {
+            reply(connection, 1, 0, "Error: Unknown request\n");
+            atomic_fetch_add(&requestsFailed, 1);
+        }
+
+        close(connection);
+
+        for(int i = 0; i < 3; i++)
+        {
+            if(descriptors[i] >= 0)
+            {
+                close(descriptors[i]);
+            }
+        }
+
+        free(payload);
+    }
+
+    /*
+        Compile the source into the image named at the start of the payload,
+            through the cache when there is one
+    */
+    void serve_compile(int connection, ServerRequest *request, char *payload)
+    {
+        double start = now();
+        char *imageName = payload;
+        long nameLength = strnlen(payload, request->length);
+
+        if(nameLength == request->length || imageName[0] != '/')
+        {
+            reply(connection, 1, 0, "Error: Bad compile request\n");
+            atomic_fetch_add(&requestsFailed, 1);
+            return;
+        }
+
+        char *source = payload + nameLength + 1;
+        long sourceLength = request->length - nameLength - 1;
+        char key[CACHE_KEY_SIZE];
+        int codeSize = -1;
+        char *error = NULL;
+
+        if(cacheDirectory)
+        {
+            cache_key(source, sourceLength, request->optimizeLevel, key);
+            codeSize = cache_fetch(key, imageName);
+        }
+
+        if(codeSize < 0)
+        {
+            TokenList tokens;
+            lex_source(source, sourceLength, &tokens);
+            codeSize = compile_to_image(&tokens, request->optimizeLevel, imageName, &error);
+            free_tokens(&tokens);
+
+            if(cacheDirectory && codeSize >= 0)
+            {
+                cache_store(key, imageName);
+            }
+        }
+
+        if(codeSize < 0)
+        {
+            reply(connection, 1, 0, error ? error : "Error: Compile failed");
+        }
+        else
+        {
+            reply(connection, 0, codeSize, NULL);
+        }
+
+        atomic_fetch_add(&compilesServed, 1);
+        atomic_fetch_add(&compileMicroseconds, (long)((now() - start) * 1e6));
+    }
+
+    /*
+        Hand a run to the run helper with the connection and the client's
+            descriptors. The request follows on a socket of its own, so a
+            long command line never blocks the helper.
+    */
+    void serve_run(int connection, ServerRequest *request, char *payload, int *descriptors)
+    {
+        int pair[2];
+        int failed = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+
+        if(!failed)
+        {
+            int passed[5] = {pair[1], connection, descriptors[0], descriptors[1], descriptors[2]};
+            char byte = 0;
+
+            failed = send_descriptors(runHelper, &byte, 1, passed, 5);
+            close(pair[1]);
+
+            if(!failed)
+            {
+                send_all(pair[0], request, sizeof(ServerRequest));
+                send_all(pair[0], payload, request->length);
+            }
+            close(pair[0]);
+        }
+
+        if(failed)
+        {
+            reply(connection, 1, 0, "Error: Failed to start the run\n");
+            atomic_fetch_add(&requestsFailed, 1);
+            return;
+        }
+
+        atomic_fetch_add(&runsServed, 1);
+    }
+
+// Run helper
+    /*
+        Fork the run helper, sharing a socket with it. Only the main thread
+            may call this, before any other thread starts.
+
+        Returns the server's end of the socket, or -1 if the helper cannot be
+            started
+    */
+    int start_run_helper()
+    {
+        int pair[2];
+
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair))
+        {
+            return -1;
+        }
+
+        pid_t helper = fork();
+
+        if(helper == 0)
+        {
+            close(listener);
+            close(pair[0]);
+            run_helper(pair[1]);
+        }
+
+        close(pair[1]);
+
+        if(helper < 0)
+        {
+            close(pair[0]);
+            return -1;
+        }
+
+        return pair[0];
+    }
+
+    /*
+        Fork a process for every run the server sends, until the server
+            closes its end of the channel. Each message carries the request
+            socket, the connection and the client's stdin, stdout and stderr.
+    */
+    void run_helper(int channel)
+    {
+        // Nobody here waits for the runs
+        signal(SIGCHLD, SIG_IGN);
+
+        for(;;)
+        {
+            int descriptors[5] = {-1, -1, -1, -1, -1};
+            char byte;
+            ssize_t count = receive_descriptors(channel, &byte, 1, descriptors, 5);
+
+            if(count == 0 || (count < 0 && errno != EINTR))
+            {
+                _exit(0);
+            }
+
+            pid_t child = descriptors[4] >= 0 ? fork() : -1;
+
+            if(child == 0)
+            {
+                close(channel);
+                start_run(descriptors);
+            }
+
+            if(child < 0 && descriptors[1] >= 0)
+            {
+                reply(descriptors[1], 1, 0, "Error: Failed to start the run\n");
+            }
+
+            for(int i = 0; i < 5; i++)
+            {
+                if(descriptors[i] >= 0)
+                {
+                    close(descriptors[i]);
+                }
+            }
+        }
+    }
+
+    /*
+        Read the run request, run the pl0 command line in a child on the
+            client's terminal and send its exit status back. Never returns.
+    */
+    void start_run(int *descriptors)
+    {
+        int connection = descriptors[1];
+        ServerRequest request;
+
+        signal(SIGCHLD, SIG_DFL);
+
+        if(receive_all(descriptors[0], &request, sizeof(request)) ||
+            request.length < 0 || request.length > SERVER_MAX_REQUEST || request.argumentCount < 0)
+        {
+            _exit(1);
+        }
+
+        char *payload = malloc(request.length + 1);
+
+        if(receive_all(descriptors[0], payload, request.length))
+        {
+            _exit(1);
+        }
+        payload[request.length] = '\0';
+        close(descriptors[0]);
+
+        // The working directory, then the arguments
+        char **arguments = malloc(sizeof(char *) * (request.argumentCount + 2));
+        char *cursor = payload, *end = payload + request.length;
+        char *directory = cursor;
+        int argumentCount = 1;
+
+        arguments[0] = "pl0";
+        cursor += strnlen(cursor, end - cursor) + 1;
+
+        while(cursor < end && argumentCount <= request.argumentCount)
+        {
+            arguments[argumentCount++] = cursor;
+            cursor += strnlen(cursor, end - cursor) + 1;
+        }
+        arguments[argumentCount] = NULL;
+
+        pid_t child = fork();
+
+        if(child == 0)
+        {
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            signal(SIGPIPE, SIG_DFL);
+
+            close(connection);
+
+            for(int i = 0; i < 3; i++)
+            {
+                dup2(descriptors[2 + i], i);
+            }
+            for(int i = 2; i < 5; i++)
+            {
+                if(descriptors[i] > 2)
+                {
+                    close(descriptors[i]);
+                }
+            }
+
+            if(chdir(directory))
+            {
+                fprintf(stderr, "Error: Failed to enter %s\n", directory);
+                _exit(1);
+            }
+
+            exit(run_driver(argumentCount, arguments));
+        }
+
+        // Only the run keeps the client's terminal
+        for(int i = 2; i < 5; i++)
+        {
+            close(descriptors[i]);
+        }
+
+        if(child < 0)
+        {
+            reply(connection, 1, 0, "Error: Failed to start the run\n");
+            _exit(1);
+        }
+
+        int status = 0;
+
+        while(waitpid(child, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+
+        int exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+        reply(connection, exitStatus, 0, NULL);
+        _exit(0);
+    }
+
+// Protocol
+    /*
+        Read a request header and the descriptors that came with it
+
+        Returns 0 on success, -1 otherwise
+    */
+    int read_request(int connection, ServerRequest *request, int *descriptors)
+    {
+        ssize_t count = receive_descriptors(connection, request, sizeof(ServerRequest), descriptors, 3);
+
+        if(count <= 0)
+        {
+            return -1;
+        }
+
+        // The rest of a header split across reads
+        if(receive_all(connection, (char *)request + count, sizeof(ServerRequest) - count))
+        {
+            return -1;
+        }
+
+        if(request->length < 0 || request->length > SERVER_MAX_REQUEST || request->argumentCount < 0)
+        {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /*
+        Read up to length bytes and the first count descriptors (at most
+            five) that came with them. Descriptors past count are closed.
+
+        Returns what recvmsg() returned
+    */
+    ssize_t receive_descriptors(int fd, void *buffer, long length, int *descriptors, int count)
+    {
+        char control[CMSG_SPACE(sizeof(int) * 5)];
+        struct iovec part = {buffer, length};
+        struct msghdr message = {0};
+
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(fd, &message, 0);
+
+        if(received <= 0)
+        {
+            return received;
+        }
+
+        for(struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+        {
+            if(header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+                int total = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int *passed = (int *)CMSG_DATA(header);
+
+                for(int i = 0; i < total; i++)
+                {
+                    if(i < count)
+                    {
+                        descriptors[i] = passed[i];
+                    }
+                    else
+                    {
+                        close(passed[i]);
+                    }
+                }
+            }
+        }
+
+        return received;
+    }
+
+    /*
+        Send length bytes with count descriptors (at most five) in one
+            message
+
+        Returns 0 on success, -1 otherwise
+    */
+    int send_descriptors(int fd, void *buffer, long length, int *descriptors, int count)
+    {
+        char control[CMSG_SPACE(sizeof(int) * 5)] = {0};
+        struct iovec part = {buffer, length};
+        struct msghdr message = {0};
+
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(header), descriptors, sizeof(int) * count);
+
+        ssize_t sent;
+
+        while((sent = sendmsg(fd, &message, 0)) < 0 && errno == EINTR)
+        {
+        }
+
+        return sent == length ? 0 : -1;
+    }
+
+    int receive_all(int fd, void *buffer, long length)
+    {
+        char *bytes = buffer;
+
+        while(length > 0)
+        {
+            ssize_t count = read(fd, bytes, length);
+
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(count <= 0)
+            {
+                return -1;
+            }
+
+            bytes += count;
+            length -= count;
+        }
+
+        return 0;
+    }
+
+    int send_all(int fd, void *buffer, long length)
+    {
+        char *bytes = buffer;
+
+        while(length > 0)
+        {
+            ssize_t count = write(fd, bytes, length);
+
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(count <= 0)
+            {
+                return -1;
+            }
+
+            bytes += count;
+            length -= count;
+        }
+
+        return 0;
+    }
+
+    void reply(int connection, int status, int codeSize, char *message)
+    {
+        ServerReply header = {status, codeSize, message ? (int)strlen(message) : 0, 0};
+
+        if(send_all(connection, &header, sizeof(header)) == 0 && message)
+        {
+            send_all(connection, message, header.length);
+        }
+    }
+
+    /*
+        Returns the time in seconds on the monotonic clock
+    */
+    double now()
+    {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec + time.tv_nsec / 1e9;
+    }
@@ -1,12 +1,12 @@
 echo off
 
-gcc -O2 -std=c11 -o lex lex.c
+gcc -O2 -std=c11 -o lex lex.c phase.c
 lex "test_%1.txt"
 
-gcc -O2 -std=c11 -o parsercodegen parsercodegen_complete.c
+gcc -O2 -std=c11 -o parsercodegen parsercodegen_complete.c elf.c phase.c
 parsercodegen
 
 echo.
 
-gcc -O2 -Wall -std=c11 -o vm vm.c
+gcc -O2 -Wall -std=c11 -o vm vm.c elf.c differential.c
 vm elf.txt
\ No newline at end of file
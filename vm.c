@@ -7,20 +7,77 @@
     Language: C
 
     To Compile:
-        gcc -O2 -Wall -std=c11 -o vm vm.c
+        gcc -O2 -Wall -std=c11 -o vm vm.c elf.c differential.c
+
+        Select the dispatch engine with -DDISPATCH=1 (switch),
+        -DDISPATCH=2 (direct threading, the default with GCC) or
+        -DDISPATCH=3 (call threading).
 
     To Execute:
         ./vm input.txt
+        ./vm -f input.txt   (fast mode: program output only, no trace)
+        ./vm -m 1000000 -H input.txt
+                            (PAS of one million words on huge pages)
+        ./vm -v             (prints the banner with the dispatch engine)
+        ./vm -f -s input.txt
+                            (reports how many superinstructions ran)
+        ./vm -r input.txt   (fast mode on the register engine)
+        ./vm -j input.txt   (fast mode on native x86-64 code)
+        ./vm -d [-r | -j] input.txt
+                            (runs the program on the stack engine and on
+                            the register engine or the JIT, and checks
+                            that both agree)
+        ./vm -p profile.txt -P stacks.txt input.txt
+                            (fast mode, writing the execution profile and
+                            the folded call stacks)
+        ./vm test_bad_image_1.txt
+                            (a hand-written image with an operand outside
+                            the PAS; test_bad_image_2.txt jumps outside the
+                            code. Both must be rejected before they run)
 
     where:
         input.txt is the name of the file containing PM/0 instructions;
-        each line has three integers (OP L M)
+        each line has three integers (OP L M), or a binary image written
+        by parsercodegen -b (detected by its magic number)
 
     Notes:
         - Implements the PM/0 virtual machine described in the homework
             instructions.
-        - No dynamic memory allocation or pointer arithmetic.
-        - Does not implement any VM instruction using a separate function.
+        - The PAS is mapped at load time (-m words, default 500) with a
+            guard region below it, so stack overflows are reported instead
+            of corrupting memory; -H asks for transparent huge pages. Code
+            whose operands could reach past the PAS or the code is rejected
+            before it runs (see check_code()).
+        - Each instruction is written once as a DO_ macro and expanded by
+            the dispatch engine selected at build time.
+        - The code is loaded apart from the stack and predecoded before it
+            runs: flattened opcodes and jump targets as instruction indexes.
+        - The fast mode also fuses common instruction sequences into
+            superinstructions, so a condition or an assignment such as
+            x := x + 1 is one dispatch instead of four.
+        - With -r the fast mode translates the program into three address
+            register code at load time and runs that instead (see
+            vm_register.h); the output is the same.
+        - With -j the fast mode compiles the program to x86-64 machine code
+            at load time and runs that (see vm_jit.h). The interpreter runs
+            instead on other machines or when the code cannot be mapped
+            executable.
+        - -d runs the program twice in child processes, once on the stack
+            engine and once on the engine selected with -r or -j (the JIT
+            by default), with the same input (see differential.c). It
+            prints the stack engine's output and exits with status 1 if the
+            program output, errors, exit status or final PAS differ.
+        - -p and -P profile the fast mode on the stack engine without
+            superinstructions (see vm_profile.h): instruction counts per
+            opcode, OPR and SYS subop, address and procedure, the loops by
+            the instructions they run, and the call paths as folded stacks
+            for flame graph tools. Procedures are named from the symbols of
+            a binary image.
+        - Everything a program runs on lives in a Vm made by vm_create(), so
+            a process can run many programs at once, one machine per thread.
+            An error or a stack overflow ends only that machine's run:
+            vm_run() returns a status and vm_error() the message, which this
+            program prints before exiting as it always did.
         - Runs on Eustis.
 
     Class: COP 3402 - Systems Software - Fall 2025
@@ -30,25 +87,386 @@
     Due Date: Friday , September 12th , 2025
 */
 
+#define _DEFAULT_SOURCE
+
 // Imports
     #include <stdio.h>
     #include <stdlib.h>
-
-// Global variables
-    #define PAS_SIZE 500
-
-    static int pas[PAS_SIZE];
-    static int bps[PAS_SIZE]; // See bottom for structure
+    #include <string.h>
+    #include <stddef.h>
+    #include <limits.h>
+    #include <stdarg.h>
+    #include <setjmp.h>
+    #include <signal.h>
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+
+    #include "pl0.h"
+
+// Dispatch engines
+    /*
+        Chosen at build time with -DDISPATCH=<n>:
+            1 switch: the original two-level switch on op and m
+            2 direct threading: one computed goto per instruction (GCC/Clang)
+            3 call threading: one indirect call per instruction
+    */
+    #define DISPATCH_SWITCH 1
+    #define DISPATCH_DIRECT 2
+    #define DISPATCH_CALL 3
+
+    #ifndef DISPATCH
+        #ifdef __GNUC__
+            #define DISPATCH DISPATCH_DIRECT
+        #else
+            #define DISPATCH DISPATCH_SWITCH
+        #endif
+    #endif
+
+    /*
+        Flattened opcodes, every OPR and SYS variant has its own entry
+    */
+    typedef enum {
+        FLAT_INVALID,
+        FLAT_LIT,
+        FLAT_LOD,
+        FLAT_STO,
+        FLAT_CAL,
+        FLAT_INC,
+        FLAT_JMP,
+        FLAT_JPC,
+        FLAT_RTN,
+        FLAT_ADD,
+        FLAT_SUB,
+        FLAT_MUL,
+        FLAT_DIV,
+        FLAT_EQL,
+        FLAT_NEQ,
+        FLAT_LSS,
+        FLAT_LEQ,
+        FLAT_GTR,
+        FLAT_GEQ,
+        FLAT_EVEN,
+        FLAT_OPR_INVALID,
+        FLAT_OUT,
+        FLAT_READ,
+        FLAT_HLT,
+        FLAT_SYS_NONE,
+        FLAT_END,
+
+        // Superinstructions (see fuse_program()), each family in OPR order
+        FLAT_LIT_STO,
+        FLAT_LOD_OUT,
+        FLAT_LOD_LIT_EQL_JPC,
+        FLAT_LOD_LIT_NEQ_JPC,
+        FLAT_LOD_LIT_LSS_JPC,
+        FLAT_LOD_LIT_LEQ_JPC,
+        FLAT_LOD_LIT_GTR_JPC,
+        FLAT_LOD_LIT_GEQ_JPC,
+        FLAT_LOD_LIT_ADD_STO,
+        FLAT_LOD_LIT_SUB_STO,
+        FLAT_LOD_LIT_MUL_STO,
+        FLAT_LOD_LIT_DIV_STO,
+        FLAT_LOD_LOD_ADD_STO,
+        FLAT_LOD_LOD_SUB_STO,
+        FLAT_LOD_LOD_MUL_STO,
+        FLAT_LOD_LOD_DIV_STO,
+
+        FLAT_COUNT
+    } FlatOpcode;
+
+    /*
+        A predecoded instruction. Jump and call targets in m are instruction
+            indexes rather than code addresses.
+    */
+    typedef struct {
+    #if DISPATCH == DISPATCH_DIRECT
+        void *label; // Filled in by the direct threading engine
+    #endif
+        int op; // FlatOpcode
+        int l;
+        int m;
+    } Decoded;
+
+// Machine state
+    #define PAS_SIZE 500 // Default size of the PAS in words
+    #define GUARD_WORDS 65536 // Size of the inaccessible region below the PAS
+    #define OUTPUT_BUFFER_SIZE 65536
+    #define ERROR_SIZE 256
+
+    /*
+        The display: display[k] is the base of the newest activation record at
+            static level k. Each call saves the entry it replaces in
+            displayLinks so the return can put it back.
+    */
+    typedef struct {
+        int level;
+        int base;
+    } DisplayLink;
+
+    // Defined with the engines that use them
+    typedef struct RegisterInstruction RegisterInstruction;
+    typedef struct LazyEntry LazyEntry;
+    typedef struct JitFixup JitFixup;
+    typedef struct ProfileNode ProfileNode;
+    typedef struct ProfileFrame ProfileFrame;
+
+    /*
+        One machine: everything a program needs to load and run. Nothing is
+            shared between machines, so a process can run many of them at
+            once, one per thread.
+    */
+    struct Vm {
+        /*
+            The PAS is mapped by vm_create() with a guard region right below
+                word 0. The stack grows down towards word 0, so an overflow
+                faults in the guard instead of being checked on every push.
+                A guard page after the PAS catches code popping more than it
+                pushed the same way.
+        */
+        int *pas;
+        int pasSize;
+        int bps[PAS_SIZE]; // See bottom for structure
+
+        /*
+            The code is kept apart from the PAS: codeWords holds the loaded
+                words (only read by the trace), program their predecoded form.
+                The code still takes up the top codeLength words of the
+                address space, so the stack starts where it always did and
+                every address in the trace is unchanged.
+        */
+        int *codeWords;
+        int codeLength, codeCapacity;
+
+        Decoded *program;
+        int programCount;
+
+        int fusedCount; // Superinstructions in the program
+        long fusedRuns; // Superinstructions executed
+        long executedCount; // Instructions run by vm_count_instructions() or the profiler
+        long *profileHits; // Runs of every instruction, see vm_profile.h
+
+        ElfSymbol *symbols; // Symbols of the loaded program, if it had any
+        int symbolCount;
+
+        int engine; // Engine of the fast mode
+        int registerRan; // Set when the last run used the register engine
+        int jitRan; // Set when the last run used the JIT
+
+        char *pasMap; // Guard region, the PAS, then a guard page
+        size_t pasMapSize;
+        char *pasEndGuard; // Guard page after the PAS
+        char *linksGuard; // Guard page after the display links
+        int maxCalls; // Entries in the display and its links
+
+        int *display;
+        DisplayLink *displayLinks;
+        int displayTop;
+
+        FILE *input; // Read by SYS READ, stdin unless set
+        FILE *output; // Program output and the trace, stdout unless set
+
+        char outputBuffer[OUTPUT_BUFFER_SIZE];
+        int outputLength;
+        int outputBuffered; // Set while running in the fast mode
+
+        char error[ERROR_SIZE]; // Why the last load or run failed
+        sigjmp_buf escape; // Where an error in a run goes back to
+
+        // Register engine (see vm_register.h)
+        RegisterInstruction *registerProgram;
+        int registerCount, registerCapacity;
+        int *registerIndex; // Register index of each stack block start, or -1
+        char *registerFailure; // Why the last translation failed
+
+        // Translator state: stack positions floor + 1 .. top are in lazy
+        LazyEntry *lazy;
+        int lazyCapacity;
+        int floorDepth, topDepth;
+        int clearTop; // Positions topDepth + 1 .. clearTop still have to be zeroed
+
+        // JIT (see vm_jit.h)
+        unsigned char *jitBytes; // Code being generated
+        int jitLength, jitCapacity;
+        int *jitOffsets; // Offset of the code of each instruction
+        JitFixup *jitFixups;
+        int jitFixupCount, jitFixupCapacity;
+        void *jitCode; // Executable mapping of the code
+        size_t jitCodeSize;
+        void **jitTable;
+        char *jitFailure; // Why the last compile failed
+
+        // Profile (see vm_profile.h)
+        char *profileFileName;
+        char *foldedFileName;
+        ProfileNode *profileNodes;
+        int profileNodeCount, profileNodeCapacity;
+        ProfileFrame *profileFrames;
+        int profileFrameCount, profileFrameCapacity;
+        long *profileCalls; // Indexed by the entry instruction of a procedure
+        long *profileInclusive;
+        long *profileExclusive;
+        int *profileActive; // Activations of the procedure on the stack
+    };
+
+    /*
+        The machine running on this thread, for the guard fault handler
+    */
+    static _Thread_local Vm *runningVm = NULL;
+
+    /*
+        What SIGSEGV did before guard_fault() was installed, for the faults
+            that are not a machine's
+    */
+    static struct sigaction previousFault;
 
 // Function prototypes
-    int base(int BP, int L);
-    void print(int pc, int bp, int sp, int op, int l, int m);
+    Vm *vm_create(int size, int hugePages);
+    void vm_destroy(Vm *vm);
+    void *map_words(size_t bytes, int hugePages, char **guard);
+    void unmap_words(void *map, size_t bytes);
+    void guard_fault(int signal, siginfo_t *info, void *context);
+    void install_guard_handler();
+    void check_code(Vm *vm);
+    int set_error(Vm *vm, char *format, ...);
+    _Noreturn void vm_fail(Vm *vm, char *format, ...);
+    char *vm_error(Vm *vm);
+
+    int load_word(Vm *vm, int word);
+    int vm_load(Vm *vm, Instruction *code, int count);
+    int vm_load_image(Vm *vm, ElfImage *image);
+    void vm_load_symbols(Vm *vm, ElfSymbol *symbols, int count);
+    void vm_set_streams(Vm *vm, FILE *input, FILE *output);
+    int vm_run(Vm *vm, int trace);
+    void execute_traced(Vm *vm);
+    void execute_fast(Vm *vm);
+    void execute_counted(Vm *vm);
+    long vm_count_instructions(Vm *vm);
+    void execute_profiled(Vm *vm);
+    void vm_select_profile(Vm *vm, char *profileFile, char *foldedFile);
+    void start_profile(Vm *vm);
+    void profile_call(Vm *vm, int entry);
+    void profile_return(Vm *vm);
+    void write_profile(Vm *vm);
+    void free_profile(Vm *vm);
+    void decode_program(Vm *vm, int fuse);
+    void fuse_program(Vm *vm);
+    void vm_report(Vm *vm);
+    void vm_select_engine(Vm *vm, int selected);
+    int translate_program(Vm *vm);
+    void execute_registers(Vm *vm);
+    void report_registers(Vm *vm);
+    void free_registers(Vm *vm);
+    int compile_jit(Vm *vm);
+    void execute_jit(Vm *vm);
+    void report_jit(Vm *vm);
+    void free_jit(Vm *vm);
+    int vm_reads_input(Vm *vm);
+    uint64_t vm_hash(Vm *vm);
+
+    static inline int divide_values(Vm *vm, int left, int right);
+    void check_division(Vm *vm, int left, int right);
+    int read_input(Vm *vm);
+    void write_output(Vm *vm, int value);
+    void flush_output(Vm *vm);
+
+    int flatten_opcode(int op, int m);
+    char *dispatch_name();
+
+    int base(Vm *vm, int BP, int L);
+    void print(Vm *vm, int pc, int bp, int sp, int op, int l, int m);
 
 // Main
+#ifndef PL0_DRIVER
     int main(int argc, char *argv[])
     {
+        // Read the options
+        int trace = 1, size = PAS_SIZE, hugePages = 0, stats = 0;
+        int engine = ENGINE_STACK, differential = 0;
+        char *inputFileName = NULL, *profileFile = NULL, *foldedFile = NULL;
+
+        for(int i = 1; i < argc; i++)
+        {
+            // Print the banner
+            if(!strcmp(argv[i], "-v"))
+            {
+                printf("PM/0 virtual machine (dispatch: %s)\n", dispatch_name());
+                return 0;
+            }
+
+            // The fast mode runs without the trace
+            else if(!strcmp(argv[i], "-f"))
+            {
+                trace = 0;
+            }
+
+            // Size of the PAS in words
+            else if(!strcmp(argv[i], "-m") && i + 1 < argc)
+            {
+                size = atoi(argv[++i]);
+            }
+
+            // Back the PAS with transparent huge pages
+            else if(!strcmp(argv[i], "-H"))
+            {
+                hugePages = 1;
+            }
+
+            // Report the superinstructions after the run
+            else if(!strcmp(argv[i], "-s"))
+            {
+                stats = 1;
+            }
+
+            // Run the fast mode on the register engine
+            else if(!strcmp(argv[i], "-r"))
+            {
+                engine = ENGINE_REGISTER;
+                trace = 0;
+            }
+
+            // Run the fast mode on native code
+            else if(!strcmp(argv[i], "-j"))
+            {
+                engine = ENGINE_JIT;
+                trace = 0;
+            }
+
+            // Check an engine against the stack engine
+            else if(!strcmp(argv[i], "-d"))
+            {
+                differential = 1;
+                trace = 0;
+            }
+
+            // Profile the run
+            else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+            {
+                profileFile = argv[++i];
+                trace = 0;
+            }
+
+            // Write the call paths of the run as folded stacks
+            else if(!strcmp(argv[i], "-P") && i + 1 < argc)
+            {
+                foldedFile = argv[++i];
+                trace = 0;
+            }
+
+            else if(!inputFileName)
+            {
+                inputFileName = argv[i];
+            }
+
+            else
+            {
+                inputFileName = NULL;
+                break;
+            }
+        }
+
         // Validate command line arguments
-        if(!argv[1] || argv[2])
+        if(!inputFileName || size <= 0)
         {
             fprintf(stderr, 
                 "Error: This file takes in one argument; the name of an input file"
@@ -56,16 +474,57 @@
             exit(1);
         }
 
+        Vm *vm = vm_create(size, hugePages);
+
+        if(!vm)
+        {
+            fprintf(stderr, "Error: Failed to map a PAS of %d words", size);
+            exit(1);
+        }
+
+        vm_select_engine(vm, engine);
+        vm_select_profile(vm, profileFile, foldedFile);
+
         // Declare variables
         FILE *inputFile;
+        int status;
 
-        int pc = PAS_SIZE - 1, sp, bp = PAS_SIZE - 1;
-        int op, l, m;
+        // Binary images are mapped and copied without any parsing
+        if(elf_is_binary(inputFileName))
+        {
+            ElfImage image;
 
-        // Open the input file
-            // Store the file name
-            char *inputFileName = argv[1];
+            if(elf_open(inputFileName, &image))
+            {
+                exit(1);
+            }
+
+            if(vm_load_image(vm, &image))
+            {
+                fprintf(stderr, "%s", vm_error(vm));
+                exit(1);
+            }
+
+            elf_close(&image);
+
+            status = differential ? run_differential(vm, engine) : vm_run(vm, trace);
+
+            if(status)
+            {
+                fprintf(stderr, "%s", vm_error(vm));
+                exit(status);
+            }
+
+            if(stats && !differential)
+            {
+                vm_report(vm);
+            }
+
+            vm_destroy(vm);
+            return 0;
+        }
 
+        // Open the input file
             // Attempt to open the file
             inputFile = fopen(inputFileName, "r");
 
@@ -81,495 +540,1333 @@
             int i;
             while(fscanf(inputFile, "%d", &i) == 1)
             {
-                pas[bp] = i;
-                bp--;
+                if(load_word(vm, i))
+                {
+                    fprintf(stderr, "%s", vm_error(vm));
+                    exit(1);
+                }
             }
-            
-            // Initialize bp and sp
-            sp = bp + 1;
-            bps[0] = bp;
-            bps[1] = 1;
 
         // Parse the pas
-            printf("\tL\tM\tPC\tBP\tSP\tstack\n");
-            printf("Initial values: \t%d\t%d\t%d\n", pc, bp, sp);
+            status = differential ? run_differential(vm, engine) : vm_run(vm, trace);
 
-            while(bp < pc)
+            if(status)
             {
-                // Fetch
-                op = pas[pc];
-                l = pas[pc - 1];
-                m = pas[pc - 2];
-
-                // Execute
-                switch(op)
-                {
-                    /*
-                        LIT- Push the literal value m to the very top of pas
-                    */
-                    case 1:
-                    {
-                        // Decrement sp to the new top of pas
-                        sp--;
-                        
-                        // Store the value in the new position
-                        pas[sp] = m;
-                    }
-                    break;
-
-                    /*
-                        OP- Perform the operation given by m on the top
-                        and following value on the stack
-                    */
-                    case 2:
-                    {
-                        switch(m) 
-                        {
-                            /*
-                                OP RTN- finish with child ar and return to parent
-                                ar
-                            */
-                            case 0:
-                            {
-                                // Move sp to the ar's return address
-                                sp = bp - 2;
-
-                                // Move pc to the next instruction
-                                pc = pas[sp] + 3;
-
-                                // Move bp to the base of the next instruction
-                                bp = pas[sp + 1];
-
-                                // Pop the ar header
-                                sp += 3;
-
-                                // Stop printing this ar
-                                bps[1]--;
-                            }
-                            break;
-
-                            /*
-                                OP ADD- Add the two values on the top of pas
-                            */
-                            case 1:
-                            {
-                                // Apply the operation on the second value
-                                pas[sp + 1] += pas[sp];
-
-                                // Pop the first value
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                OP SUB- Subtract the two values at the top
-                                of pas
-                            */
-                            case 2:
-                            {
-                                // Apply the operation on the second value
-                                pas[sp + 1] -= pas[sp];
-
-                                // Pop the first value
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                OP MUL- Multiply the two values at the top
-                                of pas
-                            */
-                            case 3:
-                            {
-                                // Apply the operation on the second value
-                                pas[sp + 1] *= pas[sp];
-
-                                // Pop the first value
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                OP DIV- Divide the two values at the top of
-                                pas
-                            */
-                            case 4:
-                            {
-                                // Apply the operation on the second value
-                                pas[sp + 1] /= pas[sp];
-
-                                // Pop the first value
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                OP EQL- Return 1 if the two values at the top
-                                of pas are equal, otherwise return 0
-                            */
-                            case 5:
-                            {
-                                // Compare the two values, store the result
-                                if(pas[sp + 1] == pas[sp])
-                                {
-                                    pas[sp + 1] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp + 1] = 0;
-                                }
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                OP NEQ- Return 0 if the two values at the top
-                                of pas are equal, otherwise return 1
-                            */
-                            case 6:
-                            {
-                                // Compare the two values, store the result
-                                if(pas[sp + 1] != pas[sp])
-                                {
-                                    pas[sp + 1] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp + 1] = 0;
-                                }
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                OP LSS- Return 1 if the value at the top of
-                                the stack is greater than the second value
-                                in the stack, otherwise return 0
-                            */
-                            case 7:
-                            {
-                                // Compare the two values, store the result
-                                if(pas[sp + 1] < pas[sp])
-                                {
-                                    pas[sp + 1] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp + 1] = 0;
-                                }
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-                            /*
-                                OP LEQ- Return 1 if the value at the top of
-                                the stack is greater than or equal to the second
-                                value in the stack, otherwise return 0
-                            */
-                            case 8:
-                            {
-                                // Compare the two values, store the result
-                                if(pas[sp + 1] <= pas[sp])
-                                {
-                                    pas[sp + 1] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp + 1] = 0;
-                                }
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-                            /*
-                                OP GTR- Return 1 if the value at the top of
-                                the stack is less than the second
-                                value in the stack, otherwise return 0
-                            */
-                            case 9:
-                            {
-                                // Compare the two values, store the result
-                                if(pas[sp + 1] > pas[sp])
-                                {
-                                    pas[sp + 1] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp + 1] = 0;
-                                }
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-                            /*
-                                OP GEQ- Return 1 if the value at the top of
-                                the stack is less than or equal to the second
-                                value in the stack, otherwise return 0
-                            */
-                            case 10:
-                            {
-                                // Compare the two values, store the result
-                                if(pas[sp + 1] >= pas[sp])
-                                {
-                                    pas[sp + 1] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp + 1] = 0;
-                                }
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-                            /*
-                                OP EVEN- Replace the top of the stack with 1 
-                                if the value at the top of the stack is even
-                                or 0 if it is odd
-                            */
-                            case 11:
-                            {
-                                if(pas[sp] % 2 == 0)
-                                {
-                                    pas[sp] = 1;
-                                }
-                                else
-                                {
-                                    pas[sp] = 0;
-                                }
-                            }
-                            break;
-
-                            default:
-                                fprintf(stderr, "Invalid input");
-                        }
-                    }
-                    break;
-
-                    /*
-                        LOD- Load a value from the given location onto the
-                        top of the stack
-                    */
-                    case 3:
-                    {
-                        // Move sp to the top of the stack
-                        sp--;
-
-                        // Store the given value at sp
-                        pas[sp] = pas[base(bp, l) - m];
-                    }
-                    break;
-
-                    /*
-                        STO- Pop the value at the top of the stack in
-                        the given location
-                    */
-                    case 4:
-                    {
-                        // Store the value at the given index to the given location
-                        pas[base(bp, l) - m] = pas[sp];
-
-                        // Pop the given value from the stack
-                        pas[sp] = 0;
-                        sp++;
-                    }
-                    break;
-
-                    /*
-                        CAL- Call the procedure at the given address in a
-                        new activision record
-                    */
-                    case 5:
-                    {
-                        // Create a new activision record at the top of the stack
-                        pas[sp - 1] = base(bp, l);
-                        pas[sp - 2] = bp;
-                        pas[sp - 3] = pc - 3;
-
-                        // Set bp to the base of the activision record
-                        bp = sp - 1;
-
-                        // Set pc to the start of pas at displacement m
-                        pc = (PAS_SIZE - 1 - m) + 3;
-                    }
-                    break;
-
-                    /*
-                        INC- Allocate space for the given number of local 
-                        variables
-                    */
-                    case 6:
-                    {
-                        // Increment the sp by the number of local variables
-                        sp -= m;
-                    }
-                    break;
-
-                    /*
-                        JMP- Jump to the given address unconditionally
-                    */
-                    case 7:
-                    {
-                        // Set the PC to the given location
-                        pc = (PAS_SIZE - 1 - m) + 3;
-                    }
-                    break;
-
-                    /*
-                        JPC- Jump to the given address if the top of the
-                        stack equals 0
-                    */
-                    case 8:
-                    {
-                        // If the top of the stack equals 0
-                        if(pas[sp] == 0) 
-                        {
-                            // Set the PC to the given location
-                            pc = (PAS_SIZE - 1 - m) + 3;
-                        }
-
-                        // Pop the operation from the stack
-                        pas[sp] = 0;
-                        sp++;      
-                    }                      
-                    break;
-
-                    case 9:
-                    {
-                        switch(m)
-                        {
-                            /*
-                                SYS 1- Print the value at the top of the stack
-                            */
-                            case 1:
-                            {
-                                // Print the value at the top of the stack
-                                printf("Output result is: %d\n", pas[sp]);
-
-                                // Pop the operation from the stack
-                                pas[sp] = 0;
-                                sp++;
-                            }
-                            break;
-
-                            /*
-                                SYS 2- Read an input value from stdin and push it
-                                to the top of the stack
-                            */
-                            case 2:
-                            {
-                                // Navigate to the top of the stack
-                                sp--;
-
-                                // Read the input value
-                                printf("Please Enter an Integer: ");
-                                int input;
-                                scanf("%d", &input);
-
-                                // Store the input value
-                                pas[sp] = input;
-                            }
-                            break;
-
-                            /*
-                                SYS 3- Halt the program
-                            */
-                            case 3:
-                            {
-                                // Make the condition in the while loop false
-                                pc = bp + 3;
-                            }
-                            break;
-                        }
-                    }
-                    break;
-
-                    default:
-                        fprintf(stderr, "Invalid input");
-                        exit(1);
-                    break;
-                }
-
-                // Update pc
-                pc -= 3;
+                fprintf(stderr, "%s", vm_error(vm));
+                exit(status);
+            }
 
-                // Print the operation
-                print(pc, bp, sp, op, l, m);
+            if(stats && !differential)
+            {
+                vm_report(vm);
             }
 
         // Free pointers
         fclose(inputFile);
+        vm_destroy(vm);
+    }
+#endif
+
+// Address space
+    /*
+        Create a machine with a PAS of size words, the guard region below
+            it and a guard page after it. The display and its links are mapped alongside, sized for
+            the deepest call chain the PAS can hold, with a guard page after
+            the links.
+
+        Memory is reserved, not committed, so only the pages the program
+            touches cost anything even for a PAS of several gigabytes.
+
+        The first call installs a SIGSEGV handler for the whole process
+            (see guard_fault()). Faults outside a machine's guard regions
+            go on to the handler installed before it, so a program that
+            wants its own SIGSEGV handler should install it before creating
+            a machine.
+
+        Returns NULL if the memory cannot be mapped
+    */
+    Vm *vm_create(int size, int hugePages)
+    {
+        Vm *vm = calloc(1, sizeof(Vm));
+
+        if(!vm)
+        {
+            return NULL;
+        }
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t guardBytes = (GUARD_WORDS * sizeof(int) + page - 1) / page * page;
+        size_t pasBytes = ((size_t)size * sizeof(int) + page - 1) / page * page;
+
+        vm->pasMapSize = guardBytes + pasBytes + page;
+        vm->pasMap = mmap(NULL, vm->pasMapSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if(vm->pasMap == MAP_FAILED)
+        {
+            free(vm);
+            return NULL;
+        }
+
+        mprotect(vm->pasMap, guardBytes, PROT_NONE);
+        vm->pas = (int *)(vm->pasMap + guardBytes);
+        vm->pasEndGuard = vm->pasMap + guardBytes + pasBytes;
+        mprotect(vm->pasEndGuard, page, PROT_NONE);
+
+        if(hugePages)
+        {
+            madvise(vm->pas, pasBytes, MADV_HUGEPAGE);
+        }
+
+        vm->pasSize = size;
+        vm->engine = ENGINE_STACK;
+        vm->input = stdin;
+        vm->output = stdout;
+
+        // Every activation record takes at least three words
+        vm->maxCalls = size / 3 + 1;
+
+        vm->display = map_words(sizeof(int) * vm->maxCalls, hugePages, NULL);
+        vm->displayLinks = map_words(sizeof(DisplayLink) * vm->maxCalls, hugePages, &vm->linksGuard);
+
+        if(!vm->display || !vm->displayLinks)
+        {
+            vm_destroy(vm);
+            return NULL;
+        }
+
+        // Report overflows that land in a guard region. The handler is the
+        // same for every machine, it finds the one running on the thread.
+        static pthread_once_t guardOnce = PTHREAD_ONCE_INIT;
+        pthread_once(&guardOnce, install_guard_handler);
+
+        return vm;
+    }
+
+    /*
+        Unmap the memory of a machine and free everything it loaded
+    */
+    void vm_destroy(Vm *vm)
+    {
+        if(!vm)
+        {
+            return;
+        }
+
+        munmap(vm->pasMap, vm->pasMapSize);
+
+        if(vm->display)
+        {
+            unmap_words(vm->display, sizeof(int) * vm->maxCalls);
+        }
+        if(vm->displayLinks)
+        {
+            unmap_words(vm->displayLinks, sizeof(DisplayLink) * vm->maxCalls);
+        }
+
+        free_registers(vm);
+        free_jit(vm);
+        free_profile(vm);
+
+        free(vm->codeWords);
+        free(vm->program);
+        free(vm->symbols);
+        free(vm);
+    }
+
+    /*
+        Map zeroed memory, followed by an inaccessible guard page whose address
+            is stored in guard when guard is not NULL
+
+        Returns NULL if the memory cannot be mapped
+    */
+    void *map_words(size_t bytes, int hugePages, char **guard)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        bytes = (bytes + page - 1) / page * page;
+
+        char *map = mmap(NULL, bytes + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if(map == MAP_FAILED)
+        {
+            return NULL;
+        }
+
+        mprotect(map + bytes, page, PROT_NONE);
+
+        if(hugePages)
+        {
+            madvise(map, bytes, MADV_HUGEPAGE);
+        }
+
+        if(guard)
+        {
+            *guard = map + bytes;
+        }
+
+        return map;
+    }
+
+    /*
+        Unmap what map_words() mapped for the same number of bytes
+    */
+    void unmap_words(void *map, size_t bytes)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        bytes = (bytes + page - 1) / page * page;
+
+        munmap(map, bytes + page);
+    }
+
+    /*
+        SIGSEGV handler: a fault inside a guard region of the machine running
+            on this thread is a stack overflow (or, after the PAS, a stack
+            underflow), which ends its run. Any other fault is passed on to
+            the handler that was installed before.
+
+        The fault always comes from the execution loop and never from inside
+            stdio or malloc, so leaving it for vm_run() is safe.
+    */
+    void guard_fault(int signal, siginfo_t *info, void *context)
+    {
+        Vm *vm = runningVm;
+        char *address = info->si_addr;
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        if(vm)
+        {
+            int inPasGuard = address >= vm->pasMap && address < (char *)vm->pas;
+            int inLinksGuard = vm->linksGuard && address >= vm->linksGuard && address < vm->linksGuard + page;
+
+            if(inPasGuard || inLinksGuard)
+            {
+                strcpy(vm->error, "Error: Stack overflow");
+                siglongjmp(vm->escape, 1);
+            }
+
+            if(address >= vm->pasEndGuard && address < vm->pasEndGuard + page)
+            {
+                strcpy(vm->error, "Error: Stack underflow");
+                siglongjmp(vm->escape, 1);
+            }
+        }
+
+        // Not ours
+        if(previousFault.sa_flags & SA_SIGINFO)
+        {
+            previousFault.sa_sigaction(signal, info, context);
+        }
+        else if(previousFault.sa_handler != SIG_DFL && previousFault.sa_handler != SIG_IGN)
+        {
+            previousFault.sa_handler(signal);
+        }
+        else
+        {
+            // Let the previous action run when the access is retried
+            sigaction(SIGSEGV, &previousFault, NULL);
+        }
+    }
+
+    /*
+        Install guard_fault() for the whole process, once for all machines
+    */
+    void install_guard_handler()
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = guard_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &action, &previousFault);
+    }
+
+    /*
+        Reject code that could reach outside the machine's memory before any
+            of it runs. The guard region only catches the stack growing down
+            into it, so the operands are checked here:
+            - an INC larger than the guard region could step over it, and a
+                negative one would move the stack above the PAS
+            - LOD and STO address FRAME(l) - m, and every frame base lies
+                between 0 and the base of the main program, so m must keep
+                the word inside the PAS or at worst in the guard region
+            - CAL, JMP and JPC must land on an instruction or the end of the
+                code
+            - static levels are never negative
+            The frames themselves come from the stack, so the links RTN and
+            base() follow are checked as the program runs (see DO_RTN).
+    */
+    void check_code(Vm *vm)
+    {
+        static char *names[] = {"", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS"};
+        int count = vm->codeLength / 3;
+        int mainBase = vm->pasSize - 1 - vm->codeLength;
+        int deepest = mainBase < GUARD_WORDS ? mainBase : GUARD_WORDS;
+
+        for(int i = 0; i < count; i++)
+        {
+            int op = vm->codeWords[i * 3];
+            int l = vm->codeWords[i * 3 + 1];
+            int m = vm->codeWords[i * 3 + 2];
+
+            if(op == INC && m > GUARD_WORDS - 3)
+            {
+                vm_fail(vm, "Error: Activation record of %d words is too large", m);
+            }
+
+            if(op == INC && m < 0)
+            {
+                vm_fail(vm, "Error: INC %d %d at instruction %d moves the stack out of the PAS", l, m, i);
+            }
+
+            if((op == LOD || op == STO || op == CAL) && l < 0)
+            {
+                vm_fail(vm, "Error: %s %d %d at instruction %d has a negative level", names[op], l, m, i);
+            }
+
+            if((op == LOD || op == STO) && (m > deepest || m < -vm->codeLength))
+            {
+                vm_fail(vm, "Error: %s %d %d at instruction %d reaches outside the PAS", names[op], l, m, i);
+            }
+
+            if((op == CAL || op == JMP || op == JPC) && (m < 0 || m / 3 > count))
+            {
+                vm_fail(vm, "Error: %s %d %d at instruction %d jumps outside the code", names[op], l, m, i);
+            }
+        }
+    }
+
+// Errors
+    /*
+        Keep the message of an error for vm_error()
+
+        Returns -1, for the caller to return
+    */
+    int set_error(Vm *vm, char *format, ...)
+    {
+        va_list arguments;
+
+        va_start(arguments, format);
+        vsnprintf(vm->error, ERROR_SIZE, format, arguments);
+        va_end(arguments);
+
+        return -1;
+    }
+
+    /*
+        Stop the run in progress with an error: vm_run() returns 1 and the
+            message is kept for vm_error()
+    */
+    _Noreturn void vm_fail(Vm *vm, char *format, ...)
+    {
+        va_list arguments;
+
+        va_start(arguments, format);
+        vsnprintf(vm->error, ERROR_SIZE, format, arguments);
+        va_end(arguments);
+
+        siglongjmp(vm->escape, 1);
+    }
+
+    /*
+        The message of the error that ended the last load or run, exactly as
+            the VM used to print it before exiting; empty if there was none
+    */
+    char *vm_error(Vm *vm)
+    {
+        return vm->error;
+    }
+
+// Loading
+    /*
+        Store one word of code after the words already loaded
+
+        Returns 0, or -1 if the code does not fit in the PAS
+    */
+    int load_word(Vm *vm, int word)
+    {
+        if(vm->codeLength >= vm->pasSize)
+        {
+            return set_error(vm, "Error: Program does not fit in the PAS");
+        }
+
+        if(vm->codeLength == vm->codeCapacity)
+        {
+            vm->codeCapacity = vm->codeCapacity ? vm->codeCapacity * 2 : 3 * 64;
+            vm->codeWords = realloc(vm->codeWords, sizeof(int) * vm->codeCapacity);
+        }
+
+        vm->codeWords[vm->codeLength] = word;
+        vm->codeLength++;
+
+        return 0;
+    }
+
+    /*
+        Store an instruction list produced in memory by the code generator
+
+        Returns 0, or -1 if the code does not fit in the PAS
+    */
+    int vm_load(Vm *vm, Instruction *code, int count)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(load_word(vm, code[i].o) || load_word(vm, code[i].l) || load_word(vm, code[i].m))
+            {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    /*
+        Store the code section of a mapped binary image
+
+        Returns 0, or -1 if the code does not fit in the PAS
+    */
+    int vm_load_image(Vm *vm, ElfImage *image)
+    {
+        int words = image->codeCount * 3;
+
+        for(int i = 0; i < words; i++)
+        {
+            if(load_word(vm, image->code[i]))
+            {
+                return -1;
+            }
+        }
+
+        vm_load_symbols(vm, image->symbols, image->symbolCount);
+        return 0;
+    }
+
+    /*
+        Keep the symbols of the loaded program, which name its procedures in
+            the profile
+    */
+    void vm_load_symbols(Vm *vm, ElfSymbol *loaded, int count)
+    {
+        free(vm->symbols);
+        vm->symbols = malloc(sizeof(ElfSymbol) * (count + 1));
+        vm->symbolCount = count;
+
+        if(count > 0)
+        {
+            memcpy(vm->symbols, loaded, sizeof(ElfSymbol) * count);
+        }
+    }
+
+    /*
+        Read SYS READ input from input and write the program output and the
+            trace to output instead of stdin and stdout
+    */
+    void vm_set_streams(Vm *vm, FILE *input, FILE *output)
+    {
+        vm->input = input;
+        vm->output = output;
+    }
+
+// Instruction bodies
+    /*
+        Every engine below executes instructions through these macros, so the
+            semantics are written once. They work on the registers ip (index
+            of the next instruction), bp, sp and level and the operands l and
+            m of the engine that expands them, on its machine vm, and on the
+            parts of the machine VM_LOCALS copies into locals.
+    */
+
+    /*
+        The machine's memory and program, read into locals of the function
+            running the instructions so they stay in registers. Everything
+            else the bodies change is in the machine itself.
+    */
+    #define VM_LOCALS \
+        int *pas = vm->pas; \
+        int pasSize = vm->pasSize; \
+        int *bps = vm->bps; \
+        int *display = vm->display; \
+        DisplayLink *displayLinks = vm->displayLinks; \
+        Decoded *program = vm->program; \
+        int programCount = vm->programCount; \
+        (void)pas; \
+        (void)pasSize; \
+        (void)bps; \
+        (void)display; \
+        (void)displayLinks; \
+        (void)program; \
+        (void)programCount;
+
+    /*
+        Code address of an instruction, as the original PM/0 layout had it:
+            the code sits at the top of the PAS, three words per instruction
+    */
+    #define ADDRESS(ip) (pasSize - 1 - 3 * (ip))
+
+    /*
+        Base of the activation record l static levels out from the current
+            one. The display holds the base of the newest record at every
+            static level, so this is one load no matter how deep the nesting
+            is. Only an l that reaches past the main program (which a correct
+            program never emits) falls back to walking the static links.
+    */
+    #define FRAME(l) ((l) <= level ? display[level - (l)] : base(vm, bp, (l)))
+
+    /*
+        LIT- Push the literal value m to the very top of pas
+    */
+    #define DO_LIT \
+        sp--; \
+        pas[sp] = m;
+
+    /*
+        OP RTN- finish with child ar and return to parent ar: move sp to the
+            ar's return address, restore ip and bp, then pop the ar header.
+            A return address outside the code ends the program, as it did
+            when the loop stopped once pc fell below bp. A dynamic link
+            outside the stack can only come from code that overwrote it, and
+            ends the run before any frame is read through it.
+    */
+    #define DO_RTN \
+        sp = bp - 2; \
+        ip = (pasSize - 1 - pas[sp]) / 3; \
+        if((unsigned)ip > (unsigned)programCount) \
+        { \
+            ip = programCount; \
+        } \
+        bp = pas[sp + 1]; \
+        if((unsigned)bp > (unsigned)(pasSize - 1 - vm->codeLength)) \
+        { \
+            vm_fail(vm, "Error: RTN to a frame outside the PAS"); \
+        } \
+        sp += 3; \
+        bps[1]--; \
+        if(vm->displayTop > 0) \
+        { \
+            vm->displayTop--; \
+            display[level] = displayLinks[vm->displayTop].base; \
+            level = displayLinks[vm->displayTop].level; \
+        }
+
+    /*
+        The values of the arithmetic operations. Sums, differences and
+            products are computed on unsigned ints, so they wrap around on
+            overflow the way the compiler folds them. A quotient that does
+            not exist ends the run (see divide_values()).
+    */
+    #define ADD_VALUES(a, b) ((int)((unsigned)(a) + (unsigned)(b)))
+    #define SUB_VALUES(a, b) ((int)((unsigned)(a) - (unsigned)(b)))
+    #define MUL_VALUES(a, b) ((int)((unsigned)(a) * (unsigned)(b)))
+    #define DIV_VALUES(a, b) divide_values(vm, (a), (b))
+
+    /*
+        OP ADD, SUB, MUL, DIV- Apply the operation on the second value with
+            the value at the top of pas, then pop the first value
+    */
+    #define DO_ARITHMETIC(operation) \
+        pas[sp + 1] = operation(pas[sp + 1], pas[sp]); \
+        pas[sp] = 0; \
+        sp++;
+
+    /*
+        OP EQL, NEQ, LSS, LEQ, GTR, GEQ- Replace the second value with 1 if
+            the comparison holds, otherwise 0, then pop the first value
+    */
+    #define DO_COMPARE(operator) \
+        pas[sp + 1] = (pas[sp + 1] operator pas[sp]) ? 1 : 0; \
+        pas[sp] = 0; \
+        sp++;
+
+    /*
+        OP EVEN- Replace the top of the stack with 1 if the value at the top of
+            the stack is even or 0 if it is odd
+    */
+    #define DO_EVEN \
+        pas[sp] = (pas[sp] % 2 == 0) ? 1 : 0;
+
+    /*
+        LOD- Load a value from the given location onto the top of the stack
+    */
+    #define DO_LOD \
+        sp--; \
+        pas[sp] = pas[FRAME(l) - m];
+
+    /*
+        STO- Pop the value at the top of the stack in the given location
+    */
+    #define DO_STO \
+        pas[FRAME(l) - m] = pas[sp]; \
+        pas[sp] = 0; \
+        sp++;
+
+    /*
+        CAL- Call the procedure at instruction m in a new activision record:
+            static link, dynamic link, return address. The return address is
+            stored as a code address so the stack looks as it always did.
+            The callee sits one static level inside the record its static
+            link points to, so its base replaces that level's display entry
+            until it returns.
+    */
+    #define DO_CAL \
+        pas[sp - 1] = FRAME(l); \
+        pas[sp - 2] = bp; \
+        pas[sp - 3] = ADDRESS(ip); \
+        bp = sp - 1; \
+        ip = m; \
+        displayLinks[vm->displayTop].level = level; \
+        level = (l <= level) ? level - l + 1 : 0; \
+        displayLinks[vm->displayTop].base = display[level]; \
+        vm->displayTop++; \
+        display[level] = bp;
+
+    /*
+        INC- Allocate space for the given number of local variables
+    */
+    #define DO_INC \
+        sp -= m;
+
+    /*
+        JMP- Jump to instruction m unconditionally
+    */
+    #define DO_JMP \
+        ip = m;
+
+    /*
+        JPC- Jump to instruction m if the top of the stack equals 0, then pop
+            the top of the stack
+    */
+    #define DO_JPC \
+        if(pas[sp] == 0) \
+        { \
+            ip = m; \
+        } \
+        pas[sp] = 0; \
+        sp++;
+
+    /*
+        SYS 1- Print the value at the top of the stack and pop it
+    */
+    #define DO_OUT \
+        write_output(vm, pas[sp]); \
+        pas[sp] = 0; \
+        sp++;
+
+    /*
+        SYS 2- Read an input value from the machine's input and push it to the
+            top of the stack
+    */
+    #define DO_READ \
+        sp--; \
+        pas[sp] = read_input(vm);
+
+    /*
+        SYS 3 (halt) and the end of the code are handled by each engine, since
+            they leave the execution loop
+    */
+
+// Superinstruction bodies
+    /*
+        A superinstruction replaces only the opcode of the first instruction
+            of its sequence; the others stay in the program untouched. The
+            body reads their operands from program[ip] onwards and skips
+            them, and a jump into the middle of the sequence still runs the
+            original instructions one at a time.
+
+        Each body leaves the stack exactly as the sequence would: the net
+            change to sp is the same and the slots the sequence pushed and
+            popped end up zeroed, since later records can see them.
+    */
+
+    /*
+        LIT c, STO- Store a constant
+    */
+    #define DO_LIT_STO \
+        pas[FRAME(program[ip].l) - program[ip].m] = m; \
+        pas[sp - 1] = 0; \
+        ip += 1; \
+        vm->fusedRuns++;
+
+    /*
+        LOD, SYS OUT- Print a variable
+    */
+    #define DO_LOD_OUT \
+        write_output(vm, pas[FRAME(l) - m]); \
+        pas[sp - 1] = 0; \
+        ip += 1; \
+        vm->fusedRuns++;
+
+    /*
+        LOD, LIT c, OPR compare, JPC- Compare a variable with a constant and
+            jump if the comparison fails
+    */
+    #define DO_LOD_LIT_JPC(operator) \
+        { \
+            int value = pas[FRAME(l) - m]; \
+            pas[sp - 2] = 0; \
+            pas[sp - 1] = 0; \
+            ip = (value operator program[ip].m) ? ip + 3 : program[ip + 2].m; \
+            vm->fusedRuns++; \
+        }
+
+    /*
+        LOD, LIT c, OPR arithmetic, STO- Assign a variable combined with a
+            constant, such as x := x - 1
+    */
+    #define DO_LOD_LIT_STO(operation) \
+        { \
+            int value = operation(pas[FRAME(l) - m], program[ip].m); \
+            pas[sp - 2] = 0; \
+            pas[FRAME(program[ip + 2].l) - program[ip + 2].m] = value; \
+            pas[sp - 1] = 0; \
+            ip += 3; \
+            vm->fusedRuns++; \
+        }
+
+    /*
+        LOD, LOD, OPR arithmetic, STO- Assign two variables combined, such as
+            x := x + y
+    */
+    #define DO_LOD_LOD_STO(operation) \
+        { \
+            int value = operation(pas[FRAME(l) - m], pas[FRAME(program[ip].l) - program[ip].m]); \
+            pas[sp - 2] = 0; \
+            pas[FRAME(program[ip + 2].l) - program[ip + 2].m] = value; \
+            pas[sp - 1] = 0; \
+            ip += 3; \
+            vm->fusedRuns++; \
+        }
+
+// Predecoding
+    /*
+        Maps an (op, m) pair onto a single opcode, so every engine reaches any
+            instruction, including each OPR and SYS variant, with one switch,
+            indirect jump or call
+    */
+    int flatten_opcode(int op, int m)
+    {
+        switch(op)
+        {
+            case LIT: return FLAT_LIT;
+            case OPR: return (m >= RTN && m <= EVEN) ? FLAT_RTN + m : FLAT_OPR_INVALID;
+            case LOD: return FLAT_LOD;
+            case STO: return FLAT_STO;
+            case CAL: return FLAT_CAL;
+            case INC: return FLAT_INC;
+            case JMP: return FLAT_JMP;
+            case JPC: return FLAT_JPC;
+            case SYS: return (m >= OUT && m <= HLT) ? FLAT_OUT + m - OUT : FLAT_SYS_NONE;
+            default: return FLAT_INVALID;
+        }
+    }
+
+    /*
+        Translate the loaded code into the program array: flattened opcodes,
+            jump and call targets as instruction indexes, and a final
+            FLAT_END entry so running off the end stops the program. Stops
+            with an error if a jump or call leaves the code.
+
+        With fuse set common sequences are also turned into superinstructions
+            (the trace has to show every instruction, so it runs without)
+    */
+    void decode_program(Vm *vm, int fuse)
+    {
+        int count = vm->codeLength / 3;
+
+        free(vm->program);
+        vm->program = malloc(sizeof(Decoded) * (count + 1));
+        vm->programCount = count;
+
+        Decoded *program = vm->program;
+
+        for(int i = 0; i < count; i++)
+        {
+            int op = vm->codeWords[i * 3];
+            int l = vm->codeWords[i * 3 + 1];
+            int m = vm->codeWords[i * 3 + 2];
+
+            // Targets are in range (see check_code())
+            if(op == CAL || op == JMP || op == JPC)
+            {
+                m /= 3;
+            }
+
+            program[i].op = flatten_opcode(op, m);
+            program[i].l = l;
+            program[i].m = m;
+        }
+
+        program[count].op = FLAT_END;
+        program[count].l = 0;
+        program[count].m = 0;
+
+        vm->fusedCount = 0;
+        vm->fusedRuns = 0;
+
+        if(fuse)
+        {
+            fuse_program(vm);
+        }
+    }
+
+    /*
+        Replace the first instruction of every sequence below with its
+            superinstruction. The sequences are the ones the test programs
+            spend most of their instructions in: a loop or if condition
+            against a constant (LOD LIT compare JPC), an update such as
+            x := x - 1 or x := x + y, a constant assignment and a write.
+
+        The program is scanned front to back, so the instructions after i are
+            still unfused when i is matched. Sequences may overlap: the
+            instructions inside one keep their own superinstruction for when
+            they are reached by a jump.
+    */
+    void fuse_program(Vm *vm)
+    {
+        Decoded *program = vm->program;
+        int programCount = vm->programCount;
+
+        for(int i = 0; i < programCount; i++)
+        {
+            // Opcodes of the sequence starting at i; FLAT_END past the end
+            int op[4];
+
+            for(int k = 0; k < 4; k++)
+            {
+                op[k] = (i + k < programCount) ? program[i + k].op : FLAT_END;
+            }
+
+            int compare = op[2] >= FLAT_EQL && op[2] <= FLAT_GEQ;
+            int arithmetic = op[2] >= FLAT_ADD && op[2] <= FLAT_DIV;
+            int fused = FLAT_INVALID;
+
+            if(op[0] == FLAT_LOD && op[1] == FLAT_LIT && compare && op[3] == FLAT_JPC)
+            {
+                fused = FLAT_LOD_LIT_EQL_JPC + op[2] - FLAT_EQL;
+            }
+            else if(op[0] == FLAT_LOD && op[1] == FLAT_LIT && arithmetic && op[3] == FLAT_STO)
+            {
+                fused = FLAT_LOD_LIT_ADD_STO + op[2] - FLAT_ADD;
+            }
+            else if(op[0] == FLAT_LOD && op[1] == FLAT_LOD && arithmetic && op[3] == FLAT_STO)
+            {
+                fused = FLAT_LOD_LOD_ADD_STO + op[2] - FLAT_ADD;
+            }
+            else if(op[0] == FLAT_LIT && op[1] == FLAT_STO)
+            {
+                fused = FLAT_LIT_STO;
+            }
+            else if(op[0] == FLAT_LOD && op[1] == FLAT_OUT)
+            {
+                fused = FLAT_LOD_OUT;
+            }
+
+            if(fused != FLAT_INVALID)
+            {
+                program[i].op = fused;
+                vm->fusedCount++;
+            }
+        }
+    }
+
+    /*
+        Print how many superinstructions the program had and how many of them
+            were executed, or how the register engine translated it
+    */
+    void vm_report(Vm *vm)
+    {
+        if(vm->engine == ENGINE_REGISTER)
+        {
+            report_registers(vm);
+            return;
+        }
+
+        if(vm->engine == ENGINE_JIT)
+        {
+            report_jit(vm);
+            return;
+        }
+
+        fprintf(stderr, "Superinstructions: %d in the program, %ld executed\n",
+            vm->fusedCount, vm->fusedRuns);
+    }
+
+    /*
+        Select the engine that runs the fast mode: ENGINE_STACK (the dispatch
+            engine built in, with superinstructions), ENGINE_REGISTER (the
+            program translated to register code, see vm_register.h) or
+            ENGINE_JIT (native code, see vm_jit.h)
+    */
+    void vm_select_engine(Vm *vm, int selected)
+    {
+        vm->engine = selected;
+    }
+
+    char *dispatch_name()
+    {
+        #if DISPATCH == DISPATCH_SWITCH
+            return "switch";
+        #elif DISPATCH == DISPATCH_DIRECT
+            return "direct threading";
+        #else
+            return "call threading";
+        #endif
+    }
+
+// Call threading handlers
+#if DISPATCH == DISPATCH_CALL
+    /*
+        Registers shared by the handler functions, and the machine they run on
+    */
+    typedef struct {
+        int ip;
+        int bp;
+        int sp;
+        int level;
+        int l;
+        int m;
+        int running;
+        Vm *vm;
+    } Registers;
+
+    typedef void (*Handler)(Registers *r);
+
+    /*
+        Defines a handler that copies the registers in, runs an instruction
+            body and copies them back out
+    */
+    #define CALL_HANDLER(name, body) \
+        static void name(Registers *r) \
+        { \
+            Vm *vm = r->vm; \
+            VM_LOCALS \
+            int ip = r->ip, bp = r->bp, sp = r->sp, level = r->level; \
+            int l = r->l, m = r->m; \
+            (void)l; \
+            (void)m; \
+            body \
+            r->ip = ip; \
+            r->bp = bp; \
+            r->sp = sp; \
+            r->level = level; \
+        }
+
+    CALL_HANDLER(call_lit, DO_LIT)
+    CALL_HANDLER(call_rtn, DO_RTN)
+    CALL_HANDLER(call_add, DO_ARITHMETIC(ADD_VALUES))
+    CALL_HANDLER(call_sub, DO_ARITHMETIC(SUB_VALUES))
+    CALL_HANDLER(call_mul, DO_ARITHMETIC(MUL_VALUES))
+    CALL_HANDLER(call_div, DO_ARITHMETIC(DIV_VALUES))
+    CALL_HANDLER(call_eql, DO_COMPARE(==))
+    CALL_HANDLER(call_neq, DO_COMPARE(!=))
+    CALL_HANDLER(call_lss, DO_COMPARE(<))
+    CALL_HANDLER(call_leq, DO_COMPARE(<=))
+    CALL_HANDLER(call_gtr, DO_COMPARE(>))
+    CALL_HANDLER(call_geq, DO_COMPARE(>=))
+    CALL_HANDLER(call_even, DO_EVEN)
+    CALL_HANDLER(call_lod, DO_LOD)
+    CALL_HANDLER(call_sto, DO_STO)
+    CALL_HANDLER(call_cal, DO_CAL)
+    CALL_HANDLER(call_inc, DO_INC)
+    CALL_HANDLER(call_jmp, DO_JMP)
+    CALL_HANDLER(call_jpc, DO_JPC)
+    CALL_HANDLER(call_out, DO_OUT)
+    CALL_HANDLER(call_read, DO_READ)
+    CALL_HANDLER(call_sys_none, )
+
+    CALL_HANDLER(call_lit_sto, DO_LIT_STO)
+    CALL_HANDLER(call_lod_out, DO_LOD_OUT)
+    CALL_HANDLER(call_lod_lit_eql_jpc, DO_LOD_LIT_JPC(==))
+    CALL_HANDLER(call_lod_lit_neq_jpc, DO_LOD_LIT_JPC(!=))
+    CALL_HANDLER(call_lod_lit_lss_jpc, DO_LOD_LIT_JPC(<))
+    CALL_HANDLER(call_lod_lit_leq_jpc, DO_LOD_LIT_JPC(<=))
+    CALL_HANDLER(call_lod_lit_gtr_jpc, DO_LOD_LIT_JPC(>))
+    CALL_HANDLER(call_lod_lit_geq_jpc, DO_LOD_LIT_JPC(>=))
+    CALL_HANDLER(call_lod_lit_add_sto, DO_LOD_LIT_STO(ADD_VALUES))
+    CALL_HANDLER(call_lod_lit_sub_sto, DO_LOD_LIT_STO(SUB_VALUES))
+    CALL_HANDLER(call_lod_lit_mul_sto, DO_LOD_LIT_STO(MUL_VALUES))
+    CALL_HANDLER(call_lod_lit_div_sto, DO_LOD_LIT_STO(DIV_VALUES))
+    CALL_HANDLER(call_lod_lod_add_sto, DO_LOD_LOD_STO(ADD_VALUES))
+    CALL_HANDLER(call_lod_lod_sub_sto, DO_LOD_LOD_STO(SUB_VALUES))
+    CALL_HANDLER(call_lod_lod_mul_sto, DO_LOD_LOD_STO(MUL_VALUES))
+    CALL_HANDLER(call_lod_lod_div_sto, DO_LOD_LOD_STO(DIV_VALUES))
+
+    static void call_hlt(Registers *r)
+    {
+        r->running = 0;
     }
 
-    int base(int BP, int L) 
+    static void call_opr_invalid(Registers *r)
     {
+        fprintf(stderr, "Invalid input");
+    }
+
+    static void call_invalid(Registers *r)
+    {
+        vm_fail(r->vm, "Invalid input");
+    }
+
+    static Handler handlers[FLAT_COUNT] = {
+        [FLAT_INVALID] = call_invalid,
+        [FLAT_LIT] = call_lit,
+        [FLAT_LOD] = call_lod,
+        [FLAT_STO] = call_sto,
+        [FLAT_CAL] = call_cal,
+        [FLAT_INC] = call_inc,
+        [FLAT_JMP] = call_jmp,
+        [FLAT_JPC] = call_jpc,
+        [FLAT_RTN] = call_rtn,
+        [FLAT_ADD] = call_add,
+        [FLAT_SUB] = call_sub,
+        [FLAT_MUL] = call_mul,
+        [FLAT_DIV] = call_div,
+        [FLAT_EQL] = call_eql,
+        [FLAT_NEQ] = call_neq,
+        [FLAT_LSS] = call_lss,
+        [FLAT_LEQ] = call_leq,
+        [FLAT_GTR] = call_gtr,
+        [FLAT_GEQ] = call_geq,
+        [FLAT_EVEN] = call_even,
+        [FLAT_OPR_INVALID] = call_opr_invalid,
+        [FLAT_OUT] = call_out,
+        [FLAT_READ] = call_read,
+        [FLAT_HLT] = call_hlt,
+        [FLAT_SYS_NONE] = call_sys_none,
+        [FLAT_END] = call_hlt,
+        [FLAT_LIT_STO] = call_lit_sto,
+        [FLAT_LOD_OUT] = call_lod_out,
+        [FLAT_LOD_LIT_EQL_JPC] = call_lod_lit_eql_jpc,
+        [FLAT_LOD_LIT_NEQ_JPC] = call_lod_lit_neq_jpc,
+        [FLAT_LOD_LIT_LSS_JPC] = call_lod_lit_lss_jpc,
+        [FLAT_LOD_LIT_LEQ_JPC] = call_lod_lit_leq_jpc,
+        [FLAT_LOD_LIT_GTR_JPC] = call_lod_lit_gtr_jpc,
+        [FLAT_LOD_LIT_GEQ_JPC] = call_lod_lit_geq_jpc,
+        [FLAT_LOD_LIT_ADD_STO] = call_lod_lit_add_sto,
+        [FLAT_LOD_LIT_SUB_STO] = call_lod_lit_sub_sto,
+        [FLAT_LOD_LIT_MUL_STO] = call_lod_lit_mul_sto,
+        [FLAT_LOD_LIT_DIV_STO] = call_lod_lit_div_sto,
+        [FLAT_LOD_LOD_ADD_STO] = call_lod_lod_add_sto,
+        [FLAT_LOD_LOD_SUB_STO] = call_lod_lod_sub_sto,
+        [FLAT_LOD_LOD_MUL_STO] = call_lod_lod_mul_sto,
+        [FLAT_LOD_LOD_DIV_STO] = call_lod_lod_div_sto
+    };
+#endif
+
+// Execution
+    #define ENGINE_FUNCTION execute_traced
+    #define TRACE 1
+    #include "vm_engine.h"
+
+    #define ENGINE_FUNCTION execute_fast
+    #define TRACE 0
+    #include "vm_engine.h"
+
+    #define ENGINE_FUNCTION execute_counted
+    #define TRACE 0
+    #define COUNTING 1
+    #include "vm_engine.h"
+
+    #define ENGINE_FUNCTION execute_profiled
+    #define TRACE 0
+    #define COUNTING 1
+    #define PROFILING 1
+    #include "vm_engine.h"
+
+    #include "vm_register.h"
+    #include "vm_jit.h"
+    #include "vm_profile.h"
+
+    /*
+        Run the loaded program from its first instruction until it halts
+
+        With trace set every instruction is printed with the registers and
+            stack; otherwise only the program output is produced, buffered
+            and written when the program halts or reads input
+
+        Returns 0, or the exit status the VM ends with and the message in
+            vm_error() when the program fails. Whatever it printed up to
+            there has been written.
+    */
+    int vm_run(Vm *vm, int trace)
+    {
+        vm->error[0] = '\0';
+
+        // The profile counts the instructions as loaded, on the stack engine
+        int profiling = !trace && (vm->profileFileName || vm->foldedFileName);
+
+        // Errors and stack overflows come back here
+        if(sigsetjmp(vm->escape, 1))
+        {
+            flush_output(vm);
+            vm->outputBuffered = 0;
+            runningVm = NULL;
+            return 1;
+        }
+
+        runningVm = vm;
+
+        check_code(vm);
+        decode_program(vm, !trace && !profiling && vm->engine == ENGINE_STACK);
+
+        // Code the translator or the JIT cannot handle runs on the stack engine
+        vm->registerRan = !trace && !profiling && vm->engine == ENGINE_REGISTER && translate_program(vm);
+        vm->jitRan = !trace && !profiling && vm->engine == ENGINE_JIT && compile_jit(vm);
+
+        if(trace)
+        {
+            execute_traced(vm);
+        }
+        else
+        {
+            vm->outputBuffered = 1;
+
+            if(profiling)
+            {
+                start_profile(vm);
+                execute_profiled(vm);
+            }
+            else if(vm->registerRan)
+            {
+                execute_registers(vm);
+            }
+            else if(vm->jitRan)
+            {
+                execute_jit(vm);
+            }
+            else
+            {
+                execute_fast(vm);
+            }
+
+            flush_output(vm);
+            vm->outputBuffered = 0;
+
+            if(profiling)
+            {
+                write_profile(vm);
+            }
+        }
+
+        runningVm = NULL;
+        return 0;
+    }
+
+    /*
+        Run the loaded program on the stack engine without superinstructions
+            and return how many instructions it ran, or -1 and the message
+            in vm_error() when the program fails. Its output is produced as
+            in the fast mode. The other engines do not count, so timing them
+            costs nothing.
+    */
+    long vm_count_instructions(Vm *vm)
+    {
+        vm->error[0] = '\0';
+
+        if(sigsetjmp(vm->escape, 1))
+        {
+            flush_output(vm);
+            vm->outputBuffered = 0;
+            runningVm = NULL;
+            return -1;
+        }
+
+        runningVm = vm;
+
+        check_code(vm);
+        decode_program(vm, 0);
+
+        vm->executedCount = 0;
+        vm->outputBuffered = 1;
+        execute_counted(vm);
+        flush_output(vm);
+        vm->outputBuffered = 0;
+
+        runningVm = NULL;
+        return vm->executedCount;
+    }
+
+// Inspection
+    /*
+        Returns 1 if the loaded program has a SYS READ, so running it may
+            wait for input
+    */
+    int vm_reads_input(Vm *vm)
+    {
+        for(int i = 0; i + 2 < vm->codeLength; i += 3)
+        {
+            if(vm->codeWords[i] == SYS && vm->codeWords[i + 2] == READ)
+            {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    /*
+        FNV-1a hash of the stack part of the PAS, to compare the state two
+            runs leave behind
+    */
+    uint64_t vm_hash(Vm *vm)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+
+        for(int i = 0; i < vm->pasSize - vm->codeLength; i++)
+        {
+            hash = (hash ^ (uint32_t)vm->pas[i]) * 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+// Arithmetic
+    /*
+        OP DIV- The quotient of left by right. Only the divisors 0 and -1
+            need a look, so the check is one comparison.
+    */
+    static inline int divide_values(Vm *vm, int left, int right)
+    {
+        if((unsigned)right + 1 <= 1)
+        {
+            check_division(vm, left, right);
+        }
+
+        return left / right;
+    }
+
+    /*
+        Division by 0 and the one quotient an int cannot hold (INT_MIN / -1)
+            end the run
+    */
+    void check_division(Vm *vm, int left, int right)
+    {
+        if(right == 0)
+        {
+            vm_fail(vm, "Error: Division by zero");
+        }
+
+        if(right == -1 && left == INT_MIN)
+        {
+            vm_fail(vm, "Error: Division overflow");
+        }
+    }
+
+// Program input and output
+    /*
+        SYS READ- Prompt for an integer and read it from the machine's input.
+            Input that is not an integer, or no input left, ends the run.
+    */
+    int read_input(Vm *vm)
+    {
+        int input = 0;
+
+        flush_output(vm);
+        fprintf(vm->output, "Please Enter an Integer: ");
+        fflush(vm->output);
+
+        if(fscanf(vm->input, "%d", &input) != 1)
+        {
+            vm_fail(vm, "Error: Failed to read an integer");
+        }
+
+        return input;
+    }
+
+    /*
+        Write the value printed by SYS OUT, either straight away or into the
+            output buffer in the fast mode
+    */
+    void write_output(Vm *vm, int value)
+    {
+        if(!vm->outputBuffered)
+        {
+            fprintf(vm->output, "Output result is: %d\n", value);
+            return;
+        }
+
+        if(vm->outputLength > OUTPUT_BUFFER_SIZE - 64)
+        {
+            flush_output(vm);
+        }
+
+        vm->outputLength += sprintf(vm->outputBuffer + vm->outputLength, "Output result is: %d\n", value);
+    }
+
+    /*
+        Write out everything in the output buffer
+    */
+    void flush_output(Vm *vm)
+    {
+        if(vm->outputLength > 0)
+        {
+            fwrite(vm->outputBuffer, 1, vm->outputLength, vm->output);
+            vm->outputLength = 0;
+        }
+
+        fflush(vm->output);
+    }
+
+    /*
+        Follow L static links from the frame at BP. A link outside the stack
+            can only come from code that overwrote it, and ends the run.
+    */
+    int base(Vm *vm, int BP, int L) 
+    {
+        int *pas = vm->pas;
         int arb = BP;
         while (L > 0) 
         {
             arb = pas[arb];
+            if((unsigned)arb > (unsigned)(vm->pasSize - 1 - vm->codeLength))
+            {
+                vm_fail(vm, "Error: Static link outside the PAS");
+            }
             L--;
         }
         return arb;   
     }
 
-    void print(int pc, int bp, int sp, int op, int l, int m)
+    void print(Vm *vm, int pc, int bp, int sp, int op, int l, int m)
     {
+        FILE *output = vm->output;
+        int *bps = vm->bps;
+
         // Print the name of the operation
         switch(op)
         {
-            case 1: printf("LIT\t"); break;
+            case 1: fprintf(output, "LIT\t"); break;
             case 2: 
                 switch(m)
                 {
-                    case 0: printf("RTN\t"); break;
-                    case 1: printf("ADD\t"); break;
-                    case 2: printf("SUB\t"); break;
-                    case 3: printf("MUL\t"); break;
-                    case 4: printf("DIV\t"); break;
-                    case 5: printf("EQL\t"); break;
-                    case 6: printf("NEQ\t"); break;
-                    case 7: printf("LSS\t"); break;
-                    case 8: printf("LEQ\t"); break;
-                    case 9: printf("GTR\t"); break;
-                    case 10: printf("GEQ\t"); break;
-                    case 11: printf("EVEN\n"); break;
+                    case 0: fprintf(output, "RTN\t"); break;
+                    case 1: fprintf(output, "ADD\t"); break;
+                    case 2: fprintf(output, "SUB\t"); break;
+                    case 3: fprintf(output, "MUL\t"); break;
+                    case 4: fprintf(output, "DIV\t"); break;
+                    case 5: fprintf(output, "EQL\t"); break;
+                    case 6: fprintf(output, "NEQ\t"); break;
+                    case 7: fprintf(output, "LSS\t"); break;
+                    case 8: fprintf(output, "LEQ\t"); break;
+                    case 9: fprintf(output, "GTR\t"); break;
+                    case 10: fprintf(output, "GEQ\t"); break;
+                    case 11: fprintf(output, "EVEN\n"); break;
                 }
             break;
-            case 3: printf("LOD\t"); break;
-            case 4: printf("STO\t"); break;
-            case 5: printf("CAL\t"); break;
-            case 6: printf("INC\t"); break;
-            case 7: printf("JMP\t"); break;
-            case 8: printf("JPC\t"); break;
-            case 9: printf("SYS\t"); break;
+            case 3: fprintf(output, "LOD\t"); break;
+            case 4: fprintf(output, "STO\t"); break;
+            case 5: fprintf(output, "CAL\t"); break;
+            case 6: fprintf(output, "INC\t"); break;
+            case 7: fprintf(output, "JMP\t"); break;
+            case 8: fprintf(output, "JPC\t"); break;
+            case 9: fprintf(output, "SYS\t"); break;
             default: 
-                fprintf(stderr, "Invalid input");
-                exit(1);
+                vm_fail(vm, "Invalid input");
             break;
         }
 
         // Print the operation values
-        printf("%d\t%d\t", l, m);
+        fprintf(output, "%d\t%d\t", l, m);
 
         // Print the registers
-        printf("%d\t%d\t%d\t", pc, bp, sp);
+        fprintf(output, "%d\t%d\t%d\t", pc, bp, sp);
 
         // Print the stacks of the main to second to latest activision records
         for(int i = bps[0]; i >= sp; i--)
@@ -578,15 +1875,15 @@
             {
                 if(i == bps[j])
                 {
-                    printf("  |");
+                    fprintf(output, "  |");
                 }
             }
 
-            printf("%5d", pas[i]);
+            fprintf(output, "%5d", vm->pas[i]);
         }
 
         // New line
-        printf("\n");
+        fprintf(output, "\n");
     }
 
 /*
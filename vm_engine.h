@@ -0,0 +1,334 @@
+/*
+    vm_engine.h - Body of the VM execution loop
+
+    Notes:
+        - Not a normal header: vm.c includes it once per execution mode after
+            defining ENGINE_FUNCTION (the name of the function to generate)
+            and TRACE (1 to print the trace after every instruction, 0 for
+            the fast mode). COUNTING 1 also counts every instruction run in
+            the machine's executedCount, and PROFILING 1 keeps the counts of
+            vm_profile.h; both are 0 when not defined.
+        - The generated function runs the program loaded in the machine it
+            is given. An invalid instruction ends the run through vm_fail().
+        - With TRACE 0 the trace code is not compiled into the loop at all,
+            so the fast mode pays nothing for it.
+        - The engines run the predecoded program (see decode_program()).
+*/
+
+// Tracing
+    /*
+        The trace shows the instruction as it was loaded, and pc as the code
+            address of the next instruction. A halt shows pc equal to bp, as
+            the original loop did.
+    */
+    #if TRACE
+        #define TRACE_STEP(pc) \
+            print(vm, pc, bp, sp, vm->codeWords[at * 3], vm->codeWords[at * 3 + 1], vm->codeWords[at * 3 + 2]);
+    #else
+        #define TRACE_STEP(pc)
+    #endif
+
+// Counting
+    #ifndef COUNTING
+        #define COUNTING 0
+    #endif
+
+    #if COUNTING
+        #define COUNT_STEP vm->executedCount++;
+    #else
+        #define COUNT_STEP
+    #endif
+
+    #ifndef PROFILING
+        #define PROFILING 0
+    #endif
+
+    #if PROFILING
+        #define PROFILE_STEP(index) vm->profileHits[index]++;
+        #define PROFILE_CALL profile_call(vm, ip);
+        #define PROFILE_RETURN profile_return(vm);
+    #else
+        #define PROFILE_STEP(index)
+        #define PROFILE_CALL
+        #define PROFILE_RETURN
+    #endif
+
+// Execution
+    void ENGINE_FUNCTION(Vm *vm)
+    {
+        VM_LOCALS
+        int ip = 0, sp, bp = pasSize - 1 - vm->codeLength;
+        int l = 0, m = 0;
+        int at = 0; // Index of the instruction being run, for the trace
+        (void)l;
+        (void)m;
+        (void)at;
+
+        // Initialize bp and sp
+            sp = bp + 1;
+            bps[0] = bp;
+            bps[1] = 1;
+
+        // The main program is the only record on the display
+            int level = 0;
+            display[0] = bp;
+            vm->displayTop = 0;
+
+        // Parse the pas
+        #if TRACE
+            fprintf(vm->output, "\tL\tM\tPC\tBP\tSP\tstack\n");
+            fprintf(vm->output, "Initial values: \t%d\t%d\t%d\n", ADDRESS(0), bp, sp);
+        #endif
+
+        if(programCount == 0)
+        {
+            return;
+        }
+
+        #if DISPATCH == DISPATCH_SWITCH
+            for(;;)
+            {
+                // Fetch
+                Decoded *instruction = &program[ip];
+                COUNT_STEP
+                PROFILE_STEP(ip)
+                at = ip;
+                ip++;
+                l = instruction->l;
+                m = instruction->m;
+
+                // Execute
+                switch(instruction->op)
+                {
+                    case FLAT_LIT: DO_LIT break;
+                    case FLAT_RTN: DO_RTN PROFILE_RETURN break;
+                    case FLAT_ADD: DO_ARITHMETIC(ADD_VALUES) break;
+                    case FLAT_SUB: DO_ARITHMETIC(SUB_VALUES) break;
+                    case FLAT_MUL: DO_ARITHMETIC(MUL_VALUES) break;
+                    case FLAT_DIV: DO_ARITHMETIC(DIV_VALUES) break;
+                    case FLAT_EQL: DO_COMPARE(==) break;
+                    case FLAT_NEQ: DO_COMPARE(!=) break;
+                    case FLAT_LSS: DO_COMPARE(<) break;
+                    case FLAT_LEQ: DO_COMPARE(<=) break;
+                    case FLAT_GTR: DO_COMPARE(>) break;
+                    case FLAT_GEQ: DO_COMPARE(>=) break;
+                    case FLAT_EVEN: DO_EVEN break;
+                    case FLAT_LOD: DO_LOD break;
+                    case FLAT_STO: DO_STO break;
+                    case FLAT_CAL: DO_CAL PROFILE_CALL break;
+                    case FLAT_INC: DO_INC break;
+                    case FLAT_JMP: DO_JMP break;
+                    case FLAT_JPC: DO_JPC break;
+                    case FLAT_OUT: DO_OUT break;
+                    case FLAT_READ: DO_READ break;
+                    case FLAT_SYS_NONE: break;
+
+                    case FLAT_LIT_STO: DO_LIT_STO break;
+                    case FLAT_LOD_OUT: DO_LOD_OUT break;
+                    case FLAT_LOD_LIT_EQL_JPC: DO_LOD_LIT_JPC(==) break;
+                    case FLAT_LOD_LIT_NEQ_JPC: DO_LOD_LIT_JPC(!=) break;
+                    case FLAT_LOD_LIT_LSS_JPC: DO_LOD_LIT_JPC(<) break;
+                    case FLAT_LOD_LIT_LEQ_JPC: DO_LOD_LIT_JPC(<=) break;
+                    case FLAT_LOD_LIT_GTR_JPC: DO_LOD_LIT_JPC(>) break;
+                    case FLAT_LOD_LIT_GEQ_JPC: DO_LOD_LIT_JPC(>=) break;
+                    case FLAT_LOD_LIT_ADD_STO: DO_LOD_LIT_STO(ADD_VALUES) break;
+                    case FLAT_LOD_LIT_SUB_STO: DO_LOD_LIT_STO(SUB_VALUES) break;
+                    case FLAT_LOD_LIT_MUL_STO: DO_LOD_LIT_STO(MUL_VALUES) break;
+                    case FLAT_LOD_LIT_DIV_STO: DO_LOD_LIT_STO(DIV_VALUES) break;
+                    case FLAT_LOD_LOD_ADD_STO: DO_LOD_LOD_STO(ADD_VALUES) break;
+                    case FLAT_LOD_LOD_SUB_STO: DO_LOD_LOD_STO(SUB_VALUES) break;
+                    case FLAT_LOD_LOD_MUL_STO: DO_LOD_LOD_STO(MUL_VALUES) break;
+                    case FLAT_LOD_LOD_DIV_STO: DO_LOD_LOD_STO(DIV_VALUES) break;
+
+                    case FLAT_OPR_INVALID:
+                        fprintf(stderr, "Invalid input");
+                    break;
+
+                    case FLAT_HLT:
+                        TRACE_STEP(bp)
+                        return;
+
+                    case FLAT_END:
+                        return;
+
+                    default:
+                        vm_fail(vm, "Invalid input");
+                    break;
+                }
+
+                // Print the operation
+                TRACE_STEP(ADDRESS(ip))
+            }
+
+        #elif DISPATCH == DISPATCH_DIRECT
+            // Store the label of every instruction in the program
+            static void *labels[FLAT_COUNT] = {
+                [FLAT_INVALID] = &&do_invalid,
+                [FLAT_LIT] = &&do_lit,
+                [FLAT_LOD] = &&do_lod,
+                [FLAT_STO] = &&do_sto,
+                [FLAT_CAL] = &&do_cal,
+                [FLAT_INC] = &&do_inc,
+                [FLAT_JMP] = &&do_jmp,
+                [FLAT_JPC] = &&do_jpc,
+                [FLAT_RTN] = &&do_rtn,
+                [FLAT_ADD] = &&do_add,
+                [FLAT_SUB] = &&do_sub,
+                [FLAT_MUL] = &&do_mul,
+                [FLAT_DIV] = &&do_div,
+                [FLAT_EQL] = &&do_eql,
+                [FLAT_NEQ] = &&do_neq,
+                [FLAT_LSS] = &&do_lss,
+                [FLAT_LEQ] = &&do_leq,
+                [FLAT_GTR] = &&do_gtr,
+                [FLAT_GEQ] = &&do_geq,
+                [FLAT_EVEN] = &&do_even,
+                [FLAT_OPR_INVALID] = &&do_opr_invalid,
+                [FLAT_OUT] = &&do_out,
+                [FLAT_READ] = &&do_read,
+                [FLAT_HLT] = &&do_hlt,
+                [FLAT_SYS_NONE] = &&do_next,
+                [FLAT_END] = &&do_end,
+                [FLAT_LIT_STO] = &&do_lit_sto,
+                [FLAT_LOD_OUT] = &&do_lod_out,
+                [FLAT_LOD_LIT_EQL_JPC] = &&do_lod_lit_eql_jpc,
+                [FLAT_LOD_LIT_NEQ_JPC] = &&do_lod_lit_neq_jpc,
+                [FLAT_LOD_LIT_LSS_JPC] = &&do_lod_lit_lss_jpc,
+                [FLAT_LOD_LIT_LEQ_JPC] = &&do_lod_lit_leq_jpc,
+                [FLAT_LOD_LIT_GTR_JPC] = &&do_lod_lit_gtr_jpc,
+                [FLAT_LOD_LIT_GEQ_JPC] = &&do_lod_lit_geq_jpc,
+                [FLAT_LOD_LIT_ADD_STO] = &&do_lod_lit_add_sto,
+                [FLAT_LOD_LIT_SUB_STO] = &&do_lod_lit_sub_sto,
+                [FLAT_LOD_LIT_MUL_STO] = &&do_lod_lit_mul_sto,
+                [FLAT_LOD_LIT_DIV_STO] = &&do_lod_lit_div_sto,
+                [FLAT_LOD_LOD_ADD_STO] = &&do_lod_lod_add_sto,
+                [FLAT_LOD_LOD_SUB_STO] = &&do_lod_lod_sub_sto,
+                [FLAT_LOD_LOD_MUL_STO] = &&do_lod_lod_mul_sto,
+                [FLAT_LOD_LOD_DIV_STO] = &&do_lod_lod_div_sto
+            };
+
+            for(int i = 0; i <= programCount; i++)
+            {
+                program[i].label = labels[program[i].op];
+            }
+
+            // Fetch the next instruction and jump straight to its label
+            #define DISPATCH_NEXT \
+                COUNT_STEP \
+                PROFILE_STEP(ip) \
+                at = ip; \
+                l = program[ip].l; \
+                m = program[ip].m; \
+                goto *program[ip++].label;
+
+            // Finish the current instruction and dispatch the next one
+            #define NEXT \
+                TRACE_STEP(ADDRESS(ip)) \
+                DISPATCH_NEXT
+
+            DISPATCH_NEXT
+
+            do_lit: DO_LIT NEXT
+            do_rtn: DO_RTN PROFILE_RETURN NEXT
+            do_add: DO_ARITHMETIC(ADD_VALUES) NEXT
+            do_sub: DO_ARITHMETIC(SUB_VALUES) NEXT
+            do_mul: DO_ARITHMETIC(MUL_VALUES) NEXT
+            do_div: DO_ARITHMETIC(DIV_VALUES) NEXT
+            do_eql: DO_COMPARE(==) NEXT
+            do_neq: DO_COMPARE(!=) NEXT
+            do_lss: DO_COMPARE(<) NEXT
+            do_leq: DO_COMPARE(<=) NEXT
+            do_gtr: DO_COMPARE(>) NEXT
+            do_geq: DO_COMPARE(>=) NEXT
+            do_even: DO_EVEN NEXT
+            do_lod: DO_LOD NEXT
+            do_sto: DO_STO NEXT
+            do_cal: DO_CAL PROFILE_CALL NEXT
+            do_inc: DO_INC NEXT
+            do_jmp: DO_JMP NEXT
+            do_jpc: DO_JPC NEXT
+            do_out: DO_OUT NEXT
+            do_read: DO_READ NEXT
+            do_opr_invalid:
+                fprintf(stderr, "Invalid input");
+            do_next: NEXT
+
+            do_lit_sto: DO_LIT_STO NEXT
+            do_lod_out: DO_LOD_OUT NEXT
+            do_lod_lit_eql_jpc: DO_LOD_LIT_JPC(==) NEXT
+            do_lod_lit_neq_jpc: DO_LOD_LIT_JPC(!=) NEXT
+            do_lod_lit_lss_jpc: DO_LOD_LIT_JPC(<) NEXT
+            do_lod_lit_leq_jpc: DO_LOD_LIT_JPC(<=) NEXT
+            do_lod_lit_gtr_jpc: DO_LOD_LIT_JPC(>) NEXT
+            do_lod_lit_geq_jpc: DO_LOD_LIT_JPC(>=) NEXT
+            do_lod_lit_add_sto: DO_LOD_LIT_STO(ADD_VALUES) NEXT
+            do_lod_lit_sub_sto: DO_LOD_LIT_STO(SUB_VALUES) NEXT
+            do_lod_lit_mul_sto: DO_LOD_LIT_STO(MUL_VALUES) NEXT
+            do_lod_lit_div_sto: DO_LOD_LIT_STO(DIV_VALUES) NEXT
+            do_lod_lod_add_sto: DO_LOD_LOD_STO(ADD_VALUES) NEXT
+            do_lod_lod_sub_sto: DO_LOD_LOD_STO(SUB_VALUES) NEXT
+            do_lod_lod_mul_sto: DO_LOD_LOD_STO(MUL_VALUES) NEXT
+            do_lod_lod_div_sto: DO_LOD_LOD_STO(DIV_VALUES) NEXT
+
+            do_hlt:
+                TRACE_STEP(bp)
+            do_end:
+                return;
+
+            do_invalid:
+                vm_fail(vm, "Invalid input");
+
+            #undef NEXT
+            #undef DISPATCH_NEXT
+
+        #else
+            Registers r = {ip, bp, sp, level, 0, 0, 1, vm};
+
+            while(r.running)
+            {
+                // Fetch
+                Decoded *instruction = &program[r.ip];
+                COUNT_STEP
+                PROFILE_STEP(r.ip)
+                at = r.ip;
+                r.ip++;
+                r.l = instruction->l;
+                r.m = instruction->m;
+
+                // Execute
+                handlers[instruction->op](&r);
+
+                #if PROFILING
+                    if(instruction->op == FLAT_CAL)
+                    {
+                        profile_call(vm, r.ip);
+                    }
+                    else if(instruction->op == FLAT_RTN)
+                    {
+                        profile_return(vm);
+                    }
+                #endif
+
+                // Print the operation, a halt shows pc equal to bp
+                #if TRACE
+                    bp = r.bp;
+                    sp = r.sp;
+
+                    if(instruction->op != FLAT_END)
+                    {
+                        TRACE_STEP(r.running ? ADDRESS(r.ip) : bp)
+                    }
+                #endif
+            }
+        #endif
+    }
+
+    #undef TRACE_STEP
+    #undef COUNT_STEP
+    #undef COUNTING
+    #undef PROFILE_STEP
+    #undef PROFILE_CALL
+    #undef PROFILE_RETURN
+    #undef PROFILING
+    #undef TRACE
+    #undef ENGINE_FUNCTION
@@ -0,0 +1,645 @@
+/*
+    vm_jit.h - Native x86-64 code for the program and the runtime it calls
+
+    Notes:
+        - Not a normal header: vm.c includes it once, after the instruction
+            bodies and the other engines.
+        - compile_jit() turns the predecoded program (without
+            superinstructions) into x86-64 machine code, one template per
+            stack instruction, in a buffer that is mapped executable once
+            the code is written. The VM registers live in machine registers
+            for the whole run:
+                r12 pas         r14 sp          rbx level
+                r13 JitState    r15 bp          rbp display
+        - Arithmetic, comparisons, loads, stores, INC and jumps are inline,
+            except divisions by 0 and -1, which fail or may fail the run.
+            CAL, RTN and SYS call back into C, through the same DO_ macros
+            the interpreters expand, so the links, the display and the
+            program output are exactly theirs.
+        - Every instruction leaves memory as the stack engines do (popped
+            slots are zeroed), and stack overflows still fault in the guard
+            region below the PAS.
+        - RTN may return to any instruction, so the JIT keeps a table with
+            the native address of every instruction and jumps through it.
+        - On any other machine, or if executable memory cannot be mapped,
+            vm_run() runs the interpreter instead.
+        - The code and the generator's buffers belong to the machine (see
+            struct Vm in vm.c); the runtime finds it through JitState.
+*/
+
+// JIT state
+    /*
+        What the native code reads at entry and what the runtime calls see.
+            sp, bp and level are written back before every call into the
+            runtime and reloaded after it.
+    */
+    typedef struct {
+        int *pas;
+        long sp;
+        long bp;
+        long level;
+        int *display;
+        void **table; // Native address of every instruction, END included
+        Vm *vm;
+    } JitState;
+
+    /*
+        A rel32 jump to patch once every instruction has its offset
+    */
+    typedef struct JitFixup {
+        int at;
+        int target;
+    } JitFixup;
+
+#if defined(__x86_64__)
+// Runtime
+    /*
+        CAL: link a new activation record and make it current. Native code
+            jumps to the callee itself.
+    */
+    static void jit_call(JitState *state, int l, int returnIndex)
+    {
+        Vm *vm = state->vm;
+        VM_LOCALS
+        int ip = returnIndex, m = 0;
+        int bp = state->bp, sp = state->sp, level = state->level;
+
+        DO_CAL
+
+        (void)ip;
+        state->bp = bp;
+        state->level = level;
+    }
+
+    /*
+        RTN: drop the current activation record. Returns the instruction to
+            continue at.
+    */
+    static int jit_return(JitState *state)
+    {
+        Vm *vm = state->vm;
+        VM_LOCALS
+        int ip = 0;
+        int bp = state->bp, sp = state->sp, level = state->level;
+
+        DO_RTN
+
+        state->sp = sp;
+        state->bp = bp;
+        state->level = level;
+        return ip;
+    }
+
+    /*
+        FRAME(l) for an l past the main program: follow the static links
+    */
+    static int jit_base(JitState *state, int bp, int l)
+    {
+        return base(state->vm, bp, l);
+    }
+
+    /*
+        SYS 1: the value is popped by the native code
+    */
+    static void jit_write(JitState *state, int value)
+    {
+        write_output(state->vm, value);
+    }
+
+    /*
+        SYS 2: the value is pushed by the native code
+    */
+    static int jit_read(JitState *state)
+    {
+        return read_input(state->vm);
+    }
+
+    /*
+        DIV by 0 or -1: the native code divides every other divisor itself
+    */
+    static int jit_divide(JitState *state, int left, int right)
+    {
+        return divide_values(state->vm, left, right);
+    }
+
+    static void jit_opr_invalid()
+    {
+        fprintf(stderr, "Invalid input");
+    }
+
+    static void jit_invalid(JitState *state)
+    {
+        vm_fail(state->vm, "Invalid input");
+    }
+
+// Code generation
+    #define JIT_RAX 0
+    #define JIT_RCX 1
+    #define JIT_RDX 2
+    #define JIT_RSI 6
+    #define JIT_RDI 7
+    #define JIT_R14 14
+    #define JIT_R15 15
+
+    #define JIT_STATE(field) ((int)offsetof(JitState, field))
+
+    static void jit_byte(Vm *vm, int byte)
+    {
+        if(vm->jitLength == vm->jitCapacity)
+        {
+            vm->jitCapacity = vm->jitCapacity ? vm->jitCapacity * 2 : 4096;
+            vm->jitBytes = realloc(vm->jitBytes, vm->jitCapacity);
+        }
+
+        vm->jitBytes[vm->jitLength++] = (unsigned char)byte;
+    }
+
+    static void jit_bytes(Vm *vm, const char *bytes, int count)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            jit_byte(vm, bytes[i]);
+        }
+    }
+
+    static void jit_int(Vm *vm, int value)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            jit_byte(vm, (unsigned)value >> (8 * i));
+        }
+    }
+
+    static void jit_pointer(Vm *vm, void *pointer)
+    {
+        uint64_t value = (uint64_t)(uintptr_t)pointer;
+
+        for(int i = 0; i < 8; i++)
+        {
+            jit_byte(vm, value >> (8 * i));
+        }
+    }
+
+    /*
+        An instruction on the PAS word [r12 + index * 4 + displacement]. reg
+            is the register operand, or the opcode extension. Sizes are 32
+            bits unless wide is set.
+    */
+    static void jit_pas(Vm *vm, int wide, const char *opcode, int opcodeLength, int reg, int index, int displacement)
+    {
+        int small = displacement >= -128 && displacement <= 127;
+
+        jit_byte(vm, 0x41 | (wide ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0) | (index >= 8 ? 0x02 : 0));
+        jit_bytes(vm, opcode, opcodeLength);
+        jit_byte(vm, (small ? 0x40 : 0x80) | (reg & 7) << 3 | 0x04);
+        jit_byte(vm, 0x80 | (index & 7) << 3 | 0x04);
+
+        if(small)
+        {
+            jit_byte(vm, displacement);
+        }
+        else
+        {
+            jit_int(vm, displacement);
+        }
+    }
+
+    // The top of the stack and the word under it
+    #define JIT_TOP JIT_R14, 0
+    #define JIT_SECOND JIT_R14, 4
+
+    static void jit_load(Vm *vm, int reg, int index, int displacement) // mov reg32, [pas]
+    {
+        jit_pas(vm, 0, "\x8b", 1, reg, index, displacement);
+    }
+
+    static void jit_store(Vm *vm, int reg, int index, int displacement) // mov [pas], reg32
+    {
+        jit_pas(vm, 0, "\x89", 1, reg, index, displacement);
+    }
+
+    static void jit_store_constant(Vm *vm, int value, int index, int displacement) // mov dword [pas], imm32
+    {
+        jit_pas(vm, 0, "\xc7", 1, 0, index, displacement);
+        jit_int(vm, value);
+    }
+
+    // Pop the top of the stack: zero its slot and move sp up
+    static void jit_pop(Vm *vm)
+    {
+        jit_store_constant(vm, 0, JIT_TOP);
+        jit_bytes(vm, "\x49\xff\xc6", 3); // inc r14
+    }
+
+    static void jit_push_slot(Vm *vm)
+    {
+        jit_bytes(vm, "\x49\xff\xce", 3); // dec r14
+    }
+
+    // Keep sp, bp and level in JitState across a call into the runtime
+    static void jit_save_registers(Vm *vm)
+    {
+        jit_bytes(vm, "\x4d\x89\x75", 3); // mov [r13 + sp], r14
+        jit_byte(vm, JIT_STATE(sp));
+        jit_bytes(vm, "\x4d\x89\x7d", 3); // mov [r13 + bp], r15
+        jit_byte(vm, JIT_STATE(bp));
+        jit_bytes(vm, "\x49\x89\x5d", 3); // mov [r13 + level], rbx
+        jit_byte(vm, JIT_STATE(level));
+    }
+
+    static void jit_load_registers(Vm *vm)
+    {
+        jit_bytes(vm, "\x4d\x8b\x75", 3); // mov r14, [r13 + sp]
+        jit_byte(vm, JIT_STATE(sp));
+        jit_bytes(vm, "\x4d\x8b\x7d", 3); // mov r15, [r13 + bp]
+        jit_byte(vm, JIT_STATE(bp));
+        jit_bytes(vm, "\x49\x8b\x5d", 3); // mov rbx, [r13 + level]
+        jit_byte(vm, JIT_STATE(level));
+    }
+
+    static void jit_call_function(Vm *vm, void *function)
+    {
+        jit_bytes(vm, "\x48\xb8", 2); // mov rax, function
+        jit_pointer(vm, function);
+        jit_bytes(vm, "\xff\xd0", 2); // call rax
+    }
+
+    static void jit_move_constant(Vm *vm, int reg, int value) // mov reg32, imm32
+    {
+        jit_byte(vm, 0xb8 + reg);
+        jit_int(vm, value);
+    }
+
+    /*
+        Jump to the code of an instruction, patched by compile_jit()
+    */
+    static void jit_jump(Vm *vm, const char *opcode, int opcodeLength, int target)
+    {
+        jit_bytes(vm, opcode, opcodeLength);
+
+        if(vm->jitFixupCount == vm->jitFixupCapacity)
+        {
+            vm->jitFixupCapacity = vm->jitFixupCapacity ? vm->jitFixupCapacity * 2 : 256;
+            vm->jitFixups = realloc(vm->jitFixups, sizeof(JitFixup) * vm->jitFixupCapacity);
+        }
+
+        vm->jitFixups[vm->jitFixupCount++] = (JitFixup){vm->jitLength, target};
+        jit_int(vm, 0);
+    }
+
+    /*
+        Index of the word FRAME(l) - m, in rax. Returns the index register
+            and the displacement that address it: the frame of the current
+            record is bp itself.
+    */
+    static void jit_frame_word(Vm *vm, int l, int m, int *index, int *displacement)
+    {
+        if(l == 0 && m > -(1 << 28) && m < (1 << 28))
+        {
+            *index = JIT_R15;
+            *displacement = -4 * m;
+            return;
+        }
+
+        if(l == 0)
+        {
+            jit_bytes(vm, "\x4c\x89\xf8", 3); // mov rax, r15
+        }
+        else
+        {
+            // FRAME(l): display[level - l] when l <= level, otherwise base()
+            jit_bytes(vm, "\x48\x89\xd8", 3); // mov rax, rbx
+            jit_bytes(vm, "\x48\x2d", 2); // sub rax, l
+            jit_int(vm, l);
+            jit_bytes(vm, "\x7c\x07", 2); // jl slow
+            jit_bytes(vm, "\x48\x63\x44\x85\x00", 5); // movsxd rax, [rbp + rax * 4]
+            jit_bytes(vm, "\xeb\x1a", 2); // jmp done
+            // slow:
+            jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+            jit_bytes(vm, "\x44\x89\xfe", 3); // mov esi, r15d
+            jit_move_constant(vm, JIT_RDX, l);
+            jit_call_function(vm, (void *)jit_base);
+            jit_bytes(vm, "\x48\x63\xc0", 3); // movsxd rax, eax
+            // done:
+        }
+
+        jit_bytes(vm, "\x48\x2d", 2); // sub rax, m
+        jit_int(vm, m);
+
+        *index = JIT_RAX;
+        *displacement = 0;
+    }
+
+    /*
+        pas[sp + 1] operation= pas[sp], then pop
+    */
+    static void jit_arithmetic(Vm *vm, int op)
+    {
+        jit_load(vm, JIT_RAX, JIT_SECOND);
+
+        switch(op)
+        {
+            case FLAT_ADD: jit_pas(vm, 0, "\x03", 1, JIT_RAX, JIT_TOP); break; // add eax, [sp]
+            case FLAT_SUB: jit_pas(vm, 0, "\x2b", 1, JIT_RAX, JIT_TOP); break; // sub eax, [sp]
+            case FLAT_MUL: jit_pas(vm, 0, "\x0f\xaf", 2, JIT_RAX, JIT_TOP); break; // imul eax, [sp]
+            case FLAT_DIV:
+                // Divisors 0 and -1 go to jit_divide(), which fails the run
+                // for 0 and for INT_MIN / -1
+                jit_load(vm, JIT_RCX, JIT_TOP);
+                jit_bytes(vm, "\x8d\x51\x01", 3); // lea edx, [rcx + 1]
+                jit_bytes(vm, "\x83\xfa\x01", 3); // cmp edx, 1
+                jit_bytes(vm, "\x77\x15", 2); // ja divide
+                jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+                jit_bytes(vm, "\x89\xc6", 2); // mov esi, eax
+                jit_bytes(vm, "\x89\xca", 2); // mov edx, ecx
+                jit_call_function(vm, (void *)jit_divide);
+                jit_bytes(vm, "\xeb\x03", 2); // jmp done
+                // divide:
+                jit_byte(vm, 0x99); // cdq
+                jit_bytes(vm, "\xf7\xf9", 2); // idiv ecx
+                // done:
+            break;
+        }
+
+        jit_store(vm, JIT_RAX, JIT_SECOND);
+        jit_pop(vm);
+    }
+
+    /*
+        pas[sp + 1] = pas[sp + 1] compared with pas[sp], then pop
+    */
+    static void jit_compare(Vm *vm, int op)
+    {
+        static const char conditions[] = {
+            0x94, // sete
+            0x95, // setne
+            0x9c, // setl
+            0x9e, // setle
+            0x9f, // setg
+            0x9d // setge
+        };
+
+        jit_load(vm, JIT_RAX, JIT_SECOND);
+        jit_pas(vm, 0, "\x3b", 1, JIT_RAX, JIT_TOP); // cmp eax, [sp]
+        jit_byte(vm, 0x0f);
+        jit_byte(vm, conditions[op - FLAT_EQL]);
+        jit_byte(vm, 0xc0); // al
+        jit_bytes(vm, "\x0f\xb6\xc0", 3); // movzx eax, al
+        jit_store(vm, JIT_RAX, JIT_SECOND);
+        jit_pop(vm);
+    }
+
+    /*
+        Generate the code of one instruction
+    */
+    static void jit_instruction(Vm *vm, int i)
+    {
+        Decoded *instruction = &vm->program[i];
+        int l = instruction->l, m = instruction->m;
+        int index, displacement;
+
+        switch(instruction->op)
+        {
+            case FLAT_LIT:
+                jit_push_slot(vm);
+                jit_store_constant(vm, m, JIT_TOP);
+            break;
+
+            case FLAT_LOD:
+                jit_frame_word(vm, l, m, &index, &displacement);
+                jit_load(vm, JIT_RCX, index, displacement);
+                jit_push_slot(vm);
+                jit_store(vm, JIT_RCX, JIT_TOP);
+            break;
+
+            case FLAT_STO:
+                jit_frame_word(vm, l, m, &index, &displacement);
+                jit_load(vm, JIT_RCX, JIT_TOP);
+                jit_store(vm, JIT_RCX, index, displacement);
+                jit_pop(vm);
+            break;
+
+            case FLAT_ADD: case FLAT_SUB: case FLAT_MUL: case FLAT_DIV:
+                jit_arithmetic(vm, instruction->op);
+            break;
+
+            case FLAT_EQL: case FLAT_NEQ: case FLAT_LSS:
+            case FLAT_LEQ: case FLAT_GTR: case FLAT_GEQ:
+                jit_compare(vm, instruction->op);
+            break;
+
+            case FLAT_EVEN:
+                jit_pas(vm, 0, "\xf6", 1, 0, JIT_TOP); // test byte [sp], 1
+                jit_byte(vm, 1);
+                jit_bytes(vm, "\x0f\x94\xc0", 3); // sete al
+                jit_bytes(vm, "\x0f\xb6\xc0", 3); // movzx eax, al
+                jit_store(vm, JIT_RAX, JIT_TOP);
+            break;
+
+            case FLAT_INC:
+                jit_bytes(vm, "\x49\x81\xee", 3); // sub r14, m
+                jit_int(vm, m);
+            break;
+
+            case FLAT_JMP:
+                jit_jump(vm, "\xe9", 1, m);
+            break;
+
+            case FLAT_JPC:
+                jit_load(vm, JIT_RAX, JIT_TOP);
+                jit_pop(vm);
+                jit_bytes(vm, "\x85\xc0", 2); // test eax, eax
+                jit_jump(vm, "\x0f\x84", 2, m); // jz
+            break;
+
+            case FLAT_CAL:
+                jit_save_registers(vm);
+                jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+                jit_move_constant(vm, JIT_RSI, l);
+                jit_move_constant(vm, JIT_RDX, i + 1);
+                jit_call_function(vm, (void *)jit_call);
+                jit_load_registers(vm);
+                jit_jump(vm, "\xe9", 1, m);
+            break;
+
+            case FLAT_RTN:
+                jit_save_registers(vm);
+                jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+                jit_call_function(vm, (void *)jit_return);
+                jit_load_registers(vm);
+                jit_bytes(vm, "\x89\xc0", 2); // mov eax, eax
+                jit_bytes(vm, "\x49\x8b\x4d", 3); // mov rcx, [r13 + table]
+                jit_byte(vm, JIT_STATE(table));
+                jit_bytes(vm, "\xff\x24\xc1", 3); // jmp [rcx + rax * 8]
+            break;
+
+            case FLAT_OUT:
+                jit_load(vm, JIT_RSI, JIT_TOP);
+                jit_pop(vm);
+                jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+                jit_call_function(vm, (void *)jit_write);
+            break;
+
+            case FLAT_READ:
+                jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+                jit_call_function(vm, (void *)jit_read);
+                jit_push_slot(vm);
+                jit_store(vm, JIT_RAX, JIT_TOP);
+            break;
+
+            case FLAT_OPR_INVALID:
+                jit_call_function(vm, (void *)jit_opr_invalid);
+            break;
+
+            case FLAT_SYS_NONE:
+            break;
+
+            case FLAT_HLT:
+            case FLAT_END:
+                jit_jump(vm, "\xe9", 1, -1);
+            break;
+
+            default:
+                jit_bytes(vm, "\x4c\x89\xef", 3); // mov rdi, r13
+                jit_call_function(vm, (void *)jit_invalid);
+            break;
+        }
+    }
+
+    /*
+        Compile the predecoded program into jitCode
+
+        Returns 1 on success, otherwise sets jitFailure and returns 0
+    */
+    int compile_jit(Vm *vm)
+    {
+        vm->jitLength = 0;
+        vm->jitFixupCount = 0;
+        vm->jitFailure = NULL;
+
+        free(vm->jitOffsets);
+        vm->jitOffsets = malloc(sizeof(int) * (vm->programCount + 1));
+
+        // Entry: save the callee-saved registers and load the VM registers
+        // from the JitState in rdi. The stack stays 16-byte aligned for calls.
+        jit_bytes(vm, "\x55\x53\x41\x54\x41\x55\x41\x56\x41\x57", 10); // push rbp, rbx, r12 to r15
+        jit_bytes(vm, "\x48\x83\xec\x08", 4); // sub rsp, 8
+        jit_bytes(vm, "\x49\x89\xfd", 3); // mov r13, rdi
+        jit_bytes(vm, "\x4d\x8b\x65", 3); // mov r12, [r13 + pas]
+        jit_byte(vm, JIT_STATE(pas));
+        jit_bytes(vm, "\x49\x8b\x6d", 3); // mov rbp, [r13 + display]
+        jit_byte(vm, JIT_STATE(display));
+        jit_load_registers(vm);
+
+        for(int i = 0; i <= vm->programCount; i++)
+        {
+            vm->jitOffsets[i] = vm->jitLength;
+            jit_instruction(vm, i);
+        }
+
+        // Exit: HLT and END jump here
+        int exitOffset = vm->jitLength;
+        jit_save_registers(vm);
+        jit_bytes(vm, "\x48\x83\xc4\x08", 4); // add rsp, 8
+        jit_bytes(vm, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\x5d", 10); // pop r15 to r12, rbx, rbp
+        jit_byte(vm, 0xc3); // ret
+
+        for(int i = 0; i < vm->jitFixupCount; i++)
+        {
+            int target = vm->jitFixups[i].target == -1 ? exitOffset : vm->jitOffsets[vm->jitFixups[i].target];
+            int relative = target - (vm->jitFixups[i].at + 4);
+            memcpy(vm->jitBytes + vm->jitFixups[i].at, &relative, 4);
+        }
+
+        // Map the code writable, then executable only
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        if(vm->jitCode)
+        {
+            munmap(vm->jitCode, vm->jitCodeSize);
+        }
+
+        vm->jitCodeSize = (vm->jitLength + page - 1) / page * page;
+        vm->jitCode = mmap(NULL, vm->jitCodeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(vm->jitCode == MAP_FAILED)
+        {
+            vm->jitCode = NULL;
+            vm->jitFailure = "cannot map memory for the code";
+            return 0;
+        }
+
+        memcpy(vm->jitCode, vm->jitBytes, vm->jitLength);
+
+        if(mprotect(vm->jitCode, vm->jitCodeSize, PROT_READ | PROT_EXEC))
+        {
+            vm->jitFailure = "cannot make the code executable";
+            return 0;
+        }
+
+        free(vm->jitTable);
+        vm->jitTable = malloc(sizeof(void *) * (vm->programCount + 1));
+
+        for(int i = 0; i <= vm->programCount; i++)
+        {
+            vm->jitTable[i] = (char *)vm->jitCode + vm->jitOffsets[i];
+        }
+
+        return 1;
+    }
+
+    #undef JIT_TOP
+    #undef JIT_SECOND
+#else
+    int compile_jit(Vm *vm)
+    {
+        vm->jitFailure = "not an x86-64 machine";
+        return 0;
+    }
+#endif
+
+// Execution
+    /*
+        Run the compiled program from its first instruction until it halts
+    */
+    void execute_jit(Vm *vm)
+    {
+        int bp = vm->pasSize - 1 - vm->codeLength;
+
+        vm->display[0] = bp;
+        vm->displayTop = 0;
+
+        JitState state = {vm->pas, bp + 1, bp, 0, vm->display, vm->jitTable, vm};
+
+        ((void (*)(JitState *))vm->jitCode)(&state);
+    }
+
+    /*
+        Print how much code the last run compiled to, or why it ran on the
+            interpreter
+    */
+    void report_jit(Vm *vm)
+    {
+        if(vm->jitRan)
+        {
+            fprintf(stderr, "JIT: %d instructions compiled into %d bytes of x86-64 code\n",
+                vm->programCount, vm->jitLength);
+        }
+        else
+        {
+            fprintf(stderr, "JIT: not used (%s)\n", vm->jitFailure ? vm->jitFailure : "trace");
+        }
+    }
+
+    void free_jit(Vm *vm)
+    {
+        if(vm->jitCode)
+        {
+            munmap(vm->jitCode, vm->jitCodeSize);
+        }
+
+        free(vm->jitBytes);
+        free(vm->jitOffsets);
+        free(vm->jitFixups);
+        free(vm->jitTable);
+    }
@@ -0,0 +1,387 @@
+/*
+    vm_profile.h - Execution profile of a program run on the stack engine
+
+    Notes:
+        - Not a normal header: vm.c includes it once, after the engines.
+        - The profiled engine (vm_engine.h with PROFILING 1) runs the
+            unfused program and adds one to the hit count of the instruction
+            it fetches. The opcode counts, the OPR and SYS subop counts and
+            the loops are all worked out from those hit counts after the run.
+        - Only CAL and RTN do more: they keep a shadow call stack, so every
+            instruction run is charged to the procedure and the call path
+            it ran in. The inclusive count of a recursive procedure only
+            counts its outermost activations.
+        - Call paths deeper than PROFILE_DEPTH are charged to the path at
+            that depth in the folded stacks; the procedure counts stay exact.
+        - A loop is the code from the target of a backward JMP to the JMP.
+            Loops are listed by the instructions they ran (not counting the
+            procedures they call), with their share of the whole run.
+        - The profile is a tab separated text file, one record per line:
+            total       instructions
+            opcode      name count
+            opr         name count
+            sys         name count
+            address     index pc op l m count
+            procedure   name entry calls inclusive exclusive
+            loop        header jump iterations instructions percent
+          The folded stacks (main;outer;inner count, one line per call path
+            with the instructions run in its last procedure) are what
+            flamegraph.pl and speedscope read.
+        - The counts, the call paths and the file names belong to the
+            machine (see struct Vm in vm.c).
+*/
+
+// Profile state
+    #define PROFILE_DEPTH 64
+
+    /*
+        A call path: the procedure at entry called through the path of
+            parent. Node 0 is the main program.
+    */
+    typedef struct ProfileNode {
+        int entry; // Instruction the procedure starts at, 0 for main
+        int parent;
+        int child; // First procedure called from this path
+        int sibling; // Next procedure called from the parent's path
+        long self; // Instructions run in the procedure on this path
+    } ProfileNode;
+
+    typedef struct ProfileFrame {
+        int node;
+        int entry;
+        long start; // executedCount when the call was made
+        long callees; // Instructions run in the procedures it called
+    } ProfileFrame;
+
+// Collection
+    /*
+        Profile the fast mode, writing the profile and the folded stacks to
+            the files named (either may be NULL)
+    */
+    void vm_select_profile(Vm *vm, char *profileFile, char *foldedFile)
+    {
+        vm->profileFileName = profileFile;
+        vm->foldedFileName = foldedFile;
+    }
+
+    static int add_profile_node(Vm *vm, int entry, int parent)
+    {
+        if(vm->profileNodeCount == vm->profileNodeCapacity)
+        {
+            vm->profileNodeCapacity = vm->profileNodeCapacity * 2 + 64;
+            vm->profileNodes = realloc(vm->profileNodes, sizeof(ProfileNode) * vm->profileNodeCapacity);
+        }
+
+        ProfileNode *node = &vm->profileNodes[vm->profileNodeCount];
+        node->entry = entry;
+        node->parent = parent;
+        node->child = -1;
+        node->sibling = -1;
+        node->self = 0;
+
+        if(parent >= 0)
+        {
+            node->sibling = vm->profileNodes[parent].child;
+            vm->profileNodes[parent].child = vm->profileNodeCount;
+        }
+
+        return vm->profileNodeCount++;
+    }
+
+    /*
+        Clear the counts before a run: the main program is the only frame
+    */
+    void start_profile(Vm *vm)
+    {
+        int count = vm->programCount + 1;
+
+        free(vm->profileHits);
+        free(vm->profileCalls);
+        free(vm->profileInclusive);
+        free(vm->profileExclusive);
+        free(vm->profileActive);
+
+        vm->profileHits = calloc(count, sizeof(long));
+        vm->profileCalls = calloc(count, sizeof(long));
+        vm->profileInclusive = calloc(count, sizeof(long));
+        vm->profileExclusive = calloc(count, sizeof(long));
+        vm->profileActive = calloc(count, sizeof(int));
+
+        vm->profileNodeCount = 0;
+        add_profile_node(vm, 0, -1);
+
+        if(vm->profileFrameCapacity == 0)
+        {
+            vm->profileFrameCapacity = 256;
+            vm->profileFrames = malloc(sizeof(ProfileFrame) * vm->profileFrameCapacity);
+        }
+
+        vm->profileFrames[0] = (ProfileFrame){0, 0, 0, 0};
+        vm->profileFrameCount = 1;
+
+        vm->profileCalls[0] = 1;
+        vm->profileActive[0] = 1;
+        vm->executedCount = 0;
+    }
+
+    /*
+        A CAL just jumped to entry
+    */
+    void profile_call(Vm *vm, int entry)
+    {
+        if(vm->profileFrameCount == vm->profileFrameCapacity)
+        {
+            vm->profileFrameCapacity *= 2;
+            vm->profileFrames = realloc(vm->profileFrames, sizeof(ProfileFrame) * vm->profileFrameCapacity);
+        }
+
+        // Find the caller's path to entry, past the depth limit stay put
+        int node = vm->profileFrames[vm->profileFrameCount - 1].node;
+
+        if(vm->profileFrameCount < PROFILE_DEPTH)
+        {
+            int child = vm->profileNodes[node].child;
+
+            while(child >= 0 && vm->profileNodes[child].entry != entry)
+            {
+                child = vm->profileNodes[child].sibling;
+            }
+
+            node = child >= 0 ? child : add_profile_node(vm, entry, node);
+        }
+
+        vm->profileFrames[vm->profileFrameCount++] = (ProfileFrame){node, entry, vm->executedCount, 0};
+        vm->profileCalls[entry]++;
+        vm->profileActive[entry]++;
+    }
+
+    /*
+        A RTN left the newest frame. Returning from the main program (which
+            ends it) leaves its frame for finish_profile().
+    */
+    void profile_return(Vm *vm)
+    {
+        if(vm->profileFrameCount <= 1)
+        {
+            return;
+        }
+
+        ProfileFrame *frame = &vm->profileFrames[--vm->profileFrameCount];
+        long elapsed = vm->executedCount - frame->start;
+        long self = elapsed - frame->callees;
+
+        vm->profileNodes[frame->node].self += self;
+        vm->profileExclusive[frame->entry] += self;
+        vm->profileFrames[vm->profileFrameCount - 1].callees += elapsed;
+
+        if(--vm->profileActive[frame->entry] == 0)
+        {
+            vm->profileInclusive[frame->entry] += elapsed;
+        }
+    }
+
+    /*
+        Close every frame still open when the program halted
+    */
+    static void finish_profile(Vm *vm)
+    {
+        while(vm->profileFrameCount > 1)
+        {
+            profile_return(vm);
+        }
+
+        ProfileFrame *frame = &vm->profileFrames[0];
+        long self = vm->executedCount - frame->callees;
+
+        vm->profileNodes[0].self += self;
+        vm->profileExclusive[0] += self;
+        vm->profileInclusive[0] = vm->executedCount;
+        vm->profileFrameCount = 0;
+    }
+
+// Output
+    /*
+        Name of the procedure starting at entry: its symbol when the program
+            was loaded with symbols, otherwise p and the entry instruction
+    */
+    static char *procedure_name(Vm *vm, int entry, char *name)
+    {
+        if(entry == 0)
+        {
+            return "main";
+        }
+
+        for(int i = 0; i < vm->symbolCount; i++)
+        {
+            if(vm->symbols[i].kind == 3 && vm->symbols[i].addr / 3 == entry)
+            {
+                return vm->symbols[i].name;
+            }
+        }
+
+        sprintf(name, "p%d", entry);
+        return name;
+    }
+
+    static void write_folded(Vm *vm, FILE *file, int node, char *path, int length)
+    {
+        char name[16];
+        char *procedure = procedure_name(vm, vm->profileNodes[node].entry, name);
+        int added = snprintf(path + length, MAX_WORD + 2, "%s%s", length ? ";" : "", procedure);
+
+        if(vm->profileNodes[node].self > 0)
+        {
+            fprintf(file, "%s %ld\n", path, vm->profileNodes[node].self);
+        }
+
+        for(int child = vm->profileNodes[node].child; child >= 0; child = vm->profileNodes[child].sibling)
+        {
+            write_folded(vm, file, child, path, length + added);
+        }
+
+        path[length] = '\0';
+    }
+
+    static int compare_loops(const void *a, const void *b)
+    {
+        long x = ((const long *)a)[2], y = ((const long *)b)[2];
+        return (x < y) - (x > y);
+    }
+
+    /*
+        Write the profile and the folded stacks of the run that just ended
+    */
+    void write_profile(Vm *vm)
+    {
+        static const char *opcodeNames[] = {"", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS"};
+        static const char *oprNames[] = {"RTN", "ADD", "SUB", "MUL", "DIV", "EQL", "NEQ", "LSS", "LEQ", "GTR", "GEQ", "EVEN"};
+        static const char *sysNames[] = {"", "OUT", "READ", "HLT"};
+
+        int pasSize = vm->pasSize; // For ADDRESS()
+
+        finish_profile(vm);
+
+        if(vm->profileFileName)
+        {
+            FILE *file = fopen(vm->profileFileName, "w");
+
+            if(!file)
+            {
+                vm_fail(vm, "Error: Could not write the profile to %s\n", vm->profileFileName);
+            }
+
+            long opcodes[10] = {0}, oprs[12] = {0}, syses[4] = {0};
+
+            for(int i = 0; i < vm->programCount; i++)
+            {
+                int op = vm->codeWords[i * 3], m = vm->codeWords[i * 3 + 2];
+
+                if(op >= LIT && op <= SYS)
+                {
+                    opcodes[op] += vm->profileHits[i];
+                }
+                if(op == OPR && m >= RTN && m <= EVEN)
+                {
+                    oprs[m] += vm->profileHits[i];
+                }
+                if(op == SYS && m >= OUT && m <= HLT)
+                {
+                    syses[m] += vm->profileHits[i];
+                }
+            }
+
+            fprintf(file, "total\t%ld\n", vm->executedCount);
+
+            for(int op = LIT; op <= SYS; op++)
+            {
+                fprintf(file, "opcode\t%s\t%ld\n", opcodeNames[op], opcodes[op]);
+            }
+            for(int m = RTN; m <= EVEN; m++)
+            {
+                fprintf(file, "opr\t%s\t%ld\n", oprNames[m], oprs[m]);
+            }
+            for(int m = OUT; m <= HLT; m++)
+            {
+                fprintf(file, "sys\t%s\t%ld\n", sysNames[m], syses[m]);
+            }
+
+            for(int i = 0; i < vm->programCount; i++)
+            {
+                fprintf(file, "address\t%d\t%d\t%d\t%d\t%d\t%ld\n", i, ADDRESS(i),
+                    vm->codeWords[i * 3], vm->codeWords[i * 3 + 1], vm->codeWords[i * 3 + 2], vm->profileHits[i]);
+            }
+
+            for(int entry = 0; entry < vm->programCount; entry++)
+            {
+                if(vm->profileCalls[entry] > 0)
+                {
+                    char name[16];
+                    fprintf(file, "procedure\t%s\t%d\t%ld\t%ld\t%ld\n", procedure_name(vm, entry, name), entry,
+                        vm->profileCalls[entry], vm->profileInclusive[entry], vm->profileExclusive[entry]);
+                }
+            }
+
+            // Loops: header, jump, iterations, instructions
+            long (*loops)[4] = malloc(sizeof(long[4]) * (vm->programCount + 1));
+            int loopCount = 0;
+
+            for(int i = 0; i < vm->programCount; i++)
+            {
+                if(vm->program[i].op == FLAT_JMP && vm->program[i].m <= i)
+                {
+                    long instructions = 0;
+
+                    for(int k = vm->program[i].m; k <= i; k++)
+                    {
+                        instructions += vm->profileHits[k];
+                    }
+
+                    loops[loopCount][0] = vm->program[i].m;
+                    loops[loopCount][1] = i;
+                    loops[loopCount][2] = instructions;
+                    loops[loopCount][3] = vm->profileHits[i];
+                    loopCount++;
+                }
+            }
+
+            qsort(loops, loopCount, sizeof(long[4]), compare_loops);
+
+            for(int i = 0; i < loopCount; i++)
+            {
+                fprintf(file, "loop\t%ld\t%ld\t%ld\t%ld\t%.2f\n", loops[i][0], loops[i][1], loops[i][3], loops[i][2],
+                    vm->executedCount ? loops[i][2] * 100.0 / vm->executedCount : 0.0);
+            }
+
+            free(loops);
+            fclose(file);
+        }
+
+        if(vm->foldedFileName)
+        {
+            FILE *file = fopen(vm->foldedFileName, "w");
+
+            if(!file)
+            {
+                vm_fail(vm, "Error: Could not write the folded stacks to %s\n", vm->foldedFileName);
+            }
+
+            char *path = malloc((MAX_WORD + 2) * PROFILE_DEPTH + 1);
+            path[0] = '\0';
+
+            write_folded(vm, file, 0, path, 0);
+
+            free(path);
+            fclose(file);
+        }
+    }
+
+    void free_profile(Vm *vm)
+    {
+        free(vm->profileHits);
+        free(vm->profileCalls);
+        free(vm->profileInclusive);
+        free(vm->profileExclusive);
+        free(vm->profileActive);
+        free(vm->profileNodes);
+        free(vm->profileFrames);
+    }
@@ -0,0 +1,885 @@
+/*
+    vm_register.h - Register form of the program and the engine that runs it
+
+    Notes:
+        - Not a normal header: vm.c includes it once, after the instruction
+            bodies and the stack engines.
+        - translate_program() turns the predecoded stack code into three
+            address instructions over virtual registers. Register r of the
+            current activation record is the frame slot pas[bp - r]: the
+            locals keep their own slots and the expression stack position p
+            (counted from bp + 1 down) is register p - 1. Operands in outer
+            records are (l, m) pairs like LOD and STO, and constants are
+            operands too, so x := y * 2 + z is two instructions instead of
+            seven.
+        - The register engine leaves memory exactly as the stack engines do:
+            every stack slot an expression pushes and pops is zeroed by the
+            register instruction that consumes it, calls and returns write
+            the same links, and a pending value is stored to its stack slot
+            before any jump, call or return. Uninitialized variables and
+            stack overflows therefore behave the same in both engines.
+        - Only code whose stack depth is known at every instruction can be
+            translated, which is all code the PL/0 compiler generates. For
+            anything else (or invalid opcodes) vm_run() runs the stack
+            engine instead.
+        - The register program and the translator state belong to the
+            machine (see struct Vm in vm.c).
+        - Runs in the fast mode only; the trace shows stack instructions.
+*/
+
+// Register form
+    /*
+        Register opcodes. The J forms jump to target when the comparison
+            fails, which is how JPC uses a condition.
+    */
+    typedef enum {
+        REG_MOV,
+        REG_ADD,
+        REG_SUB,
+        REG_MUL,
+        REG_DIV,
+        REG_EQL,
+        REG_NEQ,
+        REG_LSS,
+        REG_LEQ,
+        REG_GTR,
+        REG_GEQ,
+        REG_EVEN,
+        REG_JEQL,
+        REG_JNEQ,
+        REG_JLSS,
+        REG_JLEQ,
+        REG_JGTR,
+        REG_JGEQ,
+        REG_JEVEN,
+        REG_JZ,
+        REG_JMP,
+        REG_OUT,
+        REG_READ,
+        REG_CAL,
+        REG_RTN,
+        REG_CLEAR,
+        REG_HLT,
+        REG_END,
+
+        REG_COUNT
+    } RegisterOpcode;
+
+    #define OPERAND_CONSTANT -1 // l of an operand whose m is the value itself
+
+    /*
+        A frame slot FRAME(l) - m, or the constant m
+    */
+    typedef struct {
+        int l;
+        int m;
+    } Operand;
+
+    /*
+        A register instruction. Every instruction zeroes the slots of the
+            stack positions it pops, registers clearFrom to clearTo - 1 of
+            the current record, after writing its result and before it jumps,
+            calls, returns or prints.
+    */
+    typedef struct RegisterInstruction {
+    #if DISPATCH == DISPATCH_DIRECT
+        void *label; // Filled in by the register engine
+    #endif
+        int op; // RegisterOpcode
+        Operand d; // Destination
+        Operand a;
+        Operand b;
+        int target; // Jump or call target, a register instruction index
+        int depth; // CAL: stack depth of the caller, so sp = bp + 1 - depth
+        int returnIndex; // CAL: stack instruction to return to
+        int clearFrom;
+        int clearTo;
+    } RegisterInstruction;
+
+    /*
+        An entry of the translator's stack that has not been written to its
+            slot yet: a value (constant or slot) or an operation whose
+            result is still to be computed
+    */
+    typedef struct LazyEntry {
+        int op; // -1 for a value, otherwise the RegisterOpcode computing it
+        Operand a;
+        Operand b;
+    } LazyEntry;
+
+// Translation
+    /*
+        Highest popped stack position a lazy entry still reads, or the top
+            when there is none
+    */
+    static int highest_read(Vm *vm)
+    {
+        int highest = vm->topDepth;
+
+        for(int p = vm->floorDepth + 1; p <= vm->topDepth; p++)
+        {
+            LazyEntry *entry = &vm->lazy[p - vm->floorDepth - 1];
+
+            if(entry->a.l == 0 && entry->a.m + 1 > highest)
+            {
+                highest = entry->a.m + 1;
+            }
+            if(entry->op != -1 && entry->b.l == 0 && entry->b.m + 1 > highest)
+            {
+                highest = entry->b.m + 1;
+            }
+        }
+
+        return highest;
+    }
+
+    /*
+        Append a register instruction. It clears the stack positions popped
+            since the last instruction that are above the current top and
+            that no lazy entry still reads.
+    */
+    static RegisterInstruction *emit_register(Vm *vm, int op, Operand d, Operand a, Operand b)
+    {
+        if(vm->registerCount == vm->registerCapacity)
+        {
+            vm->registerCapacity = vm->registerCapacity ? vm->registerCapacity * 2 : 256;
+            vm->registerProgram = realloc(vm->registerProgram, sizeof(RegisterInstruction) * vm->registerCapacity);
+        }
+
+        RegisterInstruction *instruction = &vm->registerProgram[vm->registerCount++];
+        memset(instruction, 0, sizeof(RegisterInstruction));
+
+        instruction->op = op;
+        instruction->d = d;
+        instruction->a = a;
+        instruction->b = b;
+        instruction->target = -1;
+
+        int keep = highest_read(vm);
+
+        if(vm->clearTop > keep)
+        {
+            instruction->clearFrom = keep;
+            instruction->clearTo = vm->clearTop;
+            vm->clearTop = keep;
+        }
+
+        return instruction;
+    }
+
+    static Operand operand(int l, int m)
+    {
+        return (Operand){l, m};
+    }
+
+    static int reads_slot(LazyEntry *entry, Operand slot)
+    {
+        return (entry->a.l == slot.l && entry->a.m == slot.m) ||
+            (entry->op != -1 && entry->b.l == slot.l && entry->b.m == slot.m);
+    }
+
+    /*
+        Write the lazy entry at stack position p to its slot, so it is read
+            from memory from now on. Entries below it that still read the
+            slot are written first.
+    */
+    static void materialize(Vm *vm, int p)
+    {
+        LazyEntry *entry = &vm->lazy[p - vm->floorDepth - 1];
+        Operand slot = operand(0, p - 1);
+
+        if(entry->op == -1 && entry->a.l == slot.l && entry->a.m == slot.m)
+        {
+            return;
+        }
+
+        for(int q = vm->floorDepth + 1; q < p; q++)
+        {
+            if(reads_slot(&vm->lazy[q - vm->floorDepth - 1], slot))
+            {
+                materialize(vm, q);
+            }
+        }
+
+        emit_register(vm, entry->op == -1 ? REG_MOV : entry->op, slot, entry->a, entry->b);
+
+        entry->op = -1;
+        entry->a = slot;
+    }
+
+    /*
+        Write every lazy entry and zero every popped slot, so memory is
+            exactly what the stack engines would have at this point
+    */
+    static void flush_lazy(Vm *vm)
+    {
+        for(int p = vm->floorDepth + 1; p <= vm->topDepth; p++)
+        {
+            materialize(vm, p);
+        }
+
+        if(vm->clearTop > vm->topDepth)
+        {
+            emit_register(vm, REG_CLEAR, operand(0, 0), operand(0, 0), operand(0, 0));
+        }
+
+        vm->floorDepth = vm->topDepth;
+    }
+
+    static void push_lazy(Vm *vm, int op, Operand a, Operand b)
+    {
+        int count = vm->topDepth - vm->floorDepth;
+
+        if(count == vm->lazyCapacity)
+        {
+            vm->lazyCapacity = vm->lazyCapacity ? vm->lazyCapacity * 2 : 16;
+            vm->lazy = realloc(vm->lazy, sizeof(LazyEntry) * vm->lazyCapacity);
+        }
+
+        vm->lazy[count] = (LazyEntry){op, a, b};
+        vm->topDepth++;
+    }
+
+    /*
+        Pop the top of the stack. A position below the lazy ones is read
+            from its slot.
+    */
+    static LazyEntry pop_lazy(Vm *vm)
+    {
+        if(vm->topDepth == vm->floorDepth)
+        {
+            vm->floorDepth--;
+            vm->topDepth--;
+            vm->clearTop = vm->clearTop > vm->topDepth + 1 ? vm->clearTop : vm->topDepth + 1;
+            return (LazyEntry){-1, operand(0, vm->topDepth), operand(0, 0)};
+        }
+
+        LazyEntry entry = vm->lazy[vm->topDepth - vm->floorDepth - 1];
+        vm->topDepth--;
+        vm->clearTop = vm->clearTop > vm->topDepth + 1 ? vm->clearTop : vm->topDepth + 1;
+        return entry;
+    }
+
+    /*
+        Make sure the n entries at the top of the stack are values
+    */
+    static void materialize_top(Vm *vm, int n)
+    {
+        for(int p = vm->topDepth - n + 1; p <= vm->topDepth; p++)
+        {
+            if(p > vm->floorDepth && vm->lazy[p - vm->floorDepth - 1].op != -1)
+            {
+                materialize(vm, p);
+            }
+        }
+    }
+
+    /*
+        Everything below the top entry goes to memory before an instruction
+            with side effects consumes the top
+    */
+    static void flush_below_top(Vm *vm)
+    {
+        for(int p = vm->floorDepth + 1; p < vm->topDepth; p++)
+        {
+            materialize(vm, p);
+        }
+    }
+
+    /*
+        Find the stack depth at every reachable instruction. Every path into
+            an instruction has to agree on the depth; code where they do not
+            (never generated by the compiler) is left to the stack engine.
+
+        Returns 1 on success, otherwise sets registerFailure and returns 0
+    */
+    static int analyze_depths(Vm *vm, int *depth)
+    {
+        int *work = malloc(sizeof(int) * (vm->programCount + 1) * 2);
+        int workCount = 0;
+
+        memset(depth, -1, sizeof(int) * (vm->programCount + 1));
+
+        // The program and every procedure start on an empty stack
+        #define REACH(index, value) \
+            if(depth[index] == -1) \
+            { \
+                depth[index] = (value); \
+                work[workCount++] = (index); \
+            } \
+            else if(depth[index] != (value)) \
+            { \
+                vm->registerFailure = "stack depth differs between paths"; \
+                free(work); \
+                return 0; \
+            }
+
+        REACH(0, 0)
+        for(int i = 0; i < vm->programCount; i++)
+        {
+            if(vm->program[i].op == FLAT_CAL)
+            {
+                REACH(vm->program[i].m, 0)
+            }
+        }
+
+        while(workCount > 0)
+        {
+            int i = work[--workCount];
+            int d = depth[i];
+            Decoded *instruction = &vm->program[i];
+            int pops = 0, pushes = 0, next = 1;
+
+            switch(instruction->op)
+            {
+                case FLAT_LIT: case FLAT_LOD: case FLAT_READ: pushes = 1; break;
+                case FLAT_STO: case FLAT_OUT: pops = 1; break;
+                case FLAT_EVEN: pops = 1; pushes = 1; break;
+                case FLAT_INC:
+                    if(instruction->m < 0)
+                    {
+                        vm->registerFailure = "negative INC";
+                        free(work);
+                        return 0;
+                    }
+                    pushes = instruction->m;
+                break;
+                case FLAT_JPC: pops = 1; break;
+                case FLAT_JMP: next = 0; break;
+                case FLAT_CAL: case FLAT_SYS_NONE: break;
+                case FLAT_RTN: case FLAT_HLT: case FLAT_END: next = 0; break;
+
+                default:
+                    if(instruction->op >= FLAT_ADD && instruction->op <= FLAT_GEQ)
+                    {
+                        pops = 2;
+                        pushes = 1;
+                        break;
+                    }
+
+                    vm->registerFailure = "invalid instruction";
+                    free(work);
+                    return 0;
+            }
+
+            if(d < pops)
+            {
+                vm->registerFailure = "pop from an empty stack";
+                free(work);
+                return 0;
+            }
+
+            d += pushes - pops;
+
+            if(next)
+            {
+                REACH(i + 1, d)
+            }
+            if(instruction->op == FLAT_JMP || instruction->op == FLAT_JPC)
+            {
+                REACH(instruction->m, d)
+            }
+        }
+
+        #undef REACH
+
+        free(work);
+        return 1;
+    }
+
+    /*
+        Translate the predecoded program into registerProgram
+
+        Returns 1 on success, otherwise sets registerFailure and returns 0
+    */
+    int translate_program(Vm *vm)
+    {
+        int *depth = malloc(sizeof(int) * (vm->programCount + 1));
+        char *blockStart = calloc(vm->programCount + 1, 1);
+
+        vm->registerCount = 0;
+        vm->registerFailure = NULL;
+
+        if(!analyze_depths(vm, depth))
+        {
+            free(depth);
+            free(blockStart);
+            return 0;
+        }
+
+        // Instructions control can reach other than by falling through
+        blockStart[0] = 1;
+        for(int i = 0; i < vm->programCount; i++)
+        {
+            int op = vm->program[i].op;
+
+            if(op == FLAT_JMP || op == FLAT_JPC || op == FLAT_CAL)
+            {
+                blockStart[vm->program[i].m] = 1;
+            }
+            if(op == FLAT_CAL)
+            {
+                blockStart[i + 1] = 1;
+            }
+        }
+
+        free(vm->registerIndex);
+        vm->registerIndex = malloc(sizeof(int) * (vm->programCount + 1));
+
+        int fallsThrough = 0;
+
+        for(int i = 0; i <= vm->programCount; i++)
+        {
+            vm->registerIndex[i] = -1;
+
+            if(depth[i] == -1)
+            {
+                fallsThrough = 0;
+                continue;
+            }
+
+            // Enter a block with everything in memory
+            if(blockStart[i])
+            {
+                if(fallsThrough)
+                {
+                    flush_lazy(vm);
+                }
+
+                vm->registerIndex[i] = vm->registerCount;
+                vm->floorDepth = vm->topDepth = vm->clearTop = depth[i];
+            }
+
+            Decoded *instruction = &vm->program[i];
+            int op = instruction->op, l = instruction->l, m = instruction->m;
+            fallsThrough = 1;
+
+            // A slot of this record that may still be lazy has to be in memory,
+            // and is loaded straight away since its position can be reused
+            int stackSlot = (op == FLAT_LOD || op == FLAT_STO) && l == 0 && (m < 0 || m + 1 > vm->floorDepth);
+
+            if(stackSlot)
+            {
+                flush_lazy(vm);
+            }
+
+            switch(op)
+            {
+                case FLAT_LIT:
+                    push_lazy(vm, -1, operand(OPERAND_CONSTANT, m), operand(0, 0));
+                break;
+
+                case FLAT_LOD:
+                    push_lazy(vm, -1, operand(l, m), operand(0, 0));
+
+                    if(stackSlot)
+                    {
+                        materialize(vm, vm->topDepth);
+                    }
+                break;
+
+                case FLAT_STO:
+                {
+                    flush_below_top(vm);
+                    LazyEntry value = pop_lazy(vm);
+                    emit_register(vm, value.op == -1 ? REG_MOV : value.op, operand(l, m), value.a, value.b);
+                }
+                break;
+
+                case FLAT_EVEN:
+                {
+                    materialize_top(vm, 1);
+                    LazyEntry value = pop_lazy(vm);
+                    push_lazy(vm, REG_EVEN, value.a, operand(0, 0));
+                }
+                break;
+
+                case FLAT_OUT:
+                {
+                    flush_below_top(vm);
+                    materialize_top(vm, 1);
+                    LazyEntry value = pop_lazy(vm);
+                    emit_register(vm, REG_OUT, operand(0, 0), value.a, operand(0, 0));
+                }
+                break;
+
+                case FLAT_READ:
+                    flush_lazy(vm);
+                    push_lazy(vm, -1, operand(0, vm->topDepth), operand(0, 0));
+                    emit_register(vm, REG_READ, operand(0, vm->topDepth - 1), operand(0, 0), operand(0, 0));
+                break;
+
+                case FLAT_INC:
+                    flush_lazy(vm);
+                    vm->topDepth += m;
+                    vm->floorDepth = vm->clearTop = vm->topDepth;
+                break;
+
+                case FLAT_JMP:
+                    flush_lazy(vm);
+                    emit_register(vm, REG_JMP, operand(0, 0), operand(0, 0), operand(0, 0))->target = m;
+                    fallsThrough = 0;
+                break;
+
+                case FLAT_JPC:
+                {
+                    flush_below_top(vm);
+
+                    // Only comparisons and EVEN fuse into the jump
+                    LazyEntry *top = vm->topDepth > vm->floorDepth ? &vm->lazy[vm->topDepth - vm->floorDepth - 1] : NULL;
+                    if(top && top->op != -1 && !(top->op >= REG_EQL && top->op <= REG_EVEN))
+                    {
+                        materialize(vm, vm->topDepth);
+                    }
+
+                    LazyEntry condition = pop_lazy(vm);
+                    int jump = REG_JZ;
+
+                    if(condition.op >= REG_EQL && condition.op <= REG_GEQ)
+                    {
+                        jump = REG_JEQL + condition.op - REG_EQL;
+                    }
+                    else if(condition.op == REG_EVEN)
+                    {
+                        jump = REG_JEVEN;
+                    }
+
+                    emit_register(vm, jump, operand(0, 0), condition.a, condition.b)->target = m;
+                    vm->floorDepth = vm->topDepth;
+                }
+                break;
+
+                case FLAT_CAL:
+                {
+                    flush_lazy(vm);
+                    RegisterInstruction *call = emit_register(vm, REG_CAL, operand(l, 0), operand(0, 0), operand(0, 0));
+                    call->target = m;
+                    call->depth = vm->topDepth;
+                    call->returnIndex = i + 1;
+                }
+                break;
+
+                case FLAT_RTN:
+                    flush_lazy(vm);
+                    emit_register(vm, REG_RTN, operand(0, 0), operand(0, 0), operand(0, 0));
+                    fallsThrough = 0;
+                break;
+
+                case FLAT_HLT:
+                    emit_register(vm, REG_HLT, operand(0, 0), operand(0, 0), operand(0, 0));
+                    fallsThrough = 0;
+                break;
+
+                case FLAT_END:
+                    vm->registerIndex[i] = vm->registerCount;
+                    emit_register(vm, REG_END, operand(0, 0), operand(0, 0), operand(0, 0));
+                    fallsThrough = 0;
+                break;
+
+                case FLAT_SYS_NONE:
+                break;
+
+                default:
+                {
+                    // ADD to GEQ: the result takes the place of the first operand
+                    materialize_top(vm, 2);
+                    LazyEntry right = pop_lazy(vm);
+                    LazyEntry left = pop_lazy(vm);
+                    push_lazy(vm, REG_ADD + op - FLAT_ADD, left.a, right.a);
+                }
+                break;
+            }
+        }
+
+        // A return past the code ends the program even when the end is
+        // not reachable otherwise
+        if(vm->registerIndex[vm->programCount] == -1)
+        {
+            vm->clearTop = vm->topDepth;
+            vm->registerIndex[vm->programCount] = vm->registerCount;
+            emit_register(vm, REG_END, operand(0, 0), operand(0, 0), operand(0, 0));
+        }
+
+        // Jump and call targets become register indexes
+        for(int i = 0; i < vm->registerCount; i++)
+        {
+            if(vm->registerProgram[i].target != -1)
+            {
+                vm->registerProgram[i].target = vm->registerIndex[vm->registerProgram[i].target];
+            }
+        }
+
+        free(depth);
+        free(blockStart);
+        return 1;
+    }
+
+// Register engine
+    /*
+        The value of an operand and the slot of a destination. Slots of the
+            current record (l == 0, nearly all of them) skip the display.
+    */
+    #define REG_VALUE(o) \
+        ((o).l == 0 ? pas[bp - (o).m] : (o).l == OPERAND_CONSTANT ? (o).m : pas[FRAME((o).l) - (o).m])
+    #define REG_SLOT(o) \
+        pas[(o).l == 0 ? bp - (o).m : FRAME((o).l) - (o).m]
+
+    #define REG_CLEAR_SLOTS \
+        for(int r = instruction->clearFrom; r < instruction->clearTo; r++) \
+        { \
+            pas[bp - r] = 0; \
+        }
+
+    #define REG_DO_OPERATION(operation) \
+        { \
+            int value = operation(REG_VALUE(instruction->a), REG_VALUE(instruction->b)); \
+            REG_SLOT(instruction->d) = value; \
+            REG_CLEAR_SLOTS \
+        }
+
+    #define REG_DO_COMPARE(operator) \
+        { \
+            int value = (REG_VALUE(instruction->a) operator REG_VALUE(instruction->b)) ? 1 : 0; \
+            REG_SLOT(instruction->d) = value; \
+            REG_CLEAR_SLOTS \
+        }
+
+    #define REG_DO_JUMP_UNLESS(condition) \
+        { \
+            int holds = (condition); \
+            REG_CLEAR_SLOTS \
+            if(!holds) \
+            { \
+                ip = instruction->target; \
+            } \
+        }
+
+    #define REG_DO_MOV \
+        { \
+            int value = REG_VALUE(instruction->a); \
+            REG_SLOT(instruction->d) = value; \
+            REG_CLEAR_SLOTS \
+        }
+
+    #define REG_DO_EVEN \
+        { \
+            int value = (REG_VALUE(instruction->a) % 2 == 0) ? 1 : 0; \
+            REG_SLOT(instruction->d) = value; \
+            REG_CLEAR_SLOTS \
+        }
+
+    #define REG_DO_OUT \
+        { \
+            int value = REG_VALUE(instruction->a); \
+            REG_CLEAR_SLOTS \
+            write_output(vm, value); \
+        }
+
+    #define REG_DO_READ \
+        { \
+            int input = read_input(vm); \
+            REG_SLOT(instruction->d) = input; \
+            REG_CLEAR_SLOTS \
+        }
+
+    /*
+        CAL and RTN as in DO_CAL and DO_RTN, with sp known from the depth
+            and the return address mapped back to a register index
+    */
+    #define REG_DO_CAL \
+        { \
+            REG_CLEAR_SLOTS \
+            int l = instruction->d.l; \
+            int sp = bp + 1 - instruction->depth; \
+            pas[sp - 1] = FRAME(l); \
+            pas[sp - 2] = bp; \
+            pas[sp - 3] = ADDRESS(instruction->returnIndex); \
+            bp = sp - 1; \
+            ip = instruction->target; \
+            displayLinks[vm->displayTop].level = level; \
+            level = (l <= level) ? level - l + 1 : 0; \
+            displayLinks[vm->displayTop].base = display[level]; \
+            vm->displayTop++; \
+            display[level] = bp; \
+        }
+
+    #define REG_DO_RTN \
+        { \
+            REG_CLEAR_SLOTS \
+            int sp = bp - 2; \
+            int stackIp = (pasSize - 1 - pas[sp]) / 3; \
+            if((unsigned)stackIp > (unsigned)programCount) \
+            { \
+                stackIp = programCount; \
+            } \
+            bp = pas[sp + 1]; \
+            if((unsigned)bp > (unsigned)(pasSize - 1 - vm->codeLength)) \
+            { \
+                vm_fail(vm, "Error: RTN to a frame outside the PAS"); \
+            } \
+            if(vm->displayTop > 0) \
+            { \
+                vm->displayTop--; \
+                display[level] = displayLinks[vm->displayTop].base; \
+                level = displayLinks[vm->displayTop].level; \
+            } \
+            ip = registerIndex[stackIp]; \
+            if(ip < 0) \
+            { \
+                vm_fail(vm, "Invalid input"); \
+            } \
+        }
+
+    /*
+        Run the register program from its first instruction until it halts
+    */
+    void execute_registers(Vm *vm)
+    {
+        VM_LOCALS
+        RegisterInstruction *registerProgram = vm->registerProgram;
+        int *registerIndex = vm->registerIndex;
+        int ip = 0, bp = pasSize - 1 - vm->codeLength;
+        int level = 0;
+        RegisterInstruction *instruction;
+
+        display[0] = bp;
+        vm->displayTop = 0;
+
+        #if DISPATCH == DISPATCH_DIRECT
+            static void *labels[REG_COUNT] = {
+                [REG_MOV] = &&reg_mov,
+                [REG_ADD] = &&reg_add,
+                [REG_SUB] = &&reg_sub,
+                [REG_MUL] = &&reg_mul,
+                [REG_DIV] = &&reg_div,
+                [REG_EQL] = &&reg_eql,
+                [REG_NEQ] = &&reg_neq,
+                [REG_LSS] = &&reg_lss,
+                [REG_LEQ] = &&reg_leq,
+                [REG_GTR] = &&reg_gtr,
+                [REG_GEQ] = &&reg_geq,
+                [REG_EVEN] = &&reg_even,
+                [REG_JEQL] = &&reg_jeql,
+                [REG_JNEQ] = &&reg_jneq,
+                [REG_JLSS] = &&reg_jlss,
+                [REG_JLEQ] = &&reg_jleq,
+                [REG_JGTR] = &&reg_jgtr,
+                [REG_JGEQ] = &&reg_jgeq,
+                [REG_JEVEN] = &&reg_jeven,
+                [REG_JZ] = &&reg_jz,
+                [REG_JMP] = &&reg_jmp,
+                [REG_OUT] = &&reg_out,
+                [REG_READ] = &&reg_read,
+                [REG_CAL] = &&reg_cal,
+                [REG_RTN] = &&reg_rtn,
+                [REG_CLEAR] = &&reg_clear,
+                [REG_HLT] = &&reg_end,
+                [REG_END] = &&reg_end
+            };
+
+            for(int i = 0; i < vm->registerCount; i++)
+            {
+                registerProgram[i].label = labels[registerProgram[i].op];
+            }
+
+            #define REG_NEXT \
+                instruction = &registerProgram[ip++]; \
+                goto *instruction->label;
+
+            REG_NEXT
+
+            reg_mov: REG_DO_MOV REG_NEXT
+            reg_add: REG_DO_OPERATION(ADD_VALUES) REG_NEXT
+            reg_sub: REG_DO_OPERATION(SUB_VALUES) REG_NEXT
+            reg_mul: REG_DO_OPERATION(MUL_VALUES) REG_NEXT
+            reg_div: REG_DO_OPERATION(DIV_VALUES) REG_NEXT
+            reg_eql: REG_DO_COMPARE(==) REG_NEXT
+            reg_neq: REG_DO_COMPARE(!=) REG_NEXT
+            reg_lss: REG_DO_COMPARE(<) REG_NEXT
+            reg_leq: REG_DO_COMPARE(<=) REG_NEXT
+            reg_gtr: REG_DO_COMPARE(>) REG_NEXT
+            reg_geq: REG_DO_COMPARE(>=) REG_NEXT
+            reg_even: REG_DO_EVEN REG_NEXT
+            reg_jeql: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) == REG_VALUE(instruction->b)) REG_NEXT
+            reg_jneq: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) != REG_VALUE(instruction->b)) REG_NEXT
+            reg_jlss: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) < REG_VALUE(instruction->b)) REG_NEXT
+            reg_jleq: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) <= REG_VALUE(instruction->b)) REG_NEXT
+            reg_jgtr: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) > REG_VALUE(instruction->b)) REG_NEXT
+            reg_jgeq: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) >= REG_VALUE(instruction->b)) REG_NEXT
+            reg_jeven: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) % 2 == 0) REG_NEXT
+            reg_jz: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) != 0) REG_NEXT
+            reg_jmp: REG_DO_JUMP_UNLESS(0) REG_NEXT
+            reg_out: REG_DO_OUT REG_NEXT
+            reg_read: REG_DO_READ REG_NEXT
+            reg_cal: REG_DO_CAL REG_NEXT
+            reg_rtn: REG_DO_RTN REG_NEXT
+            reg_clear: REG_CLEAR_SLOTS REG_NEXT
+            reg_end:
+                return;
+
+            #undef REG_NEXT
+
+        #else
+            for(;;)
+            {
+                instruction = &registerProgram[ip++];
+
+                switch(instruction->op)
+                {
+                    case REG_MOV: REG_DO_MOV break;
+                    case REG_ADD: REG_DO_OPERATION(ADD_VALUES) break;
+                    case REG_SUB: REG_DO_OPERATION(SUB_VALUES) break;
+                    case REG_MUL: REG_DO_OPERATION(MUL_VALUES) break;
+                    case REG_DIV: REG_DO_OPERATION(DIV_VALUES) break;
+                    case REG_EQL: REG_DO_COMPARE(==) break;
+                    case REG_NEQ: REG_DO_COMPARE(!=) break;
+                    case REG_LSS: REG_DO_COMPARE(<) break;
+                    case REG_LEQ: REG_DO_COMPARE(<=) break;
+                    case REG_GTR: REG_DO_COMPARE(>) break;
+                    case REG_GEQ: REG_DO_COMPARE(>=) break;
+                    case REG_EVEN: REG_DO_EVEN break;
+                    case REG_JEQL: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) == REG_VALUE(instruction->b)) break;
+                    case REG_JNEQ: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) != REG_VALUE(instruction->b)) break;
+                    case REG_JLSS: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) < REG_VALUE(instruction->b)) break;
+                    case REG_JLEQ: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) <= REG_VALUE(instruction->b)) break;
+                    case REG_JGTR: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) > REG_VALUE(instruction->b)) break;
+                    case REG_JGEQ: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) >= REG_VALUE(instruction->b)) break;
+                    case REG_JEVEN: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) % 2 == 0) break;
+                    case REG_JZ: REG_DO_JUMP_UNLESS(REG_VALUE(instruction->a) != 0) break;
+                    case REG_JMP: REG_DO_JUMP_UNLESS(0) break;
+                    case REG_OUT: REG_DO_OUT break;
+                    case REG_READ: REG_DO_READ break;
+                    case REG_CAL: REG_DO_CAL break;
+                    case REG_RTN: REG_DO_RTN break;
+                    case REG_CLEAR: REG_CLEAR_SLOTS break;
+                    default:
+                        return;
+                }
+            }
+        #endif
+    }
+
+    /*
+        Print how the last run was translated, or why it ran on the stack
+            engine
+    */
+    void report_registers(Vm *vm)
+    {
+        if(vm->registerRan)
+        {
+            fprintf(stderr, "Register engine: %d stack instructions translated into %d\n",
+                vm->programCount, vm->registerCount);
+        }
+        else
+        {
+            fprintf(stderr, "Register engine: not used (%s)\n",
+                vm->registerFailure ? vm->registerFailure : "trace");
+        }
+    }
+
+    void free_registers(Vm *vm)
+    {
+        free(vm->registerProgram);
+        free(vm->registerIndex);
+        free(vm->lazy);
+    }